@@ -0,0 +1,206 @@
+// crc32.c - CRC-32 engines for MiniVSFS, all bit-compatible with polynomial 0xEDB88320
+//
+//   slice8 : slicing-by-8 tables, portable fallback (8 bytes per iteration)
+//   pclmul : x86-64 carry-less multiply folding, picked at runtime via cpuid
+//   armv8  : ARMv8 CRC32 instructions, when the compiler targets them
+#define _FILE_OFFSET_BITS 64
+#include <string.h>
+#include "crc32.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define CRC32_HAVE_PCLMUL 1
+#include <immintrin.h>
+#endif
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#define CRC32_HAVE_ARMV8 1
+#include <arm_acle.h>
+#endif
+
+#define CRC32_POLY 0xEDB88320u
+
+static uint32_t CRC32_TAB[8][256];
+static uint32_t CRC32_X2N[32];          // x^(2^k) mod P, for crc32_zeros()
+
+typedef uint32_t (*crc32_fn)(uint32_t state, const uint8_t *p, size_t n);
+static crc32_fn crc32_engine;
+static const char *crc32_engine_name = "slice8";
+
+// ========================== Table engine ==========================
+// All engines work on the raw register (pre/post inversion done by callers).
+static uint32_t crc32_bytes(uint32_t c, const uint8_t *p, size_t n){
+    for(size_t i=0;i<n;i++) c = CRC32_TAB[0][(c^p[i])&0xFF] ^ (c>>8);
+    return c;
+}
+
+static uint32_t crc32_slice8(uint32_t c, const uint8_t *p, size_t n){
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while(n>=8){
+        uint32_t lo, hi;
+        memcpy(&lo,p,4); memcpy(&hi,p+4,4);
+        lo ^= c;
+        c = CRC32_TAB[7][ lo      &0xFF] ^ CRC32_TAB[6][(lo>> 8)&0xFF] ^
+            CRC32_TAB[5][(lo>>16)&0xFF] ^ CRC32_TAB[4][ lo>>24      ] ^
+            CRC32_TAB[3][ hi      &0xFF] ^ CRC32_TAB[2][(hi>> 8)&0xFF] ^
+            CRC32_TAB[1][(hi>>16)&0xFF] ^ CRC32_TAB[0][ hi>>24      ];
+        p+=8; n-=8;
+    }
+#endif
+    return crc32_bytes(c,p,n);
+}
+
+// ========================== PCLMULQDQ engine ==========================
+#ifdef CRC32_HAVE_PCLMUL
+// Folding constants for the reflected 0xEDB88320 polynomial, from Intel's
+// "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ" paper.
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_fold_pclmul(uint32_t c, const uint8_t *p, size_t n){
+    // requires n >= 64 and n % 16 == 0
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596LL, 0x0154442bd4LL);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009eLL, 0x01751997d0LL);
+    const __m128i k5k0 = _mm_set_epi64x(0x0000000000LL, 0x0163cd6124LL);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641LL, 0x01db710641LL);
+    const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+    x1 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)c));
+    p += 64; n -= 64;
+
+    // fold 4 x 128 bits in parallel
+    while(n >= 64){
+        x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)(p + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *)(p + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *)(p + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *)(p + 0x30)));
+        p += 64; n -= 64;
+    }
+
+    // fold the four lanes into one
+    x0 = k3k4;
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    // remaining 16-byte blocks
+    while(n >= 16){
+        x2 = _mm_loadu_si128((const __m128i *)p);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        p += 16; n -= 16;
+    }
+
+    // 128 -> 64 bits
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, mask32);
+    x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32 bits
+    x2 = _mm_and_si128(x1, mask32);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+    x2 = _mm_and_si128(x2, mask32);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+
+static uint32_t crc32_pclmul(uint32_t c, const uint8_t *p, size_t n){
+    if(n >= 64){
+        size_t chunk = n & ~(size_t)15;
+        c = crc32_fold_pclmul(c, p, chunk);
+        p += chunk; n -= chunk;
+    }
+    return crc32_slice8(c, p, n);
+}
+#endif
+
+// ========================== ARMv8 CRC engine ==========================
+#ifdef CRC32_HAVE_ARMV8
+static uint32_t crc32_armv8(uint32_t c, const uint8_t *p, size_t n){
+    while(n>=8){ uint64_t v; memcpy(&v,p,8); c=__crc32d(c,v); p+=8; n-=8; }
+    while(n>0){ c=__crc32b(c,*p++); n--; }
+    return c;
+}
+#endif
+
+// ========================== Zero extension ==========================
+// Multiplication modulo P in the reflected domain (as in zlib's crc32_combine).
+static uint32_t multmodp(uint32_t a, uint32_t b){
+    uint32_t m = 1u<<31, r = 0;
+    for(;;){
+        if(a & m){ r ^= b; if((a & (m-1)) == 0) break; }
+        m >>= 1;
+        b = (b & 1) ? (b>>1) ^ CRC32_POLY : b>>1;
+    }
+    return r;
+}
+
+// ========================== Public API ==========================
+void crc32_init(void){
+    for(uint32_t i=0;i<256;i++){
+        uint32_t c=i;
+        for(int j=0;j<8;j++) c = (c&1)?(CRC32_POLY^(c>>1)):(c>>1);
+        CRC32_TAB[0][i]=c;
+    }
+    for(uint32_t i=0;i<256;i++){
+        for(int t=1;t<8;t++) CRC32_TAB[t][i] = CRC32_TAB[0][CRC32_TAB[t-1][i]&0xFF] ^ (CRC32_TAB[t-1][i]>>8);
+    }
+    uint32_t p = 1u<<30;                 // x^1
+    CRC32_X2N[0] = p;
+    for(int k=1;k<32;k++) CRC32_X2N[k] = p = multmodp(p,p);
+
+    crc32_engine = crc32_slice8;
+    crc32_engine_name = "slice8";
+#ifdef CRC32_HAVE_PCLMUL
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")){
+        crc32_engine = crc32_pclmul;
+        crc32_engine_name = "pclmul";
+    }
+#endif
+#ifdef CRC32_HAVE_ARMV8
+    crc32_engine = crc32_armv8;
+    crc32_engine_name = "armv8";
+#endif
+}
+
+uint32_t crc32_update(uint32_t crc, const void *data, size_t n){
+    return ~crc32_engine(~crc, (const uint8_t *)data, n);
+}
+
+uint32_t crc32(const void *data, size_t n){
+    return crc32_update(0, data, n);
+}
+
+uint32_t crc32_zeros(uint32_t crc, uint64_t n){
+    // appending zero bytes multiplies the raw register by x^(8n) mod P
+    uint32_t xn = 1u<<31;                // x^0
+    unsigned k = 3;                      // 8n = n * 2^3
+    while(n){
+        if(n & 1) xn = multmodp(CRC32_X2N[k & 31], xn);
+        n >>= 1; k++;
+    }
+    return ~multmodp(xn, ~crc);
+}
+
+const char *crc32_impl(void){ return crc32_engine_name; }
@@ -0,0 +1,25 @@
+// crc32.h - CRC-32 (IEEE 802.3, reflected polynomial 0xEDB88320) used by MiniVSFS
+#ifndef MINIVSFS_CRC32_H
+#define MINIVSFS_CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Builds the lookup tables and selects the fastest engine for this CPU.
+// Must be called once before any other crc32_* function.
+void crc32_init(void);
+
+// One-shot CRC of a buffer; identical to the original byte-at-a-time crc32().
+uint32_t crc32(const void *data, size_t n);
+
+// Continues a CRC: crc32_update(crc32(a, na), b, nb) == crc32(a||b, na+nb).
+// Start with crc = 0.
+uint32_t crc32_update(uint32_t crc, const void *data, size_t n);
+
+// Extends a CRC over n zero bytes without touching memory (O(log n)).
+uint32_t crc32_zeros(uint32_t crc, uint64_t n);
+
+// Name of the engine picked by crc32_init(): "pclmul", "armv8", "slice8".
+const char *crc32_impl(void);
+
+#endif
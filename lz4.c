@@ -0,0 +1,116 @@
+// lz4.c - LZ4 block compressor and decoder for MiniVSFS
+//
+// Greedy single-probe hash matcher (as in the reference LZ4 fast mode): one
+// 4096-entry table of positions, skipping ahead faster the longer no match is
+// found, so incompressible input costs little. The decoder checks every
+// length and offset against its buffers.
+#define _FILE_OFFSET_BITS 64
+#include <stdint.h>
+#include <string.h>
+#include "lz4.h"
+
+#define LZ4_MINMATCH 4
+#define LZ4_HASH_LOG 12
+#define LZ4_LAST_LITERALS 5     // the block always ends with this many literals
+#define LZ4_MFLIMIT 12          // ... and no match starts in its last 12 bytes
+#define LZ4_MAX_OFFSET 65535
+#define LZ4_SKIP_TRIGGER 6      // miss count doubling the search step
+
+static inline uint32_t read32(const uint8_t *p){ uint32_t v; memcpy(&v,p,4); return v; }
+static inline uint32_t lz4_hash(uint32_t v){ return (v*2654435761u) >> (32-LZ4_HASH_LOG); }
+
+// Appends the 255-run encoding of len (the part past the 4-bit token field).
+static uint8_t *put_len(uint8_t *op, size_t len){
+    while(len >= 255){ *op++ = 255; len -= 255; }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+// ========================== Compressor ==========================
+size_t lz4_compress(const void *src, size_t n, void *dst, size_t cap){
+    const uint8_t *const base = src, *const iend = base + n;
+    const uint8_t *ip = base, *anchor = base;
+    uint8_t *op = dst, *const oend = op + cap;
+    uint32_t tab[1u<<LZ4_HASH_LOG];
+    if(n > UINT32_MAX) return 0;
+
+    if(n > LZ4_MFLIMIT){
+        const uint8_t *const mflimit = iend - LZ4_MFLIMIT, *const mlimit = iend - LZ4_LAST_LITERALS;
+        memset(tab,0,sizeof(tab));     // position 0: a wrong guess is caught by the compare
+        unsigned misses = 1u << LZ4_SKIP_TRIGGER;
+        ip++;
+        while(ip < mflimit){
+            const uint32_t h = lz4_hash(read32(ip));
+            const uint8_t *ref = base + tab[h];
+            tab[h] = (uint32_t)(ip - base);
+            if(ref >= ip || ip - ref > LZ4_MAX_OFFSET || read32(ref) != read32(ip)){
+                ip += misses++ >> LZ4_SKIP_TRIGGER;
+                continue;
+            }
+            misses = 1u << LZ4_SKIP_TRIGGER;
+
+            const uint8_t *mend = ip + LZ4_MINMATCH, *r = ref + LZ4_MINMATCH;
+            while(mend < mlimit && *mend == *r){ mend++; r++; }
+            while(ip > anchor && ref > base && ip[-1] == ref[-1]){ ip--; ref--; }
+
+            const size_t lit = (size_t)(ip - anchor), ml = (size_t)(mend - ip) - LZ4_MINMATCH;
+            if((size_t)(oend - op) < 1 + lit/255 + 1 + lit + 2 + ml/255 + 1) return 0;
+            uint8_t *tok = op++;
+            *tok = (uint8_t)((lit >= 15 ? 15 : lit) << 4 | (ml >= 15 ? 15 : ml));
+            if(lit >= 15) op = put_len(op, lit-15);
+            memcpy(op, anchor, lit); op += lit;
+            const size_t off = (size_t)(ip - ref);
+            *op++ = (uint8_t)off; *op++ = (uint8_t)(off >> 8);
+            if(ml >= 15) op = put_len(op, ml-15);
+            ip = anchor = mend;
+            if(ip < mflimit) tab[lz4_hash(read32(ip-2))] = (uint32_t)(ip - 2 - base);
+        }
+    }
+
+    // last literals
+    const size_t lit = (size_t)(iend - anchor);
+    if((size_t)(oend - op) < 1 + lit/255 + 1 + lit) return 0;
+    uint8_t *tok = op++;
+    *tok = (uint8_t)((lit >= 15 ? 15 : lit) << 4);
+    if(lit >= 15) op = put_len(op, lit-15);
+    memcpy(op, anchor, lit); op += lit;
+    return (size_t)(op - (uint8_t *)dst);
+}
+
+// ========================== Decoder ==========================
+// Reads the 255-run continuation of a length; 0 on truncated input.
+static int get_len(const uint8_t **ip, const uint8_t *iend, size_t *len){
+    uint8_t b;
+    do {
+        if(*ip >= iend) return 0;
+        b = *(*ip)++;
+        *len += b;
+    } while(b == 255);
+    return 1;
+}
+
+size_t lz4_decompress(const void *src, size_t n, void *dst, size_t cap){
+    const uint8_t *ip = src, *const iend = ip + n;
+    uint8_t *const ostart = dst, *op = ostart, *const oend = op + cap;
+    while(ip < iend){
+        const unsigned tok = *ip++;
+        size_t lit = tok >> 4;
+        if(lit == 15 && !get_len(&ip, iend, &lit)) return 0;
+        if((size_t)(iend - ip) < lit || (size_t)(oend - op) < lit) return 0;
+        memcpy(op, ip, lit); op += lit; ip += lit;
+        if(ip == iend) break;          // the last sequence has no match
+
+        if(iend - ip < 2) return 0;
+        const size_t off = (size_t)ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        if(off == 0 || off > (size_t)(op - ostart)) return 0;
+        size_t ml = tok & 15;
+        if(ml == 15 && !get_len(&ip, iend, &ml)) return 0;
+        ml += LZ4_MINMATCH;
+        if((size_t)(oend - op) < ml) return 0;
+        const uint8_t *m = op - off;
+        if(off >= ml){ memcpy(op, m, ml); op += ml; }
+        else while(ml--) *op++ = *m++;  // overlapping copy repeats the last off bytes
+    }
+    return (size_t)(op - ostart);
+}
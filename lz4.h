@@ -0,0 +1,16 @@
+// lz4.h - LZ4 block format (no frame), used by MiniVSFS compressed clusters
+#ifndef MINIVSFS_LZ4_H
+#define MINIVSFS_LZ4_H
+
+#include <stddef.h>
+
+// Compresses src[0..n) into dst. Returns the compressed size, or 0 if that
+// would exceed cap (the caller then stores the data as is). Any stock LZ4
+// block decoder reads the output.
+size_t lz4_compress(const void *src, size_t n, void *dst, size_t cap);
+
+// Decodes an LZ4 block of n bytes into dst. Returns the decoded size, or 0 if
+// the input is malformed or would write past cap.
+size_t lz4_decompress(const void *src, size_t n, void *dst, size_t cap);
+
+#endif
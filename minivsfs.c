@@ -0,0 +1,3252 @@
+// minivsfs.c - shared MiniVSFS core used by mkfs_builder, mkfs_adder and other tools
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE            // copy_file_range()
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "minivsfs.h"
+#include "lz4.h"
+
+// ========================== Errors ==========================
+static _Thread_local char vsfs_errbuf[256];
+
+static int vsfs_fail(const char *fmt, ...){
+    va_list ap; va_start(ap,fmt);
+    vsnprintf(vsfs_errbuf,sizeof(vsfs_errbuf),fmt,ap);
+    va_end(ap);
+    return -1;
+}
+// like perror(): "<what>: <strerror(errno)>"
+static int vsfs_fail_errno(const char *what){
+    return vsfs_fail("%s: %s",what,strerror(errno));
+}
+
+const char *vsfs_last_error(void){ return vsfs_errbuf; }
+
+// ========================== Statistics ==========================
+enum { STAT_IMAGE_READ, STAT_IMAGE_WRITE, STAT_HOST_READ, STAT_INODES, STAT_BLOCKS, STAT_BITMAP_WORDS, STAT_CRC, STAT_N };
+static atomic_int stats_on;
+static atomic_uint_fast64_t stats[STAT_N];
+
+static inline void stat_add(int which, uint64_t n){
+    if(atomic_load_explicit(&stats_on,memory_order_relaxed))
+        atomic_fetch_add_explicit(&stats[which],n,memory_order_relaxed);
+}
+
+void vsfs_stats_enable(int on){ atomic_store(&stats_on,on!=0); }
+
+void vsfs_stats_reset(void){
+    for(int i=0;i<STAT_N;i++) atomic_store(&stats[i],0);
+}
+
+void vsfs_stats_get(vsfs_stats_t *out){
+    out->image_read_bytes  = atomic_load(&stats[STAT_IMAGE_READ]);
+    out->image_write_bytes = atomic_load(&stats[STAT_IMAGE_WRITE]);
+    out->host_read_bytes   = atomic_load(&stats[STAT_HOST_READ]);
+    out->inodes_allocated  = atomic_load(&stats[STAT_INODES]);
+    out->blocks_allocated  = atomic_load(&stats[STAT_BLOCKS]);
+    out->bitmap_words      = atomic_load(&stats[STAT_BITMAP_WORDS]);
+    out->crc_bytes         = atomic_load(&stats[STAT_CRC]);
+}
+
+// crc32() and crc32_update() for everything the library checksums
+static uint32_t crc_of(const void *p, size_t n){ stat_add(STAT_CRC,n); return crc32(p,n); }
+static uint32_t crc_more(uint32_t c, const void *p, size_t n){ stat_add(STAT_CRC,n); return crc32_update(c,p,n); }
+
+// ========================== Checksums ==========================
+uint32_t superblock_crc_finalize(superblock_t *sb) {
+    sb->checksum = 0;
+    // spec: crc over exactly one block minus its last 4 bytes; everything past the
+    // struct is zero, so extend over the padding instead of hashing a stack block
+    uint32_t s = crc32_zeros(crc_of(sb, sizeof(*sb)), BS - 4 - sizeof(*sb));
+    sb->checksum = s;
+    return s;
+}
+uint32_t superblock_crc_finalize_ext(superblock_t *sb, const vsfs_sb_ext_t *ext){
+    if(!ext) return superblock_crc_finalize(sb);
+    sb->checksum = 0;
+    uint32_t s = crc32_zeros(crc_of(sb, sizeof(*sb)), VSFS_SB_EXT_OFFSET - sizeof(*sb));
+    s = crc_more(s, ext, sizeof(*ext));
+    s = crc32_zeros(s, BS - 4 - VSFS_SB_EXT_OFFSET - sizeof(*ext));
+    sb->checksum = s;
+    return s;
+}
+void inode_crc_finalize(inode_t* ino){
+    // bytes [120..127] hold the crc itself and are excluded
+    ino->inode_crc = (uint64_t)crc_of(ino, 120);
+}
+static uint8_t dirent_xor(const dirent64_t *de){
+    const uint8_t* p = (const uint8_t*)de;
+    uint8_t x = 0;
+    for (int i = 0; i < 63; i++) x ^= p[i];   // covers ino(4) + type(1) + name(58)
+    return x;
+}
+void dirent_checksum_finalize(dirent64_t* de) {
+    de->checksum = dirent_xor(de);
+}
+
+static void journal_hdr_crc_finalize(vsfs_journal_hdr_t *h){
+    h->crc = 0;
+    h->crc = crc_of(h, sizeof(*h));
+}
+
+// Verification against the stored values (the image itself is not changed).
+static int superblock_ok(const uint8_t *blk){
+    superblock_t sb;
+    memcpy(&sb, blk, sizeof(sb));
+    const uint32_t want = sb.checksum;
+    sb.checksum = 0;
+    // the real padding bytes, not crc32_zeros(): anything non-zero there is corruption too
+    return crc_more(crc_of(&sb, sizeof(sb)), blk + sizeof(sb), BS - 4 - sizeof(sb)) == want;
+}
+static int inode_ok(const uint8_t *slot){
+    uint32_t want;
+    memcpy(&want, slot + offsetof(inode_t, inode_crc), sizeof(want));
+    return crc_of(slot, 120) == want;
+}
+static int journal_hdr_ok(const vsfs_journal_hdr_t *h){
+    vsfs_journal_hdr_t c = *h;
+    return h->magic == VSFS_JOURNAL_MAGIC && (journal_hdr_crc_finalize(&c), c.crc == h->crc);
+}
+
+// ========================== Bitmaps ==========================
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static inline uint64_t load_word(const uint8_t *bm, uint64_t w){
+    uint64_t v; memcpy(&v, bm + w*8, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);       // bit i of the word must be bit i%8 of byte i/8
+#endif
+    return v;
+}
+
+// invert!=0 searches for a clear bit, else for a set bit
+static uint64_t bitmap_scan(const uint8_t *bm, uint64_t nbits, uint64_t start, int invert){
+    if(start >= nbits) return nbits;
+    const uint64_t nwords = (nbits + 63) / 64;
+    const uint64_t skip = invert ? ~0ull : 0;   // word value that holds no candidate
+    uint64_t w = start / 64, idx = nbits;
+    uint64_t v = (load_word(bm, w) ^ skip) & (~0ull << (start % 64));
+    while(!v){
+        if(++w >= nwords) goto out;
+#ifdef __SSE2__
+        // skip 32 uninteresting bytes per step on long full/empty stretches
+        const __m128i sk = _mm_set1_epi8((char)(skip & 0xFF));
+        while(w + 4 <= nwords){
+            __m128i a = _mm_loadu_si128((const __m128i *)(bm + w*8));
+            __m128i b = _mm_loadu_si128((const __m128i *)(bm + w*8 + 16));
+            __m128i eq = _mm_and_si128(_mm_cmpeq_epi8(a, sk), _mm_cmpeq_epi8(b, sk));
+            if(_mm_movemask_epi8(eq) != 0xFFFF) break;
+            w += 4;
+        }
+        if(w >= nwords) goto out;
+#endif
+        v = load_word(bm, w) ^ skip;
+    }
+    idx = w*64 + (uint64_t)__builtin_ctzll(v);
+    if(idx > nbits) idx = nbits;
+out:
+    stat_add(STAT_BITMAP_WORDS, (w < nwords ? w+1 : nwords) - start/64);
+    return idx;
+}
+
+uint64_t bitmap_find_zero(const uint8_t *bm, uint64_t nbits, uint64_t start){ return bitmap_scan(bm, nbits, start, 1); }
+uint64_t bitmap_find_one(const uint8_t *bm, uint64_t nbits, uint64_t start){ return bitmap_scan(bm, nbits, start, 0); }
+
+// Number of set bits in bm[0..nbits) (whole-word storage, as above).
+static uint64_t bitmap_count(const uint8_t *bm, uint64_t nbits){
+    uint64_t n = 0, w = 0;
+    for(; w < nbits/64; w++) n += (uint64_t)__builtin_popcountll(load_word(bm, w));
+    if(nbits % 64) n += (uint64_t)__builtin_popcountll(load_word(bm, w) & ((1ull << (nbits % 64)) - 1));
+    return n;
+}
+
+// ========================== Formatting ==========================
+// Blocks taken by d data blocks plus their bitmap and `tables` per-block
+// tables of 4-byte entries (data crc, refcount).
+static uint64_t table_layout_cost(uint64_t d, uint64_t tables){
+    return d + (d + 8u*BS - 1)/(8u*BS) + tables*((d + CRCS_PER_BLOCK - 1)/CRCS_PER_BLOCK);
+}
+
+int vsfs_layout(const vsfs_format_opts_t *opts, superblock_t *sb, vsfs_sb_ext_t *ext){
+    const uint64_t total_blocks = (opts->size_kib * 1024u) / BS; // size_kib / 4
+    if(total_blocks < 8) return vsfs_fail("image too small");
+    if(opts->features & ~VSFS_FEAT_KNOWN) return vsfs_fail("unknown feature flags 0x%x", opts->features);
+    if(opts->inodes == 0 || opts->inodes > UINT32_MAX) return vsfs_fail("inode count must be 1..%u", UINT32_MAX);
+    if((opts->features & VSFS_FEAT_DEDUP) && (opts->features & VSFS_FEAT_EXTENTS))
+        return vsfs_fail("deduplication needs block-mapped files (no extents)");
+    if((opts->features & VSFS_FEAT_COMPRESS) && (opts->features & VSFS_FEAT_EXTENTS))
+        return vsfs_fail("compression needs block-mapped files (no extents)");
+    const uint64_t cluster_kib = opts->cluster_kib ? opts->cluster_kib : VSFS_CLUSTER_KIB_DEFAULT;
+    if(cluster_kib < 8 || cluster_kib > 1024 || (cluster_kib & (cluster_kib-1)))
+        return vsfs_fail("cluster size must be a power of two from 8 to 1024 KiB");
+
+    // Layout:
+    // 0: superblock
+    // [1 .. ]: inode bitmap, ceil(inodes / 32768) blocks
+    // [..]   : data bitmap, enough blocks for one bit per data-region block
+    // [..]   : inode table, ceil(inode_count*128 / 4096) blocks
+    // [..]   : VSFS_FEAT_DATA_CRC only: data crc table, one uint32_t per data block
+    // [..]   : VSFS_FEAT_DEDUP only: refcount table, one uint32_t per data block
+    // [..]   : VSFS_FEAT_JOURNAL only: journal header + transaction area
+    // [data_region_start .. end]: data blocks
+    const uint64_t bits_per_block    = 8u * BS;
+    const uint64_t inode_bm_blocks   = (opts->inodes + bits_per_block - 1) / bits_per_block;
+    const uint64_t inode_tbl_blocks  = (opts->inodes * INODE_SIZE + BS - 1)/BS;
+    const uint64_t fixed             = 1 + inode_bm_blocks + inode_tbl_blocks;
+    if(fixed + 2 > total_blocks)
+        return vsfs_fail("Not enough space for data region (increase --size-kib or reduce --inodes)");
+    uint64_t journal_blocks          = 0;
+    if(opts->features & VSFS_FEAT_JOURNAL){
+        const uint64_t avail = total_blocks - fixed;
+        journal_blocks = opts->journal_blocks;
+        if(journal_blocks == 0){
+            journal_blocks = avail/8 < 1024 ? avail/8 : 1024;
+            if(journal_blocks < VSFS_JOURNAL_MIN_BLOCKS) journal_blocks = VSFS_JOURNAL_MIN_BLOCKS;
+        }
+        if(journal_blocks < VSFS_JOURNAL_MIN_BLOCKS) return vsfs_fail("journal needs at least %u blocks", VSFS_JOURNAL_MIN_BLOCKS);
+        if(journal_blocks + 2 > avail)
+            return vsfs_fail("Not enough space for data region (increase --size-kib or reduce --journal-blocks)");
+    }
+    // each data bitmap block covers 32768 data blocks and costs one itself:
+    // smallest d with d*32768 >= total - fixed - d
+    const uint64_t rest              = total_blocks - fixed - journal_blocks;
+    uint64_t data_bm_blocks          = (rest + bits_per_block) / (bits_per_block + 1);
+    uint64_t crc_blocks              = 0;
+    uint64_t ref_blocks              = 0;
+    const uint64_t tables = ((opts->features & VSFS_FEAT_DATA_CRC) != 0) + ((opts->features & VSFS_FEAT_DEDUP) != 0);
+    if(tables){
+        // largest data count d with d + ceil(d/32768) + tables*ceil(d/1024) <= rest,
+        // starting from the real-valued solution; rounding slack goes to the last table
+        uint64_t d = (uint64_t)((double)rest * bits_per_block * CRCS_PER_BLOCK /
+                                ((double)bits_per_block * CRCS_PER_BLOCK + tables*bits_per_block + CRCS_PER_BLOCK));
+        while(d > 0 && table_layout_cost(d,tables) > rest) d--;
+        while(table_layout_cost(d+1,tables) <= rest) d++;
+        data_bm_blocks = (d + bits_per_block - 1)/bits_per_block;
+        const uint64_t left = rest - d - data_bm_blocks;
+        if(opts->features & VSFS_FEAT_DEDUP){
+            crc_blocks = (opts->features & VSFS_FEAT_DATA_CRC) ? (d + CRCS_PER_BLOCK - 1)/CRCS_PER_BLOCK : 0;
+            ref_blocks = left - crc_blocks;
+        } else {
+            crc_blocks = left;
+        }
+    }
+
+    const uint64_t inode_bitmap_start = 1;
+    const uint64_t data_bitmap_start  = inode_bitmap_start + inode_bm_blocks;
+    const uint64_t inode_table_start  = data_bitmap_start + data_bm_blocks;
+    const uint64_t crc_table_start    = inode_table_start + inode_tbl_blocks;
+    const uint64_t ref_table_start    = crc_table_start + crc_blocks;
+    const uint64_t journal_start      = ref_table_start + ref_blocks;
+    const uint64_t data_region_start  = journal_start + journal_blocks;
+
+    if(data_region_start >= total_blocks)
+        return vsfs_fail("Not enough space for data region (increase --size-kib or reduce --inodes)");
+    const uint64_t data_region_blocks = total_blocks - data_region_start;
+    if(data_region_blocks > UINT32_MAX) return vsfs_fail("data region exceeds 2^32 blocks");
+
+    memset(sb, 0, sizeof(*sb));
+    sb->magic               = VSFS_MAGIC;
+    sb->version             = VSFS_VERSION;
+    sb->block_size          = BS;
+    sb->total_blocks        = total_blocks;
+
+    sb->inode_count         = opts->inodes;
+    sb->inode_bitmap_start  = inode_bitmap_start;
+    sb->inode_bitmap_blocks = inode_bm_blocks;
+    sb->data_bitmap_start   = data_bitmap_start;
+    sb->data_bitmap_blocks  = data_bm_blocks;
+    sb->inode_table_start   = inode_table_start;
+    sb->inode_table_blocks  = inode_tbl_blocks;
+    sb->data_region_start   = data_region_start;
+    sb->data_region_blocks  = data_region_blocks;
+
+    sb->root_inode          = ROOT_INO; // 1
+    sb->flags               = opts->features;
+
+    memset(ext, 0, sizeof(*ext));
+    if(crc_blocks){
+        ext->crc_table_start  = crc_table_start;
+        ext->crc_table_blocks = crc_blocks;
+    }
+    if(ref_blocks){
+        ext->ref_table_start  = ref_table_start;
+        ext->ref_table_blocks = ref_blocks;
+    }
+    if(journal_blocks){
+        ext->journal_start  = journal_start;
+        ext->journal_blocks = journal_blocks;
+    }
+    if(opts->features & VSFS_FEAT_COMPRESS) ext->cluster_blocks = cluster_kib*1024u/BS;
+    ext->free_blocks = data_region_blocks - 1;    // the root directory block
+    ext->free_inodes = opts->inodes - 1;          // the root inode
+    return 0;
+}
+
+// The only blocks of a fresh image that are not all zero, in disk order.
+enum { FMT_SB, FMT_INODE_BM, FMT_DATA_BM, FMT_INODE_TBL, FMT_CRC_TBL, FMT_JOURNAL, FMT_ROOT_DIR, FMT_NBLOCKS };
+
+int vsfs_format(const char *path, const vsfs_format_opts_t *opts, superblock_t *sb_out, vsfs_sb_ext_t *ext_out){
+    superblock_t sb;
+    vsfs_sb_ext_t ext;
+    if(vsfs_layout(opts, &sb, &ext)!=0) return -1;
+
+    // Build the first block of each metadata region plus the root directory
+    // block; every other block of the image is zero and is never buffered.
+    uint8_t *blk = calloc(FMT_NBLOCKS, BS);
+    if(!blk) return vsfs_fail_errno("calloc image");
+    const uint64_t where[FMT_NBLOCKS] = {
+        0, sb.inode_bitmap_start, sb.data_bitmap_start, sb.inode_table_start, ext.crc_table_start,
+        ext.journal_start, sb.data_region_start
+    };
+    // regions the image does not have are not written
+    const int has_crc = (sb.flags & VSFS_FEAT_DATA_CRC) != 0;
+    const int has_jnl = (sb.flags & VSFS_FEAT_JOURNAL) != 0;
+
+    uint64_t now = opts->fixed_time ? opts->epoch : (uint64_t)time(NULL);
+
+    // ---------------- Bitmaps ----------------
+    // Mark inode #1 (root) allocated -> bit index 0
+    bit_set(blk + FMT_INODE_BM*BS, 0);
+    // Root directory takes the first data block.
+    // Convention: direct[] stores RELATIVE data-region index, so root uses index 0
+    bit_set(blk + FMT_DATA_BM*BS, 0);
+
+    // ---------------- Root inode ----------------
+    inode_t root;
+    memset(&root, 0, sizeof(root));
+    root.mode       = VSFS_MODE_DIR;
+    root.links      = 2;      // "." and ".."
+    root.size_bytes = 2 * sizeof(dirent64_t); // two entries
+    root.atime = root.mtime = root.ctime = now;
+    root.direct[0]  = 0;   // RELATIVE index into data region (0 => first data block)
+    inode_crc_finalize(&root);
+    memcpy(blk + FMT_INODE_TBL*BS + (ROOT_INO-1)*INODE_SIZE, &root, sizeof(root));
+
+    // ---------------- Root directory data block ----------------
+    uint8_t* root_block = blk + FMT_ROOT_DIR*BS;
+    dirent64_t de;
+    memset(&de, 0, sizeof(de));
+    de.inode_no = ROOT_INO; de.type = VSFS_DT_DIR;
+    strncpy(de.name, ".", sizeof(de.name)-1);
+    dirent_checksum_finalize(&de);
+    memcpy(root_block + 0*sizeof(dirent64_t), &de, sizeof(de));
+    // ".." points to itself in root
+    memset(&de, 0, sizeof(de));
+    de.inode_no = ROOT_INO; de.type = VSFS_DT_DIR;
+    strncpy(de.name, "..", sizeof(de.name)-1);
+    dirent_checksum_finalize(&de);
+    memcpy(root_block + 1*sizeof(dirent64_t), &de, sizeof(de));
+
+    // ---------------- Data crc table ----------------
+    if(has_crc){
+        uint32_t c = crc_of(root_block, BS);
+        memcpy(blk + FMT_CRC_TBL*BS, &c, sizeof(c));
+    }
+
+    // ---------------- Journal ----------------
+    if(has_jnl){
+        vsfs_journal_hdr_t jh = { .magic = VSFS_JOURNAL_MAGIC, .state = VSFS_JOURNAL_CLEAN };
+        journal_hdr_crc_finalize(&jh);
+        memcpy(blk + FMT_JOURNAL*BS, &jh, sizeof(jh));
+    }
+
+    // ---------------- Superblock ----------------
+    sb.mtime_epoch = now;
+    superblock_crc_finalize_ext(&sb, &ext);
+    memcpy(blk + FMT_SB*BS, &sb, sizeof(sb));
+    memcpy(blk + FMT_SB*BS + VSFS_SB_EXT_OFFSET, &ext, sizeof(ext));
+
+    // ---------------- Write image to disk ----------------
+    int fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+    if(fd<0){ free(blk); return vsfs_fail_errno("open image"); }
+    const uint64_t img_bytes = sb.total_blocks * (uint64_t)BS;
+    if(opts->sparse){
+        // size the file first: everything not written below stays a hole
+        if(ftruncate(fd, (off_t)img_bytes)!=0){ free(blk); close(fd); return vsfs_fail_errno("truncate image"); }
+        for(int i=0;i<FMT_NBLOCKS;i++){
+            if((i==FMT_CRC_TBL && !has_crc) || (i==FMT_JOURNAL && !has_jnl)) continue;
+            if(pwrite(fd, blk + (size_t)i*BS, BS, (off_t)(where[i]*BS)) != (ssize_t)BS){
+                free(blk); close(fd); return vsfs_fail_errno("write image");
+            }
+            stat_add(STAT_IMAGE_WRITE, BS);
+        }
+    } else {
+        // stream the whole image in order, zeros between the metadata blocks
+        static const uint8_t zero_chunk[64 * BS];
+        uint64_t b = 0;
+        for(int i=0;i<=FMT_NBLOCKS;i++){
+            if((i==FMT_CRC_TBL && !has_crc) || (i==FMT_JOURNAL && !has_jnl)) continue;
+            uint64_t upto = i<FMT_NBLOCKS ? where[i] : sb.total_blocks;
+            while(b < upto){
+                uint64_t n = upto - b > 64 ? 64 : upto - b;
+                if(write(fd, zero_chunk, (size_t)(n*BS)) != (ssize_t)(n*BS)){ free(blk); close(fd); return vsfs_fail_errno("write image"); }
+                stat_add(STAT_IMAGE_WRITE, n*BS);
+                b += n;
+            }
+            if(i<FMT_NBLOCKS){
+                if(write(fd, blk + (size_t)i*BS, BS) != (ssize_t)BS){ free(blk); close(fd); return vsfs_fail_errno("write image"); }
+                stat_add(STAT_IMAGE_WRITE, BS);
+                b++;
+            }
+        }
+    }
+    free(blk);
+    if(close(fd)!=0) return vsfs_fail_errno("close image");
+    if(sb_out) *sb_out = sb;
+    if(ext_out) *ext_out = ext;
+    return 0;
+}
+
+// ========================== Dentry cache ==========================
+// Directory path (normalised, relative to root) -> inode number, so a batch of
+// "a/b/c/*.o" resolves a/b/c once. Directories are never renamed, and removing
+// one (vsfs_unlink) drops the whole cache, so entries stay valid until then.
+typedef struct {
+    char *key;              // NULL = empty slot
+    uint32_t hash;
+    uint32_t ino;
+} dcache_ent_t;
+
+struct vsfs_dcache {
+    dcache_ent_t *ent;
+    size_t cap;             // power of two
+    size_t used;
+};
+
+static uint32_t path_hash(const char *p, size_t len){
+    uint32_t h=2166136261u;
+    for(size_t i=0;i<len;i++){ h^=(uint8_t)p[i]; h*=16777619u; }
+    return h;
+}
+
+static int dcache_get(vsfs_t *fs, const char *path, size_t len, uint32_t *ino){
+    const struct vsfs_dcache *dc=fs->dcache;
+    if(!dc) return 0;
+    const uint32_t h=path_hash(path,len);
+    for(size_t i=h&(dc->cap-1); dc->ent[i].key; i=(i+1)&(dc->cap-1)){
+        const dcache_ent_t *e=&dc->ent[i];
+        if(e->hash==h && strncmp(e->key,path,len)==0 && e->key[len]=='\0'){ *ino=e->ino; return 1; }
+    }
+    return 0;
+}
+
+// Best effort: on allocation failure the path is simply not cached.
+static void dcache_put(vsfs_t *fs, const char *path, size_t len, uint32_t ino){
+    struct vsfs_dcache *dc=fs->dcache;
+    if(!dc){
+        if(!(dc=fs->dcache=calloc(1,sizeof(*dc)))) return;
+    }
+    if((dc->used+1)*2 > dc->cap){
+        size_t ncap = dc->cap ? dc->cap*2 : 64;
+        dcache_ent_t *ne=calloc(ncap,sizeof(*ne));
+        if(!ne) return;
+        for(size_t i=0;i<dc->cap;i++){
+            if(!dc->ent[i].key) continue;
+            size_t j=dc->ent[i].hash&(ncap-1);
+            while(ne[j].key) j=(j+1)&(ncap-1);
+            ne[j]=dc->ent[i];
+        }
+        free(dc->ent);
+        dc->ent=ne; dc->cap=ncap;
+    }
+    char *key=malloc(len+1);
+    if(!key) return;
+    memcpy(key,path,len); key[len]='\0';
+    const uint32_t h=path_hash(path,len);
+    size_t i=h&(dc->cap-1);
+    while(dc->ent[i].key) i=(i+1)&(dc->cap-1);
+    dc->ent[i].key=key; dc->ent[i].hash=h; dc->ent[i].ino=ino;
+    dc->used++;
+}
+
+static void dcache_free(struct vsfs_dcache *dc){
+    if(!dc) return;
+    for(size_t i=0;i<dc->cap;i++) free(dc->ent[i].key);
+    free(dc->ent);
+    free(dc);
+}
+
+// ========================== File I/O ==========================
+// Reads count bytes at off into buf; a short file is an error.
+static int pread_full(int fd, void *buf, uint64_t count, uint64_t off){
+    uint8_t *p=buf;
+    while(count){
+        size_t chunk = count > (1u<<30) ? (1u<<30) : (size_t)count;
+        ssize_t n=pread(fd,p,chunk,(off_t)off);
+        if(n<0){ if(errno==EINTR) continue; return -1; }
+        if(n==0){ errno=EIO; return -1; }
+        p+=n; off+=(uint64_t)n; count-=(uint64_t)n;
+    }
+    return 0;
+}
+
+static int pwrite_full(int fd, const void *buf, uint64_t count, uint64_t off){
+    const uint8_t *p=buf;
+    while(count){
+        size_t chunk = count > (1u<<30) ? (1u<<30) : (size_t)count;
+        ssize_t n=pwrite(fd,p,chunk,(off_t)off);
+        if(n<0){ if(errno==EINTR) continue; return -1; }
+        stat_add(STAT_IMAGE_WRITE,(uint64_t)n);
+        p+=n; off+=(uint64_t)n; count-=(uint64_t)n;
+    }
+    return 0;
+}
+
+// pread_full() of host file contents
+static int host_read(int fd, void *buf, uint64_t count, uint64_t off){
+    if(pread_full(fd,buf,count,off)!=0) return -1;
+    stat_add(STAT_HOST_READ,count);
+    return 0;
+}
+
+static void *read_file_all(const char *path, size_t *out_size){
+    int fd=open(path,O_RDONLY);
+    if(fd<0) return NULL;
+    struct stat st;
+    if(fstat(fd,&st)!=0){ close(fd); return NULL; }
+    size_t s=(size_t)st.st_size;
+    void *buf=malloc(s ? s : 1);
+    if(!buf){ close(fd); return NULL; }
+    if(pread_full(fd,buf,s,0)!=0){ int e=errno; free(buf); close(fd); errno=e; return NULL; }
+    close(fd);
+    stat_add(STAT_IMAGE_READ,s);
+    *out_size=s;
+    return buf;
+}
+
+// ========================== Journal ==========================
+// An in-place journaled handle maps the image privately; the file changes only
+// in vsfs_commit(), which sorts the dirty blocks into
+//  - home: data blocks allocated by this transaction (nothing committed points
+//    at them yet) and crc table blocks whose changes are all for such blocks.
+//    These are written straight to their place before anything is logged;
+//  - logged: all other metadata and existing data-region blocks (directories,
+//    indexes, pointer blocks). These are written to the journal, committed,
+//    then copied home.
+// Frees are held back until the transaction commits, so a new block can never
+// be one the committed image still uses. With 4 KiB pages, file content skips
+// the mapping and goes straight into the file ("ondisk").
+struct vsfs_journal {
+    uint8_t *fresh;         // data-region bitmap: allocated by this transaction
+    uint8_t *ondisk;        // data-region bitmap: fresh and already written to the file
+    uint8_t *crc_logged;    // crc table blocks that changed for a committed data block
+    uint32_t *deferred;     // data blocks freed by this transaction
+    size_t ndeferred, cap;
+    uint64_t pending;       // logged blocks dirtied so far, crc table blocks aside
+    uint64_t capacity;      // most blocks one transaction can log
+    uint64_t seq;           // number of the open transaction
+    int direct;             // page size == BS: file content is written through the fd
+};
+
+enum { JNL_LOG, JNL_HOME, JNL_DONE };
+
+// Largest n with 1 header + ceil(n/512) descriptor blocks + n <= blocks.
+static uint64_t jnl_capacity(uint64_t blocks){
+    uint64_t n = (blocks-1)*JOURNAL_TAGS_PER_BLOCK/(JOURNAL_TAGS_PER_BLOCK+1);
+    while(n && 1 + (n+JOURNAL_TAGS_PER_BLOCK-1)/JOURNAL_TAGS_PER_BLOCK + n > blocks) n--;
+    return n;
+}
+
+static int jnl_direct(const vsfs_t *fs){ return fs->jnl && fs->jnl->direct; }
+
+// How the commit writes dirty block blk (crc table blocks: see data_crc_refresh()).
+static int jnl_kind(const vsfs_t *fs, uint64_t blk){
+    const struct vsfs_journal *j = fs->jnl;
+    if(blk >= fs->sb.data_region_start && blk < fs->sb.data_region_start + fs->sb.data_region_blocks){
+        const uint64_t rel = blk - fs->sb.data_region_start;
+        if(!bit_get(j->fresh,rel)) return JNL_LOG;
+        return bit_get(j->ondisk,rel) ? JNL_DONE : JNL_HOME;
+    }
+    if(fs->crc_tbl && blk >= fs->sbx.crc_table_start && blk < fs->sbx.crc_table_start + fs->sbx.crc_table_blocks)
+        return bit_get(j->crc_logged, blk - fs->sbx.crc_table_start) ? JNL_LOG : JNL_HOME;
+    return JNL_LOG;
+}
+
+// Next run [*b, *e) of dirty blocks of one kind at or after `from`; 0 at the end.
+static int jnl_next_run(const vsfs_t *fs, uint64_t from, int kind, uint64_t *b, uint64_t *e){
+    const uint64_t n = fs->sb.total_blocks;
+    for(uint64_t s=bitmap_find_one(fs->dirty,n,from); s<n; s=bitmap_find_one(fs->dirty,n,s+1)){
+        if(jnl_kind(fs,s)!=kind) continue;
+        uint64_t t=s+1;
+        while(t<n && bit_get(fs->dirty,t) && jnl_kind(fs,t)==kind) t++;
+        *b=s; *e=t;
+        return 1;
+    }
+    return 0;
+}
+
+static int jnl_sync(vsfs_t *fs){ return fdatasync(fs->fd)==0 ? 0 : vsfs_fail_errno("fdatasync image"); }
+
+static int jnl_write_hdr(vsfs_t *fs, uint32_t state, uint64_t seq, uint64_t nblocks, uint32_t body_crc){
+    vsfs_journal_hdr_t h = { VSFS_JOURNAL_MAGIC, state, seq, nblocks, body_crc, 0 };
+    journal_hdr_crc_finalize(&h);
+    if(pwrite_full(fs->fd,&h,sizeof(h),fs->sbx.journal_start*BS)!=0) return vsfs_fail_errno("write journal header");
+    return 0;
+}
+
+// Replays a transaction that committed but may not have reached home: in place
+// into the file, otherwise into the private copy only. A committed header over
+// a body that fails its crc is stale (the next transaction had started
+// overwriting the journal after a checkpoint) and is ignored.
+static int jnl_recover(vsfs_t *fs, uint64_t *seq){
+    const uint64_t js = fs->sbx.journal_start;
+    vsfs_journal_hdr_t h;
+    memcpy(&h, fs->img + js*BS, sizeof(h));
+    if(!journal_hdr_ok(&h)) return vsfs_fail("journal header checksum mismatch");
+    *seq = h.seq;
+    if(h.state != VSFS_JOURNAL_COMMITTED || h.nblocks == 0 || h.nblocks > fs->sbx.journal_blocks) return 0;
+    const uint64_t ndesc = (h.nblocks + JOURNAL_TAGS_PER_BLOCK-1)/JOURNAL_TAGS_PER_BLOCK;
+    if(1 + ndesc + h.nblocks > fs->sbx.journal_blocks) return 0;
+    const uint8_t *tags = fs->img + (js+1)*BS, *src = tags + ndesc*BS;
+    if(crc_of(tags, (size_t)((ndesc + h.nblocks)*BS)) != h.body_crc) return 0;
+
+    for(uint64_t i=0;i<h.nblocks;i++){
+        uint64_t home;
+        memcpy(&home, tags + i*sizeof(home), sizeof(home));
+        if(home >= fs->sb.total_blocks || (home >= js && home < js + fs->sbx.journal_blocks))
+            return vsfs_fail("journal entry %" PRIu64 " has bad home block %" PRIu64, i, home);
+    }
+    for(uint64_t i=0;i<h.nblocks;i++, src+=BS){
+        uint64_t home;
+        memcpy(&home, tags + i*sizeof(home), sizeof(home));
+        if(fs->mode!=VSFS_OPEN_INPLACE) memcpy(fs->img + home*BS, src, BS);
+        else if(pwrite_full(fs->fd, src, BS, home*BS)!=0) return vsfs_fail_errno("journal replay");
+    }
+    fs->replayed = h.nblocks;
+    // a private copy may be written out as a new image: it must not replay again
+    h.state = VSFS_JOURNAL_CLEAN; h.seq++; h.nblocks = 0; h.body_crc = 0;
+    journal_hdr_crc_finalize(&h);
+    if(fs->mode!=VSFS_OPEN_INPLACE) memcpy(fs->img + js*BS, &h, sizeof(h));
+    else if(jnl_sync(fs)!=0 || jnl_write_hdr(fs,h.state,h.seq,0,0)!=0 || jnl_sync(fs)!=0) return -1;
+    *seq = h.seq;
+    return 0;
+}
+
+static int jnl_init(vsfs_t *fs, uint64_t seq){
+    struct vsfs_journal *j = calloc(1,sizeof(*j));
+    if(!j) return vsfs_fail_errno("calloc journal");
+    fs->jnl = j;    // freed by vsfs_close()
+    // whole 64-bit words, like the dirty map
+    const size_t words = (size_t)((fs->sb.data_region_blocks+63)/64*8);
+    j->fresh = calloc(1,words);
+    j->ondisk = calloc(1,words);
+    j->crc_logged = calloc(1,(size_t)(fs->sbx.crc_table_blocks/8+1));
+    if(!j->fresh || !j->ondisk || !j->crc_logged) return vsfs_fail_errno("calloc journal maps");
+    j->capacity = jnl_capacity(fs->sbx.journal_blocks);
+    j->seq = seq;
+    j->direct = sysconf(_SC_PAGESIZE)==BS;
+    return 0;
+}
+
+static void jnl_free(struct vsfs_journal *j){
+    if(!j) return;
+    free(j->fresh); free(j->ondisk); free(j->crc_logged); free(j->deferred);
+    free(j);
+}
+
+static void data_block_release(vsfs_t *fs, uint32_t rel){
+    if(!bit_get(fs->data_bm,rel)) return;   // keeps free_blocks exact on a doubly referenced block
+    bit_clear(fs->data_bm,rel);
+    fs->sbx.free_blocks++;
+    bit_clear(fs->verified, fs->sb.data_region_start + rel);   // may be reused as anything
+    vsfs_mark_dirty(fs, fs->sb.data_bitmap_start + rel/(8*BS));
+    if(rel < fs->data_hint) fs->data_hint = rel;
+}
+
+static void jnl_defer_free(vsfs_t *fs, uint32_t rel){
+    struct vsfs_journal *j = fs->jnl;
+    if(j->ndeferred==j->cap){
+        size_t cap = j->cap ? j->cap*2 : 256;
+        uint32_t *d = realloc(j->deferred, cap*sizeof(*d));
+        if(!d) return;  // the block stays allocated: leaked, never unsafe
+        j->deferred = d; j->cap = cap;
+    }
+    j->deferred[j->ndeferred++] = rel;
+}
+
+static void jnl_release_deferred(vsfs_t *fs){
+    struct vsfs_journal *j = fs->jnl;
+    for(size_t i=0;i<j->ndeferred;i++) data_block_release(fs,j->deferred[i]);
+    j->ndeferred = 0;
+}
+
+// Maps the pages of every dirty block from the file again, dropping their
+// private copies once the file holds the same bytes.
+static int jnl_remap_dirty(vsfs_t *fs){
+    const uint64_t n = fs->sb.total_blocks;
+    const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    for(uint64_t b=bitmap_find_one(fs->dirty,n,0); b<n; ){
+        uint64_t e = bitmap_find_zero(fs->dirty,n,b);
+        size_t start = (size_t)(b*BS) & ~(page-1);
+        size_t end = ((size_t)(e*BS) + page-1) & ~(page-1);
+        if(end > fs->img_size) end = fs->img_size;
+        if(mmap(fs->img+start, end-start, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_FIXED, fs->fd, (off_t)start)==MAP_FAILED)
+            return vsfs_fail_errno("mmap image");
+        b = bitmap_find_one(fs->dirty,n,e);
+    }
+    return 0;
+}
+
+static int jnl_commit(vsfs_t *fs){
+    struct vsfs_journal *j = fs->jnl;
+    const uint64_t js = fs->sbx.journal_start;
+    uint64_t b, e, nlog = 0;
+    for(uint64_t at=0; jnl_next_run(fs,at,JNL_LOG,&b,&e); at=e) nlog += e-b;
+    if(nlog > j->capacity)
+        return vsfs_fail("transaction needs %" PRIu64 " journal blocks, journal holds %" PRIu64, nlog, j->capacity);
+
+    // 1. new blocks go straight home
+    for(uint64_t at=0; jnl_next_run(fs,at,JNL_HOME,&b,&e); at=e)
+        if(pwrite_full(fs->fd, fs->img + b*BS, (e-b)*BS, b*BS)!=0) return vsfs_fail_errno("write image");
+
+    // 2. descriptors and block images, synced, then the commit record
+    const uint64_t ndesc = (nlog + JOURNAL_TAGS_PER_BLOCK-1)/JOURNAL_TAGS_PER_BLOCK;
+    uint64_t *tags = calloc((size_t)ndesc, BS);
+    if(!tags) return vsfs_fail_errno("calloc journal descriptors");
+    uint64_t k = 0;
+    for(uint64_t at=0; jnl_next_run(fs,at,JNL_LOG,&b,&e); at=e) for(uint64_t x=b;x<e;x++) tags[k++] = x;
+    uint32_t body = crc_of(tags, (size_t)(ndesc*BS));
+    int rc = pwrite_full(fs->fd, tags, ndesc*BS, (js+1)*BS);
+    free(tags);
+    uint64_t jblk = js + 1 + ndesc;
+    for(uint64_t at=0; rc==0 && jnl_next_run(fs,at,JNL_LOG,&b,&e); at=e){
+        body = crc_more(body, fs->img + b*BS, (size_t)((e-b)*BS));
+        rc = pwrite_full(fs->fd, fs->img + b*BS, (e-b)*BS, jblk*BS);
+        jblk += e-b;
+    }
+    if(rc!=0) return vsfs_fail_errno("write journal");
+    if(jnl_sync(fs)!=0 || jnl_write_hdr(fs,VSFS_JOURNAL_COMMITTED,j->seq,nlog,body)!=0 || jnl_sync(fs)!=0) return -1;
+
+    // 3. checkpoint; a crash from here on replays the journal instead
+    for(uint64_t at=0; jnl_next_run(fs,at,JNL_LOG,&b,&e); at=e)
+        if(pwrite_full(fs->fd, fs->img + b*BS, (e-b)*BS, b*BS)!=0) return vsfs_fail_errno("write image");
+    // the clean header needs no sync: replaying a checkpointed transaction is harmless
+    if(jnl_sync(fs)!=0 || jnl_write_hdr(fs,VSFS_JOURNAL_CLEAN,j->seq+1,0,0)!=0) return -1;
+    j->seq++;
+
+    if(jnl_remap_dirty(fs)!=0) return -1;
+    const size_t words = (size_t)((fs->sb.data_region_blocks+63)/64*8);
+    memset(j->fresh,0,words);
+    memset(j->ondisk,0,words);
+    memset(j->crc_logged,0,(size_t)(fs->sbx.crc_table_blocks/8+1));
+    j->pending = 0;
+    return 0;
+}
+
+// Commits early when the open transaction could outgrow the journal. Each
+// logged data block can drag a crc table block along (hence 2x), and half
+// the journal stays free for the operation about to start.
+static int jnl_reserve(vsfs_t *fs){
+    if(!fs->jnl || fs->jnl->pending*4 < fs->jnl->capacity) return 0;
+    return vsfs_commit(fs);
+}
+
+// ========================== Dedup index ==========================
+// Open-addressing hash of data blocks by crc32: each slot packs crc<<32 | rel,
+// 0 is empty (block 0 is the root directory, never a file block). Entries are
+// hints: a hit is only used once the block content compares equal.
+#define DEDUP_GONE UINT32_MAX   // rel of a deleted slot
+
+struct vsfs_dedup {
+    pthread_mutex_t lock;   // the index, and every metadata change of a concurrent import
+    uint64_t *slot;
+    uint64_t cap, used;     // cap is a power of two; used counts deleted slots too
+};
+
+static void dedup_free(struct vsfs_dedup *d){
+    if(!d) return;
+    pthread_mutex_destroy(&d->lock);
+    free(d->slot);
+    free(d);
+}
+
+// Doubles the table, dropping deleted slots.
+static int dedup_grow(struct vsfs_dedup *d){
+    const uint64_t cap = d->cap ? d->cap*2 : 1024;
+    uint64_t *slot = calloc((size_t)cap,sizeof(*slot));
+    if(!slot) return -1;
+    uint64_t used = 0;
+    for(uint64_t i=0;i<d->cap;i++){
+        const uint64_t v = d->slot[i];
+        if(!v || (uint32_t)v==DEDUP_GONE) continue;
+        uint64_t h = (v>>32) & (cap-1);
+        while(slot[h]) h = (h+1) & (cap-1);
+        slot[h] = v; used++;
+    }
+    free(d->slot);
+    d->slot = slot; d->cap = cap; d->used = used;
+    return 0;
+}
+
+// Best effort: without memory the block just is not offered for sharing.
+static void dedup_insert(struct vsfs_dedup *d, uint32_t crc, uint32_t rel){
+    if((d->used+1)*2 > d->cap && dedup_grow(d)!=0) return;
+    uint64_t h = crc & (d->cap-1);
+    while(d->slot[h]) h = (h+1) & (d->cap-1);
+    d->slot[h] = (uint64_t)crc<<32 | rel;
+    d->used++;
+}
+
+// An indexed data block holding exactly buf, or 0.
+static uint32_t dedup_find(vsfs_t *fs, uint32_t crc, const uint8_t *buf){
+    const struct vsfs_dedup *d = fs->dedup;
+    if(!d->cap) return 0;
+    for(uint64_t h = crc & (d->cap-1); d->slot[h]; h = (h+1) & (d->cap-1)){
+        const uint64_t v = d->slot[h];
+        const uint32_t rel = (uint32_t)v;
+        if((uint32_t)(v>>32)!=crc || rel==DEDUP_GONE || rel >= fs->sb.data_region_blocks) continue;
+        if(fs->ref_tbl[rel]==UINT32_MAX || !bit_get(fs->data_bm,rel)) continue;
+        if(memcmp(vsfs_data_block(fs,rel),buf,BS)==0) return rel;
+    }
+    return 0;
+}
+
+static void dedup_forget_key(struct vsfs_dedup *d, uint32_t crc, uint32_t rel){
+    for(uint64_t h = crc & (d->cap-1); d->slot[h]; h = (h+1) & (d->cap-1))
+        if(d->slot[h] == ((uint64_t)crc<<32 | rel)) d->slot[h] = (uint64_t)crc<<32 | DEDUP_GONE;
+}
+
+// Deletes the entries of a block about to be freed: it may come back as a
+// directory or pointer block, which must never be shared.
+static void dedup_forget(vsfs_t *fs, uint32_t rel){
+    struct vsfs_dedup *d = fs->dedup;
+    if(!d->cap) return;
+    dedup_forget_key(d, crc_of(vsfs_data_block(fs,rel),BS), rel);
+    if(fs->crc_tbl) dedup_forget_key(d, fs->crc_tbl[rel], rel);  // seeded from a stale table
+}
+
+// ========================== Image handle ==========================
+// The time stamped into inodes and the superblock.
+static uint64_t vsfs_now(const vsfs_t *fs){ return fs->fixed_time ? fs->epoch : (uint64_t)time(NULL); }
+
+int vsfs_source_date_epoch(uint64_t *epoch){
+    const char *v = getenv("SOURCE_DATE_EPOCH");
+    if(!v || !*v) return 0;
+    char *end=NULL; errno=0;
+    unsigned long long t = strtoull(v,&end,10);
+    if(errno || *end || v[0]=='-') return vsfs_fail("SOURCE_DATE_EPOCH is not a number of seconds: '%s'",v);
+    *epoch = (uint64_t)t;
+    return 1;
+}
+
+// 1 if a region of n blocks at s lies in front of the data region (at or after
+// `after`), or past it at or after *tail, which then moves to its end.
+static int table_place_ok(const vsfs_t *fs, uint64_t s, uint64_t n, uint64_t after, uint64_t *tail){
+    if(s >= fs->sb.data_region_start + fs->sb.data_region_blocks){
+        if(s < *tail || s + n > fs->sb.total_blocks) return 0;
+        *tail = s + n;
+        return 1;
+    }
+    return s >= after && s + n <= fs->sb.data_region_start;
+}
+
+// Copies the superblock out of block 0 and checks it against the image.
+static int sb_load(vsfs_t *fs){
+    memcpy(&fs->sb,fs->img,sizeof(fs->sb));
+    memcpy(&fs->sbx,fs->img+VSFS_SB_EXT_OFFSET,sizeof(fs->sbx));
+    if(fs->sb.magic != VSFS_MAGIC) return vsfs_fail("bad magic");
+    if(fs->sb.version < 1 || fs->sb.version > VSFS_VERSION) return vsfs_fail("unsupported superblock version %u",fs->sb.version);
+    if(fs->sb.block_size != BS) return vsfs_fail("unsupported block size %u",fs->sb.block_size);
+    if(fs->sb.flags & ~VSFS_FEAT_KNOWN) return vsfs_fail("unsupported feature flags 0x%x",fs->sb.flags & ~VSFS_FEAT_KNOWN);
+    if(fs->sb.total_blocks > fs->img_size/BS)
+        return vsfs_fail("image truncated (superblock says %" PRIu64 " blocks)",fs->sb.total_blocks);
+    if(!superblock_ok(fs->img)) return vsfs_fail("superblock checksum mismatch");
+    if(fs->sb.data_region_start + fs->sb.data_region_blocks > fs->sb.total_blocks ||
+       fs->sb.inode_table_start + fs->sb.inode_table_blocks > fs->sb.data_region_start ||
+       fs->sb.inode_count > fs->sb.inode_table_blocks*(BS/INODE_SIZE) ||
+       fs->sb.inode_count > fs->sb.inode_bitmap_blocks*8u*BS ||
+       fs->sb.data_region_blocks > fs->sb.data_bitmap_blocks*8u*BS)
+        return vsfs_fail("inconsistent superblock layout");
+    // the data bitmap and per-block tables: in front of the data region as
+    // formatted, or past its end (in that order) once vsfs_resize() moved them
+    uint64_t front = fs->sb.inode_table_start + fs->sb.inode_table_blocks, tail = fs->sb.data_region_start + fs->sb.data_region_blocks;
+    if(!table_place_ok(fs,fs->sb.data_bitmap_start,fs->sb.data_bitmap_blocks,1,&tail))
+        return vsfs_fail("inconsistent superblock layout");
+    if((fs->sb.flags & VSFS_FEAT_DATA_CRC) &&
+       (fs->sbx.crc_table_blocks*CRCS_PER_BLOCK < fs->sb.data_region_blocks ||
+        !table_place_ok(fs,fs->sbx.crc_table_start,fs->sbx.crc_table_blocks,front,&tail)))
+        return vsfs_fail("inconsistent data crc table layout");
+    if((fs->sb.flags & VSFS_FEAT_DATA_CRC) && fs->sbx.crc_table_start < fs->sb.data_region_start)
+        front = fs->sbx.crc_table_start + fs->sbx.crc_table_blocks;
+    if((fs->sb.flags & VSFS_FEAT_DEDUP) &&
+       (fs->sbx.ref_table_blocks*CRCS_PER_BLOCK < fs->sb.data_region_blocks ||
+        !table_place_ok(fs,fs->sbx.ref_table_start,fs->sbx.ref_table_blocks,front,&tail)))
+        return vsfs_fail("inconsistent refcount table layout");
+    if((fs->sb.flags & VSFS_FEAT_DEDUP) && fs->sbx.ref_table_start < fs->sb.data_region_start)
+        front = fs->sbx.ref_table_start + fs->sbx.ref_table_blocks;
+    if((fs->sb.flags & VSFS_FEAT_COMPRESS) &&
+       (fs->sbx.cluster_blocks < 2 || fs->sbx.cluster_blocks > 256 || (fs->sbx.cluster_blocks & (fs->sbx.cluster_blocks-1))))
+        return vsfs_fail("bad compression cluster size (%" PRIu64 " blocks)",fs->sbx.cluster_blocks);
+    if((fs->sb.flags & VSFS_FEAT_JOURNAL) &&
+       (fs->sbx.journal_start < front ||
+        fs->sbx.journal_blocks < VSFS_JOURNAL_MIN_BLOCKS ||
+        fs->sbx.journal_start + fs->sbx.journal_blocks > fs->sb.data_region_start))
+        return vsfs_fail("inconsistent journal layout");
+    if(fs->sb.version < 2){
+        // counted once here; the next commit stores them and makes the image version 2
+        fs->sbx.free_blocks = fs->sb.data_region_blocks - bitmap_count(fs->img + fs->sb.data_bitmap_start*BS, fs->sb.data_region_blocks);
+        fs->sbx.free_inodes = fs->sb.inode_count - bitmap_count(fs->img + fs->sb.inode_bitmap_start*BS, fs->sb.inode_count);
+        fs->sb.version = VSFS_VERSION;
+    } else if(fs->sbx.free_blocks > fs->sb.data_region_blocks || fs->sbx.free_inodes > fs->sb.inode_count){
+        return vsfs_fail("inconsistent free counters");
+    }
+    return 0;
+}
+
+int vsfs_open(vsfs_t *fs, const char *path, int mode){
+    memset(fs,0,sizeof(*fs));
+    fs->fd=-1; fs->mode=mode;
+    if(mode==VSFS_OPEN_COPY){
+        fs->img = read_file_all(path,&fs->img_size);
+        if(!fs->img) return vsfs_fail_errno("reading input image");
+    } else {
+        int fd=open(path, mode==VSFS_OPEN_INPLACE ? O_RDWR : O_RDONLY);
+        if(fd<0) return vsfs_fail_errno("open image");
+        struct stat st;
+        if(fstat(fd,&st)!=0){ close(fd); return vsfs_fail_errno("stat image"); }
+        if((uint64_t)st.st_size < BS){ close(fd); return vsfs_fail("input image too small"); }
+        int prot = PROT_READ | (mode==VSFS_OPEN_INPLACE ? PROT_WRITE : 0);
+        void *m=mmap(NULL,(size_t)st.st_size,prot,MAP_SHARED,fd,0);
+        if(m==MAP_FAILED){ close(fd); return vsfs_fail_errno("mmap image"); }
+        fs->img=m; fs->img_size=(size_t)st.st_size; fs->fd=fd;
+    }
+    if(fs->img_size < BS){ vsfs_close(fs); return vsfs_fail("input image too small"); }
+    if(sb_load(fs)!=0){ vsfs_close(fs); return -1; }
+
+    uint64_t seq=0;
+    if(fs->sb.flags & VSFS_FEAT_JOURNAL){
+        // private and writable in every mode: replay and the open transaction live in memory
+        if(fs->fd>=0 && mmap(fs->img,fs->img_size,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_FIXED,fs->fd,0)==MAP_FAILED){
+            vsfs_fail_errno("mmap image"); vsfs_close(fs); return -1;
+        }
+        if(jnl_recover(fs,&seq)!=0){ vsfs_close(fs); return -1; }
+        if(fs->replayed && sb_load(fs)!=0){ vsfs_close(fs); return -1; }
+    }
+
+    fs->inode_bm    = fs->img + fs->sb.inode_bitmap_start * BS;
+    fs->data_bm     = fs->img + fs->sb.data_bitmap_start  * BS;
+    fs->inode_tbl   = fs->img + fs->sb.inode_table_start * BS;
+    fs->data_region = fs->img + fs->sb.data_region_start * BS;
+    if(fs->sb.flags & VSFS_FEAT_DATA_CRC) fs->crc_tbl = (uint32_t *)(fs->img + fs->sbx.crc_table_start * BS);
+    if(fs->sb.flags & VSFS_FEAT_DEDUP) fs->ref_tbl = (uint32_t *)(fs->img + fs->sbx.ref_table_start * BS);
+
+    // block maps are whole 64-bit words so the bitmap scanners can walk them
+    const size_t map_bytes=(size_t)((fs->sb.total_blocks+63)/64*8);
+    fs->verified=calloc(1,map_bytes);
+    if(!fs->verified){ vsfs_close(fs); return vsfs_fail_errno("calloc verified map"); }
+    if(mode!=VSFS_OPEN_RDONLY){
+        fs->dirty=calloc(1,map_bytes);
+        if(!fs->dirty){ vsfs_close(fs); return vsfs_fail_errno("calloc dirty map"); }
+    }
+    if(mode==VSFS_OPEN_INPLACE && (fs->sb.flags & VSFS_FEAT_JOURNAL) && jnl_init(fs,seq)!=0){ vsfs_close(fs); return -1; }
+    return 0;
+}
+
+void vsfs_close(vsfs_t *fs){
+    if(fs->fd>=0){
+        if(fs->img) munmap(fs->img,fs->img_size);
+        close(fs->fd);
+    } else {
+        free(fs->img);
+    }
+    free(fs->dirty);
+    free(fs->verified);
+    jnl_free(fs->jnl);
+    dedup_free(fs->dedup);
+    dcache_free(fs->dcache);
+    memset(fs,0,sizeof(*fs));
+    fs->fd=-1;
+}
+
+void vsfs_mark_dirty(vsfs_t *fs, uint64_t blk){
+    if(!fs->dirty) return;
+    if(fs->jnl && !bit_get(fs->dirty,blk) && jnl_kind(fs,blk)==JNL_LOG) fs->jnl->pending++;
+    bit_set(fs->dirty,blk);
+}
+
+void vsfs_mark_dirty_range(vsfs_t *fs, const void *p, size_t len){
+    if(!fs->dirty || len==0) return;
+    uint64_t off=(uint64_t)((const uint8_t *)p-fs->img);
+    for(uint64_t b=off/BS;b<=(off+len-1)/BS;b++) vsfs_mark_dirty(fs,b);
+}
+
+static int any_dirty(const vsfs_t *fs){
+    if(!fs->dirty) return 0;
+    for(uint64_t i=0;i<(fs->sb.total_blocks+7)/8;i++) if(fs->dirty[i]) return 1;
+    return 0;
+}
+
+// Flushes only the dirty blocks of an in-place image, coalesced into page-aligned runs.
+static int sync_dirty(vsfs_t *fs){
+    uint64_t nblocks=fs->sb.total_blocks;
+    size_t page=(size_t)sysconf(_SC_PAGESIZE);
+    for(uint64_t b=0;b<nblocks;){
+        if(!bit_get(fs->dirty,b)){ b++; continue; }
+        uint64_t e=b;
+        while(e<nblocks && bit_get(fs->dirty,e)) e++;
+        size_t start=(size_t)(b*BS) & ~(page-1);
+        size_t end=(size_t)(e*BS);
+        if(end>fs->img_size) end=fs->img_size;
+        if(msync(fs->img+start,end-start,MS_SYNC)!=0) return vsfs_fail_errno("msync image");
+        stat_add(STAT_IMAGE_WRITE,end-start);
+        b=e;
+    }
+    return 0;
+}
+
+// Recomputes the table entry of every dirty data-region block: its crc32 if the
+// block is allocated, 0 if it is free. Under a journal, a table block holding
+// only changes for blocks new in this transaction is safe to write home early;
+// one changed for a committed block has to be logged.
+static void data_crc_refresh(vsfs_t *fs){
+    const uint64_t first=fs->sb.data_region_start, end=first+fs->sb.data_region_blocks;
+    for(uint64_t b=bitmap_find_one(fs->dirty,end,first); b<end; b=bitmap_find_one(fs->dirty,end,b+1)){
+        const uint32_t rel=(uint32_t)(b-first);
+        const uint32_t c = bit_get(fs->data_bm,rel) ? crc_of(vsfs_data_block(fs,rel),BS) : 0;
+        if(fs->jnl && fs->crc_tbl[rel]!=c && !bit_get(fs->jnl->fresh,rel))
+            bit_set(fs->jnl->crc_logged, (uint64_t)rel/CRCS_PER_BLOCK);
+        fs->crc_tbl[rel] = c;
+        vsfs_mark_dirty_range(fs,&fs->crc_tbl[rel],sizeof(uint32_t));
+    }
+}
+
+int vsfs_commit(vsfs_t *fs){
+    if(fs->mode==VSFS_OPEN_RDONLY) return vsfs_fail("image opened read-only");
+    if(fs->jnl) jnl_release_deferred(fs);
+    if(!any_dirty(fs)) return 0;
+    if(fs->crc_tbl) data_crc_refresh(fs);
+    fs->sb.mtime_epoch=vsfs_now(fs);
+    superblock_crc_finalize_ext(&fs->sb,&fs->sbx);
+    memcpy(fs->img,&fs->sb,sizeof(fs->sb));
+    memcpy(fs->img+VSFS_SB_EXT_OFFSET,&fs->sbx,sizeof(fs->sbx));
+    vsfs_mark_dirty(fs,0);
+    if(fs->jnl){ if(jnl_commit(fs)!=0) return -1; }
+    else if(fs->mode==VSFS_OPEN_INPLACE && sync_dirty(fs)!=0) return -1;
+    memset(fs->dirty,0,(size_t)((fs->sb.total_blocks+63)/64*8));
+    return 0;
+}
+
+// Whether image block b reads as zeros in a written copy: a free data block,
+// whatever it still holds, or one that is all zeros.
+static int block_hole(const vsfs_t *fs, uint64_t b){
+    const uint64_t drs=fs->sb.data_region_start;
+    if(b>=drs && b-drs<fs->sb.data_region_blocks && !bit_get(fs->data_bm,b-drs)) return 1;
+    const uint64_t *w=(const uint64_t *)(fs->img + b*BS);
+    for(size_t i=0;i<BS/sizeof(*w);i++) if(w[i]) return 0;
+    return 1;
+}
+
+// Writes the image as a sparse file: runs of blocks that are not holes are
+// written where they go, and the file is then extended to the full size.
+int vsfs_write_image(vsfs_t *fs, const char *path){
+    int fd=open(path,O_WRONLY|O_CREAT|O_TRUNC,0666);
+    if(fd<0) return vsfs_fail_errno("open output");
+    const uint64_t nblocks=fs->img_size/BS;
+    for(uint64_t b=0;b<nblocks;){
+        if(block_hole(fs,b)){ b++; continue; }
+        uint64_t e=b+1;
+        while(e<nblocks && !block_hole(fs,e)) e++;
+        if(pwrite_full(fd,fs->img + b*BS,(e-b)*BS,b*BS)!=0){ close(fd); return vsfs_fail_errno("write output"); }
+        b=e;
+    }
+    if(fs->img_size%BS && pwrite_full(fd,fs->img + nblocks*BS,fs->img_size%BS,nblocks*BS)!=0){
+        close(fd); return vsfs_fail_errno("write output");
+    }
+    if(ftruncate(fd,(off_t)fs->img_size)!=0){ close(fd); return vsfs_fail_errno("truncate output"); }
+    if(close(fd)!=0) return vsfs_fail_errno("close output");
+    return 0;
+}
+
+// ========================== Inodes ==========================
+// The first read of an inode-table block checks the crc of every allocated
+// inode in it. If one does not match (or was allocated but not written yet),
+// the block stays unverified and only the inode asked for is checked, so one
+// bad inode does not make its neighbours unreadable.
+static int inode_verify(vsfs_t *fs, uint32_t ino){
+    const uint64_t per_block = BS/INODE_SIZE, idx = ino-1u;
+    const uint64_t blk = fs->sb.inode_table_start + idx/per_block;
+    if(bit_get(fs->verified,blk)) return 0;
+    int all_ok = 1;
+    for(uint64_t i=idx-idx%per_block; i<idx-idx%per_block+per_block && i<fs->sb.inode_count; i++){
+        if(!bit_get(fs->inode_bm,i) || inode_ok(fs->inode_tbl + i*INODE_SIZE)) continue;
+        if(i==idx) return vsfs_fail("inode %u checksum mismatch",ino);
+        all_ok = 0;
+    }
+    if(all_ok) bit_set(fs->verified,blk);
+    return 0;
+}
+
+int vsfs_inode_get(vsfs_t *fs, uint32_t ino, inode_t *out){
+    if(ino==0 || ino>fs->sb.inode_count) return vsfs_fail("inode %u out of range",ino);
+    if(inode_verify(fs,ino)!=0) return -1;
+    memcpy(out, fs->inode_tbl + (uint64_t)(ino-1)*INODE_SIZE, INODE_SIZE);
+    return 0;
+}
+
+int vsfs_inode_put(vsfs_t *fs, uint32_t ino, inode_t *in){
+    if(ino==0 || ino>fs->sb.inode_count) return vsfs_fail("inode %u out of range",ino);
+    inode_crc_finalize(in);
+    uint8_t *slot = fs->inode_tbl + (uint64_t)(ino-1)*INODE_SIZE;
+    memcpy(slot, in, INODE_SIZE);
+    vsfs_mark_dirty_range(fs, slot, INODE_SIZE);
+    return 0;
+}
+
+// ========================== Allocation ==========================
+// Both allocators are first-fit (lowest free index, as before) but start the
+// word scan at a hint below which every bit is known to be set, so sequential
+// fills cost O(1) words per allocation instead of rescanning from bit 0.
+int vsfs_alloc_inode(vsfs_t *fs, uint32_t *ino){
+    if(fs->sbx.free_inodes==0) return vsfs_fail("no free inode");
+    uint64_t i = bitmap_find_zero(fs->inode_bm, fs->sb.inode_count, fs->inode_hint);
+    if(i >= fs->sb.inode_count){ fs->inode_hint = fs->sb.inode_count; return vsfs_fail("no free inode"); }
+    bit_set(fs->inode_bm,i);
+    fs->sbx.free_inodes--;
+    stat_add(STAT_INODES,1);
+    vsfs_mark_dirty(fs, fs->sb.inode_bitmap_start + i/(8*BS));
+    fs->inode_hint = i+1;
+    *ino=(uint32_t)(i+1);
+    return 0;
+}
+
+// Searches [from, to) for a free run of at least n blocks. best!=0 keeps going
+// to find the smallest such run. Returns the run start or UINT64_MAX.
+static uint64_t find_run(vsfs_t *fs, uint64_t from, uint64_t to, uint64_t n, int best){
+    uint64_t pick=UINT64_MAX, pick_len=UINT64_MAX;
+    while(from < to){
+        uint64_t s = bitmap_find_zero(fs->data_bm, to, from);
+        if(s >= to) break;
+        uint64_t e = bitmap_find_one(fs->data_bm, to, s);
+        uint64_t len = e - s;
+        if(len >= n && len < pick_len){
+            pick = s; pick_len = len;
+            if(!best || len == n) break;
+        }
+        from = e;
+    }
+    return pick;
+}
+
+// Contiguous search according to the allocation policy; UINT64_MAX if no run fits.
+static uint64_t find_contig(vsfs_t *fs, uint64_t n){
+    const uint64_t nbits = fs->sb.data_region_blocks;
+    if(fs->alloc_policy==VSFS_ALLOC_BEST_FIT) return find_run(fs, fs->data_hint, nbits, n, 1);
+    uint64_t rover = fs->data_rover > fs->data_hint ? fs->data_rover : fs->data_hint;
+    uint64_t s = find_run(fs, rover, nbits, n, 0);
+    // wrap: a run may also straddle the rover, so search up to rover+n-1
+    if(s==UINT64_MAX) s = find_run(fs, fs->data_hint, rover+n-1 < nbits ? rover+n-1 : nbits, n, 0);
+    return s;
+}
+
+static void take_blocks(vsfs_t *fs, const uint32_t *out, uint64_t n){
+    for(uint64_t k=0;k<n;k++){
+        bit_set(fs->data_bm,out[k]);
+        if(fs->jnl) bit_set(fs->jnl->fresh,out[k]);
+        vsfs_mark_dirty(fs, fs->sb.data_bitmap_start + out[k]/(8*BS));
+    }
+    fs->sbx.free_blocks -= n;
+    stat_add(STAT_BLOCKS,n);
+}
+
+// Marks [s, s+n) allocated and advances the hint and rover past it.
+static void take_run(vsfs_t *fs, uint64_t s, uint64_t n){
+    for(uint64_t b=s; b<s+n; b++){
+        bit_set(fs->data_bm,b);
+        if(fs->jnl) bit_set(fs->jnl->fresh,b);
+    }
+    for(uint64_t blk=s/(8*BS); blk<=(s+n-1)/(8*BS); blk++) vsfs_mark_dirty(fs, fs->sb.data_bitmap_start + blk);
+    fs->sbx.free_blocks -= n;
+    stat_add(STAT_BLOCKS,n);
+    if(s==fs->data_hint) fs->data_hint = bitmap_find_zero(fs->data_bm, fs->sb.data_region_blocks, s+n);
+    fs->data_rover = s+n;
+}
+
+int vsfs_alloc_run(vsfs_t *fs, uint64_t want, uint32_t *start, uint32_t *len){
+    const uint64_t nbits = fs->sb.data_region_blocks;
+    if(want==0) return vsfs_fail("empty allocation");
+    if(fs->sbx.free_blocks==0) return vsfs_fail("not enough free data blocks");
+    uint64_t s = UINT64_MAX, n = want;
+    if(fs->alloc_policy!=VSFS_ALLOC_SCATTER) s = find_contig(fs, want);
+    if(s==UINT64_MAX){
+        // no run of the full length: take the lowest free run, whatever its size
+        s = bitmap_find_zero(fs->data_bm, nbits, fs->data_hint);
+        if(s >= nbits){ fs->data_hint = nbits; return vsfs_fail("not enough free data blocks"); }
+        uint64_t e = bitmap_find_one(fs->data_bm, nbits, s);
+        if(e - s < n) n = e - s;
+    }
+    take_run(fs, s, n);
+    *start = (uint32_t)s; *len = (uint32_t)n;
+    return 0;
+}
+
+int vsfs_alloc_blocks(vsfs_t *fs, uint64_t n, uint32_t *out){
+    const uint64_t nbits = fs->sb.data_region_blocks;
+    if(n==0) return 0;
+    if(n > fs->sbx.free_blocks) return vsfs_fail("not enough free data blocks");
+
+    // contiguous run first
+    if(n>1 && fs->alloc_policy!=VSFS_ALLOC_SCATTER){
+        uint64_t s = find_contig(fs, n);
+        if(s!=UINT64_MAX){
+            for(uint64_t k=0;k<n;k++) out[k]=(uint32_t)(s+k);
+            take_run(fs,s,n);
+            return 0;
+        }
+    }
+
+    // scattered: lowest free blocks
+    uint64_t found=0, i=fs->data_hint;
+    while(found<n){
+        i = bitmap_find_zero(fs->data_bm, nbits, i);
+        if(i >= nbits) break;
+        out[found++] = (uint32_t)i++;
+    }
+    if(found==0) fs->data_hint = nbits;
+    if(found<n) return vsfs_fail("not enough free data blocks");
+    take_blocks(fs,out,n);
+    fs->data_hint = (uint64_t)out[n-1]+1;
+    if(fs->data_rover < fs->data_hint) fs->data_rover = fs->data_hint;
+    return 0;
+}
+
+void vsfs_free_inode(vsfs_t *fs, uint32_t ino){
+    if(!bit_get(fs->inode_bm,ino-1)) return;
+    bit_clear(fs->inode_bm,ino-1);
+    fs->sbx.free_inodes++;
+    vsfs_mark_dirty(fs, fs->sb.inode_bitmap_start + (uint64_t)(ino-1)/(8*BS));
+    if(ino-1u < fs->inode_hint) fs->inode_hint = ino-1u;
+}
+
+// Frees a block no index entry points at.
+static void free_unindexed(vsfs_t *fs, uint32_t rel){
+    if(fs->jnl) jnl_defer_free(fs,rel);     // still allocated until the transaction commits
+    else data_block_release(fs,rel);
+}
+
+void vsfs_free_block(vsfs_t *fs, uint32_t rel){
+    if(fs->ref_tbl && fs->ref_tbl[rel] > 1){
+        // shared: one owner fewer, and a single owner is stored as 0
+        fs->ref_tbl[rel] = fs->ref_tbl[rel]==2 ? 0 : fs->ref_tbl[rel]-1;
+        vsfs_mark_dirty_range(fs,&fs->ref_tbl[rel],sizeof(uint32_t));
+        return;
+    }
+    if(fs->dedup) dedup_forget(fs,rel);
+    free_unindexed(fs,rel);
+}
+
+// ========================== Directory ==========================
+static int name_eq(const dirent64_t *de, const char *name){
+    return strncmp(de->name,name,MAX_FILENAME)==0;
+}
+
+uint32_t vsfs_name_hash(const char *name){
+    uint32_t h=2166136261u;
+    for(size_t i=0;i<MAX_FILENAME-1 && name[i];i++){ h^=(uint8_t)name[i]; h*=16777619u; }
+    return h;
+}
+
+// A directory's size_bytes spans its dirents up to the last one in use, and its
+// blocks are mapped densely from file block 0 (the root's block 0 is relative
+// block 0, so only later blocks can read as unmapped).
+static int dir_block_mapped(vsfs_t *fs, const inode_t *dir, uint64_t lblk){
+    uint32_t rel;
+    return lblk < VSFS_MAX_FILE_BLOCKS && vsfs_bmap(fs,dir,lblk,&rel)==0 && rel!=0;
+}
+
+// Dirent positions a directory has blocks for. A block appended by an add that
+// failed afterwards is mapped but not yet covered by size_bytes.
+static uint64_t dir_capacity(vsfs_t *fs, const inode_t *dir){
+    uint64_t nblocks=(dir->size_bytes+BS-1)/BS;
+    if(nblocks==0) nblocks=1;
+    while(dir_block_mapped(fs,dir,nblocks)) nblocks++;
+    return nblocks * DIRENTS_PER_BLOCK;
+}
+
+// Maps a new zeroed block at file block lblk == the current block count of a
+// directory (or block-mapped file), plus the indirect/double-indirect pointer
+// blocks that needs, from one allocation. The caller stores the inode.
+static int map_grow(vsfs_t *fs, inode_t *dir, uint64_t lblk){
+    if(lblk >= VSFS_MAX_FILE_BLOCKS) return vsfs_fail("directory full");
+    uint32_t b[3];
+    uint64_t k = lblk - DIRECT_MAX, n = 1;
+    if(lblk >= DIRECT_MAX){
+        if(k < PTRS_PER_BLOCK) n += k==0;
+        else { k -= PTRS_PER_BLOCK; n += (k==0) + (k%PTRS_PER_BLOCK==0); }
+    }
+    if(vsfs_alloc_blocks(fs,n,b)!=0) return -1;
+    for(uint64_t i=0;i<n;i++){
+        memset(vsfs_data_block(fs,b[i]),0,BS);
+        vsfs_mark_dirty(fs, fs->sb.data_region_start + b[i]);
+    }
+    const uint32_t data = b[n-1];
+    if(lblk < DIRECT_MAX){
+        dir->direct[lblk] = data;
+    } else if(lblk - DIRECT_MAX < PTRS_PER_BLOCK){
+        if(n==2) dir->indirect = b[0];
+        uint32_t *ind = (uint32_t *)vsfs_data_block(fs,dir->indirect);
+        ind[k] = data;
+        vsfs_mark_dirty_range(fs,&ind[k],sizeof(*ind));
+    } else {
+        uint32_t i = 0;
+        if(n==3) dir->dindirect = b[i++];
+        uint32_t *dind = (uint32_t *)vsfs_data_block(fs,dir->dindirect);
+        if(k%PTRS_PER_BLOCK==0){
+            dind[k/PTRS_PER_BLOCK] = b[i];
+            vsfs_mark_dirty_range(fs,&dind[k/PTRS_PER_BLOCK],sizeof(*dind));
+        }
+        uint32_t *ind = (uint32_t *)vsfs_data_block(fs,dind[k/PTRS_PER_BLOCK]);
+        ind[k%PTRS_PER_BLOCK] = data;
+        vsfs_mark_dirty_range(fs,&ind[k%PTRS_PER_BLOCK],sizeof(*ind));
+    }
+    return 0;
+}
+
+// 1 if every used dirent of block rel matches its checksum, else 0 and *bad.
+static int dir_block_ok(vsfs_t *fs, uint32_t rel, size_t *bad){
+    const dirent64_t *de=(const dirent64_t *)vsfs_data_block(fs,rel);
+    for(size_t i=0;i<DIRENTS_PER_BLOCK;i++)
+        if(de[i].inode_no && dirent_xor(&de[i])!=de[i].checksum){ *bad=i; return 0; }
+    return 1;
+}
+
+int vsfs_verify_dir_block(vsfs_t *fs, uint32_t rel){
+    if(rel >= fs->sb.data_region_blocks) return vsfs_fail("directory block %u out of range",rel);
+    const uint64_t blk = fs->sb.data_region_start + rel;
+    if(bit_get(fs->verified,blk)) return 0;
+    size_t bad;
+    if(!dir_block_ok(fs,rel,&bad)) return vsfs_fail("dirent checksum mismatch in block %u (entry %zu)",rel,bad);
+    bit_set(fs->verified,blk);
+    return 0;
+}
+
+// Address of dirent number pos of a directory; its block is verified on first use.
+static int dir_entry(vsfs_t *fs, const inode_t *dir, uint64_t pos, dirent64_t **de){
+    uint32_t rel;
+    if(vsfs_bmap(fs,dir,pos/DIRENTS_PER_BLOCK,&rel)!=0) return -1;
+    if(vsfs_verify_dir_block(fs,rel)!=0) return -1;
+    *de=(dirent64_t *)vsfs_data_block(fs,rel) + pos%DIRENTS_PER_BLOCK;
+    return 0;
+}
+
+// *ix = the directory's index, or NULL if it has none.
+static int dix_get(vsfs_t *fs, const inode_t *dir, vsfs_dir_index_t **ix){
+    *ix=NULL;
+    if(!(dir->flags & VSFS_INODE_INDEXED)) return 0;
+    if(dir->aux_ptr==0 || dir->aux_len==0 || (uint64_t)dir->aux_ptr+dir->aux_len > fs->sb.data_region_blocks)
+        return vsfs_fail("directory index out of range");
+    vsfs_dir_index_t *h=(vsfs_dir_index_t *)vsfs_data_block(fs,dir->aux_ptr);
+    if(h->magic!=VSFS_DIR_INDEX_MAGIC || h->nslots==0 ||
+       h->nslots > ((uint64_t)dir->aux_len*BS - sizeof(*h))/sizeof(vsfs_dix_slot_t))
+        return vsfs_fail("corrupt directory index");
+    *ix=h;
+    return 0;
+}
+
+static vsfs_dix_slot_t *dix_slots(vsfs_dir_index_t *ix){ return (vsfs_dix_slot_t *)(ix+1); }
+
+// Stores (hash, pos) in the first empty or removed slot of its probe sequence.
+static void dix_insert(vsfs_t *fs, vsfs_dir_index_t *ix, uint32_t hash, uint64_t pos){
+    vsfs_dix_slot_t *sl=dix_slots(ix);
+    uint32_t i=hash%ix->nslots;
+    while(sl[i].pos!=VSFS_DIX_EMPTY && sl[i].pos!=VSFS_DIX_TOMB) i = i+1==ix->nslots ? 0 : i+1;
+    if(sl[i].pos==VSFS_DIX_TOMB) ix->tombs--;
+    sl[i].hash=hash; sl[i].pos=(uint32_t)(pos+1);
+    ix->used++;
+    vsfs_mark_dirty_range(fs,&sl[i],sizeof(sl[i]));
+    vsfs_mark_dirty_range(fs,ix,sizeof(*ix));
+}
+
+// Turns the slot of (hash, pos) into a tombstone, so later probes go past it.
+static void dix_remove(vsfs_t *fs, vsfs_dir_index_t *ix, uint32_t hash, uint64_t pos){
+    vsfs_dix_slot_t *sl=dix_slots(ix);
+    uint32_t i=hash%ix->nslots;
+    for(uint32_t n=0; n<ix->nslots && sl[i].pos!=VSFS_DIX_EMPTY; n++, i = i+1==ix->nslots ? 0 : i+1){
+        if(sl[i].pos!=pos+1) continue;
+        sl[i].pos=VSFS_DIX_TOMB;
+        ix->used--; ix->tombs++;
+        vsfs_mark_dirty_range(fs,&sl[i],sizeof(sl[i]));
+        break;
+    }
+    if(pos < ix->next_free) ix->next_free=(uint32_t)pos;
+    vsfs_mark_dirty_range(fs,ix,sizeof(*ix));
+}
+
+// Looks name up in dir: 1 and *pos (dirent number) on a hit, 0 if absent, -1 on error.
+static int dir_find(vsfs_t *fs, const inode_t *dir, const char *name, uint64_t *pos){
+    vsfs_dir_index_t *ix;
+    if(dix_get(fs,dir,&ix)!=0) return -1;
+    const uint64_t cap=dir_capacity(fs,dir);
+    dirent64_t *de;
+    if(ix){
+        const vsfs_dix_slot_t *sl=dix_slots(ix);
+        const uint32_t h=vsfs_name_hash(name);
+        uint32_t i=h%ix->nslots;
+        for(uint32_t n=0;n<ix->nslots;n++, i = i+1==ix->nslots ? 0 : i+1){
+            if(sl[i].pos==VSFS_DIX_EMPTY) return 0;
+            if(sl[i].pos==VSFS_DIX_TOMB || sl[i].hash!=h) continue;
+            if(sl[i].pos-1u >= cap) return vsfs_fail("corrupt directory index");
+            if(dir_entry(fs,dir,sl[i].pos-1u,&de)!=0) return -1;
+            if(de->inode_no && name_eq(de,name)){ *pos=sl[i].pos-1u; return 1; }
+        }
+        return 0;
+    }
+    for(uint64_t b=0;b<cap;b+=DIRENTS_PER_BLOCK){
+        if(dir_entry(fs,dir,b,&de)!=0) return -1;
+        for(size_t i=0;i<DIRENTS_PER_BLOCK;i++)
+            if(de[i].inode_no && name_eq(&de[i],name)){ *pos=b+i; return 1; }
+    }
+    return 0;
+}
+
+// (Re)builds dir's index from its dirents, sized for `entries` names at no more
+// than 50% load, on a fresh contiguous run; the previous index is freed.
+static int dix_build(vsfs_t *fs, uint32_t dir_ino, inode_t *dir, uint64_t entries){
+    uint64_t want = entries*2;
+    uint64_t nblocks = (sizeof(vsfs_dir_index_t) + want*sizeof(vsfs_dix_slot_t) + BS-1)/BS;
+    uint64_t nslots = (nblocks*BS - sizeof(vsfs_dir_index_t))/sizeof(vsfs_dix_slot_t);
+    if(nslots >= UINT32_MAX) return vsfs_fail("directory index too large");
+    uint64_t s = find_run(fs, fs->data_hint, fs->sb.data_region_blocks, nblocks, 0);
+    if(s==UINT64_MAX) return vsfs_fail("no contiguous space for directory index");
+    take_run(fs,s,nblocks);
+    for(uint64_t b=0;b<nblocks;b++){
+        memset(vsfs_data_block(fs,(uint32_t)(s+b)),0,BS);
+        vsfs_mark_dirty(fs, fs->sb.data_region_start + s + b);
+    }
+    vsfs_dir_index_t *ix=(vsfs_dir_index_t *)vsfs_data_block(fs,(uint32_t)s);
+    ix->magic=VSFS_DIR_INDEX_MAGIC;
+    ix->nslots=(uint32_t)nslots;
+
+    const uint64_t cap=dir_capacity(fs,dir);
+    uint64_t next_free=cap;
+    for(uint64_t b=0;b<cap;b+=DIRENTS_PER_BLOCK){
+        dirent64_t *de;
+        if(dir_entry(fs,dir,b,&de)!=0) goto fail;
+        for(size_t i=0;i<DIRENTS_PER_BLOCK;i++){
+            if(!de[i].inode_no){ if(next_free==cap) next_free=b+i; continue; }
+            if((uint64_t)ix->used+1 >= nslots){ vsfs_fail("directory index too small"); goto fail; }
+            dix_insert(fs,ix,vsfs_name_hash(de[i].name),b+i);
+        }
+    }
+    ix->next_free=(uint32_t)next_free;
+
+    for(uint32_t k=0; (dir->flags & VSFS_INODE_INDEXED) && k<dir->aux_len; k++) vsfs_free_block(fs, dir->aux_ptr+k);
+    dir->flags |= VSFS_INODE_INDEXED;
+    dir->aux_ptr=(uint32_t)s; dir->aux_len=(uint32_t)nblocks;
+    return vsfs_inode_put(fs,dir_ino,dir);
+fail:
+    for(uint64_t b=0;b<nblocks;b++) vsfs_free_block(fs,(uint32_t)(s+b));
+    return -1;
+}
+
+// Checks that name is new in dir and picks a free dirent position for it,
+// appending a directory block when all are full; nothing is linked yet. On
+// VSFS_FEAT_DIR_INDEX images this first builds or grows the directory's index,
+// so dir_link() never runs out of slots.
+static int dir_prepare(vsfs_t *fs, uint32_t dir_ino, const char *name, uint64_t *pos){
+    inode_t dir;
+    if(vsfs_inode_get(fs,dir_ino,&dir)!=0) return -1;
+    vsfs_dir_index_t *ix=NULL;
+    if(fs->sb.flags & VSFS_FEAT_DIR_INDEX){
+        if(dix_get(fs,&dir,&ix)!=0) return -1;
+        if(!ix || ((uint64_t)ix->used+ix->tombs+1)*4 > (uint64_t)ix->nslots*3){
+            if(dix_build(fs,dir_ino,&dir,dir.size_bytes/sizeof(dirent64_t)+1)!=0) return -1;
+            if(dix_get(fs,&dir,&ix)!=0) return -1;
+        }
+    }
+    const uint64_t cap=dir_capacity(fs,&dir);
+    uint64_t hit, p, free_pos=cap;
+    int r;
+    if(ix){
+        // O(1) duplicate check, then free slots from the index's hint onwards
+        if((r=dir_find(fs,&dir,name,&hit))<0) return -1;
+        if(r) return vsfs_fail("'%s' already exists",name);
+        for(p=ix->next_free; p<cap && free_pos==cap; ){
+            dirent64_t *de;
+            if(dir_entry(fs,&dir,p,&de)!=0) return -1;
+            for(uint64_t end=p-p%DIRENTS_PER_BLOCK+DIRENTS_PER_BLOCK; p<end; p++, de++)
+                if(de->inode_no==0){ free_pos=p; break; }
+        }
+    } else {
+        // one pass finds both a duplicate and the first free slot
+        for(p=0; p<cap; p+=DIRENTS_PER_BLOCK){
+            dirent64_t *de;
+            if(dir_entry(fs,&dir,p,&de)!=0) return -1;
+            for(size_t i=0;i<DIRENTS_PER_BLOCK;i++){
+                if(de[i].inode_no==0){ if(free_pos==cap) free_pos=p+i; }
+                else if(name_eq(&de[i],name)) return vsfs_fail("'%s' already exists",name);
+            }
+        }
+    }
+    if(free_pos==cap){
+        // every block is full: append one (its first dirent is position cap)
+        if(map_grow(fs,&dir,cap/DIRENTS_PER_BLOCK)!=0) return -1;
+        if(vsfs_inode_put(fs,dir_ino,&dir)!=0) return -1;
+    }
+    *pos=free_pos;
+    return 0;
+}
+
+// Writes the dirent at pos (from dir_prepare) and accounts it in dir's inode and index.
+static int dir_link(vsfs_t *fs, uint32_t dir_ino, uint64_t pos, const char *name, uint32_t ino, uint8_t type){
+    inode_t dir;
+    dirent64_t *slot;
+    if(vsfs_inode_get(fs,dir_ino,&dir)!=0) return -1;
+    if(dir_entry(fs,&dir,pos,&slot)!=0) return -1;
+
+    dirent64_t nde; memset(&nde,0,sizeof(nde));
+    nde.inode_no=ino; nde.type=type;
+    strncpy(nde.name,name,MAX_FILENAME-1);
+    dirent_checksum_finalize(&nde);
+    memcpy(slot,&nde,sizeof(nde));
+    vsfs_mark_dirty_range(fs,slot,sizeof(nde));
+
+    vsfs_dir_index_t *ix;
+    if(dix_get(fs,&dir,&ix)!=0) return -1;
+    if(ix){
+        dix_insert(fs,ix,vsfs_name_hash(nde.name),pos);
+        if(pos >= ix->next_free) ix->next_free=(uint32_t)(pos+1);
+    }
+
+    if(dir.links < UINT16_MAX) dir.links+=1;   // file entries are counted too; saturate rather than wrap
+    if(dir.size_bytes < (pos+1)*sizeof(dirent64_t)) dir.size_bytes=(pos+1)*sizeof(dirent64_t);
+    return vsfs_inode_put(fs,dir_ino,&dir);
+}
+
+// Undoes dir_link(): clears the dirent at pos and takes it out of dir's index
+// and links count. size_bytes shrinks back to the last dirent still in use;
+// the blocks beyond it stay mapped for later adds (see dir_capacity()).
+static int dir_unlink(vsfs_t *fs, uint32_t dir_ino, uint64_t pos){
+    inode_t dir;
+    dirent64_t *slot;
+    if(vsfs_inode_get(fs,dir_ino,&dir)!=0) return -1;
+    if(dir_entry(fs,&dir,pos,&slot)!=0) return -1;
+    const uint32_t hash=vsfs_name_hash(slot->name);
+    memset(slot,0,sizeof(*slot));
+    vsfs_mark_dirty_range(fs,slot,sizeof(*slot));
+
+    vsfs_dir_index_t *ix;
+    if(dix_get(fs,&dir,&ix)!=0) return -1;
+    if(ix) dix_remove(fs,ix,hash,pos);
+
+    if(dir.links > 2 && dir.links < UINT16_MAX) dir.links-=1;  // a saturated count stays saturated
+    if((pos+1)*sizeof(dirent64_t) == dir.size_bytes){
+        uint64_t last=pos;      // "." and ".." are never removed, so this stops at 2
+        for(dirent64_t *de; last>0; last--){
+            if(dir_entry(fs,&dir,last-1,&de)!=0) return -1;
+            if(de->inode_no) break;
+        }
+        dir.size_bytes=last*sizeof(dirent64_t);
+    }
+    return vsfs_inode_put(fs,dir_ino,&dir);
+}
+
+// Looks name up in directory dir_ino: 1 and *ino (and the dirent type, if
+// type!=NULL) on a hit, 0 if absent, -1 on error.
+static int dir_lookup(vsfs_t *fs, uint32_t dir_ino, const char *name, uint32_t *ino, uint8_t *type){
+    inode_t dir;
+    uint64_t pos;
+    dirent64_t *de;
+    if(vsfs_inode_get(fs,dir_ino,&dir)!=0) return -1;
+    if(!(dir.mode & VSFS_MODE_DIR)) return vsfs_fail("inode %u is not a directory",dir_ino);
+    int r=dir_find(fs,&dir,name,&pos);
+    if(r<=0) return r;
+    if(dir_entry(fs,&dir,pos,&de)!=0) return -1;
+    *ino=de->inode_no;
+    if(type) *type=de->type;
+    return 1;
+}
+
+// Creates an empty directory `name` in parent: one block holding "." and "..".
+static int make_dir(vsfs_t *fs, uint32_t parent, const char *name, uint32_t *out_ino){
+    uint64_t pos=0;
+    if(dir_prepare(fs,parent,name,&pos)!=0) return -1;
+    uint32_t ino, blk;
+    if(vsfs_alloc_inode(fs,&ino)!=0) return -1;
+    if(vsfs_alloc_blocks(fs,1,&blk)!=0){ vsfs_free_inode(fs,ino); return -1; }
+
+    dirent64_t *de=(dirent64_t *)vsfs_data_block(fs,blk);
+    memset(de,0,BS);
+    de[0].inode_no=ino;    de[0].type=VSFS_DT_DIR; de[0].name[0]='.';
+    de[1].inode_no=parent; de[1].type=VSFS_DT_DIR; de[1].name[0]='.'; de[1].name[1]='.';
+    dirent_checksum_finalize(&de[0]);
+    dirent_checksum_finalize(&de[1]);
+    vsfs_mark_dirty(fs, fs->sb.data_region_start + blk);
+
+    inode_t d; memset(&d,0,sizeof(d));
+    d.mode=VSFS_MODE_DIR; d.links=2; d.size_bytes=2*sizeof(dirent64_t);
+    d.atime=d.mtime=d.ctime=vsfs_now(fs);
+    d.direct[0]=blk;
+    if(vsfs_inode_put(fs,ino,&d)!=0) return -1;
+    if(dir_link(fs,parent,pos,name,ino,VSFS_DT_DIR)!=0) return -1;
+    *out_ino=ino;
+    return 0;
+}
+
+// ========================== Paths ==========================
+// Image paths are '/'-separated and relative to the root; a leading '/' and
+// repeated or trailing separators are ignored. "." and ".." are not allowed.
+// Writes the canonical form ("a/b/c") to out.
+static int path_norm(const char *path, char *out){
+    size_t n=0;
+    for(const char *p=path; *p; ){
+        while(*p=='/') p++;
+        if(!*p) break;
+        const char *e=p;
+        while(*e && *e!='/') e++;
+        size_t len=(size_t)(e-p);
+        if((len==1 && p[0]=='.') || (len==2 && p[0]=='.' && p[1]=='.'))
+            return vsfs_fail("'.' and '..' are not allowed in image paths: %s",path);
+        if(len > MAX_FILENAME-1) return vsfs_fail("file name too long: %.*s",(int)len,p);
+        if(n + (n?1:0) + len >= VSFS_MAX_PATH) return vsfs_fail("path too long: %s",path);
+        if(n) out[n++]='/';
+        memcpy(out+n,p,len); n+=len;
+        p=e;
+    }
+    out[n]='\0';
+    return 0;
+}
+
+// Resolves the directory at canonical path[0..len) ("" = root), consulting the
+// dentry cache first and walking from the parent otherwise. With made!=NULL,
+// missing directories are made along the way and, unless already set, *made
+// becomes the length of the path of the first one (see path_undo()).
+static int dir_resolve(vsfs_t *fs, const char *path, size_t len, size_t *made, uint32_t *ino){
+    if(len==0){ *ino=ROOT_INO; return 0; }
+    if(dcache_get(fs,path,len,ino)) return 0;
+    size_t cut=len;
+    while(cut>0 && path[cut-1]!='/') cut--;
+    uint32_t parent, child;
+    if(dir_resolve(fs,path,cut?cut-1:0,made,&parent)!=0) return -1;
+    char name[MAX_FILENAME];
+    memcpy(name,path+cut,len-cut); name[len-cut]='\0';
+    uint8_t type=0;
+    int r=dir_lookup(fs,parent,name,&child,&type);
+    if(r<0) return -1;
+    if(r){
+        if(type!=VSFS_DT_DIR) return vsfs_fail("'%.*s' is not a directory",(int)len,path);
+    } else if(!made){
+        return vsfs_fail("'%.*s' not found",(int)len,path);
+    } else if(make_dir(fs,parent,name,&child)!=0){
+        return -1;
+    } else if(!*made){
+        *made=len;
+    }
+    dcache_put(fs,path,len,child);
+    *ino=child;
+    return 0;
+}
+
+// Splits canonical path into its parent directory (resolved) and leaf name.
+static int path_parent(vsfs_t *fs, const char *path, size_t *made, uint32_t *parent, const char **leaf){
+    const char *slash=strrchr(path,'/');
+    *leaf = slash ? slash+1 : path;
+    return dir_resolve(fs,path,slash ? (size_t)(slash-path) : 0,made,parent);
+}
+
+// Removes again the directories path_parent() made for canonical path when
+// adding it failed: the parent and each one above it down to path[0..*made),
+// as far as they exist and are still empty. The error of the failed add is kept.
+static void path_undo(vsfs_t *fs, const char *path, size_t *made){
+    if(!*made) return;
+    char dir[VSFS_MAX_PATH], keep[sizeof(vsfs_errbuf)];
+    memcpy(keep,vsfs_errbuf,sizeof(keep));
+    size_t len=(size_t)(strrchr(path,'/')-path);
+    memcpy(dir,path,len);
+    while(len>=*made){
+        dir[len]='\0';
+        (void)vsfs_unlink(fs,dir);   // one that was never made, or is in use, stays
+        if(len==*made) break;
+        while(dir[len-1]!='/') len--;
+        len--;
+    }
+    memcpy(vsfs_errbuf,keep,sizeof(keep));
+    *made=0;
+}
+
+int vsfs_lookup(vsfs_t *fs, const char *path, uint32_t *ino){
+    char norm[VSFS_MAX_PATH];
+    uint32_t parent;
+    const char *leaf;
+    if(path_norm(path,norm)!=0) return -1;
+    if(norm[0]=='\0'){ *ino=ROOT_INO; return 0; }
+    if(path_parent(fs,norm,NULL,&parent,&leaf)!=0) return -1;
+    int r=dir_lookup(fs,parent,leaf,ino,NULL);
+    if(r<0) return -1;
+    if(!r) return vsfs_fail("'%s' not found",path);
+    return 0;
+}
+
+int vsfs_dir_iter(vsfs_t *fs, uint32_t dir_ino, vsfs_dirent_cb cb, void *ctx){
+    inode_t dir;
+    if(vsfs_inode_get(fs,dir_ino,&dir)!=0) return -1;
+    if(!(dir.mode & VSFS_MODE_DIR)) return vsfs_fail("inode %u is not a directory",dir_ino);
+    const uint64_t nblocks=(dir.size_bytes+BS-1)/BS;
+    for(uint64_t b=0;b<nblocks;b++){
+        dirent64_t *de;
+        if(dir_entry(fs,&dir,b*DIRENTS_PER_BLOCK,&de)!=0) return -1;
+        for(size_t i=0;i<DIRENTS_PER_BLOCK;i++){
+            if(!de[i].inode_no) continue;
+            int r=cb(ctx,&de[i]);
+            if(r) return r;
+        }
+    }
+    return 0;
+}
+
+int vsfs_mkdir(vsfs_t *fs, const char *path, int parents, uint32_t *ino){
+    char norm[VSFS_MAX_PATH];
+    uint32_t parent, d;
+    const char *leaf;
+    if(fs->mode==VSFS_OPEN_RDONLY) return vsfs_fail("image opened read-only");
+    if(jnl_reserve(fs)!=0) return -1;
+    if(path_norm(path,norm)!=0) return -1;
+    if(norm[0]=='\0') return vsfs_fail("'%s': root already exists",path);
+    if(parents){
+        size_t made=0;
+        if(dir_resolve(fs,norm,strlen(norm),&made,&d)!=0) return -1;
+    } else {
+        if(path_parent(fs,norm,NULL,&parent,&leaf)!=0) return -1;
+        if(make_dir(fs,parent,leaf,&d)!=0) return -1;
+        dcache_put(fs,norm,strlen(norm),d);
+    }
+    if(ino) *ino=d;
+    return 0;
+}
+
+// ========================== Block maps ==========================
+uint64_t vsfs_map_meta_blocks(uint64_t nblocks){
+    if(nblocks <= DIRECT_MAX) return 0;
+    nblocks -= DIRECT_MAX;
+    if(nblocks <= PTRS_PER_BLOCK) return 1;                   // single indirect
+    nblocks -= PTRS_PER_BLOCK;
+    return 1 + 1 + (nblocks + PTRS_PER_BLOCK - 1)/PTRS_PER_BLOCK; // + dindirect + its children
+}
+
+static uint32_t *ptr_block(vsfs_t *fs, uint32_t rel){ return (uint32_t *)vsfs_data_block(fs, rel); }
+
+void vsfs_extent_root_get(const inode_t *ino, vsfs_extent_root_t *er){
+    memcpy(er, (const uint8_t *)ino + offsetof(inode_t, direct), sizeof(*er));
+}
+void vsfs_extent_root_set(inode_t *ino, const vsfs_extent_root_t *er){
+    memcpy((uint8_t *)ino + offsetof(inode_t, direct), er, sizeof(*er));
+}
+
+// Calls fn for every extent of an extent-mapped inode, in file order. Returns
+// -1 on a corrupt extent list, else the first non-zero fn result (or 0).
+typedef int (*extent_fn)(void *ctx, const vsfs_extent_t *e);
+static int extent_walk(vsfs_t *fs, const inode_t *ino, extent_fn fn, void *ctx){
+    vsfs_extent_root_t er;
+    vsfs_extent_root_get(ino, &er);
+    const vsfs_extent_t *list = er.ext;
+    uint32_t n = er.count < INODE_EXTENTS ? er.count : INODE_EXTENTS;
+    uint32_t seen = 0, next = er.overflow;
+    for(;;){
+        for(uint32_t i=0; i<n; i++, seen++){
+            const vsfs_extent_t *e = &list[i];
+            if(e->len==0 || e->start==0 || (uint64_t)e->start + e->len > fs->sb.data_region_blocks)
+                return vsfs_fail("corrupt extent (%u,%u)", e->start, e->len);
+            int r = fn(ctx, e);
+            if(r) return r;
+        }
+        if(seen >= er.count) return 0;
+        if(next==0 || next>=fs->sb.data_region_blocks) return vsfs_fail("extent overflow chain broken");
+        const vsfs_extent_block_t *eb = (const vsfs_extent_block_t *)vsfs_data_block(fs, next);
+        if(eb->count==0 || eb->count>EXTENTS_PER_BLOCK || eb->count > er.count-seen) return vsfs_fail("corrupt extent block %u", next);
+        list = eb->ext; n = eb->count; next = eb->next;
+    }
+}
+
+typedef struct { uint64_t lblk; uint64_t pos; uint32_t rel; } bmap_ext_ctx;
+static int bmap_ext_fn(void *ctx, const vsfs_extent_t *e){
+    bmap_ext_ctx *c = ctx;
+    if(c->lblk < c->pos + e->len){ c->rel = e->start + (uint32_t)(c->lblk - c->pos); return 1; }
+    c->pos += e->len;
+    return 0;
+}
+
+int vsfs_bmap(vsfs_t *fs, const inode_t *ino, uint64_t lblk, uint32_t *rel){
+    uint32_t r;
+    if(ino->flags & VSFS_INODE_INLINE) return vsfs_fail("file data is stored inline");
+    if(ino->flags & VSFS_INODE_EXTENTS){
+        bmap_ext_ctx c = { lblk, 0, 0 };
+        int found = extent_walk(fs, ino, bmap_ext_fn, &c);
+        if(found < 0) return -1;
+        if(!found) return vsfs_fail("block not mapped");
+        *rel = c.rel;
+        return 0;
+    }
+    if(lblk < DIRECT_MAX){
+        r = ino->direct[lblk];
+    } else if((lblk -= DIRECT_MAX) < PTRS_PER_BLOCK){
+        if(!ino->indirect) return vsfs_fail("block not mapped");
+        if(ino->indirect >= fs->sb.data_region_blocks) return vsfs_fail("indirect block out of range");
+        r = ptr_block(fs, ino->indirect)[lblk];
+        if(!r) return vsfs_fail("block not mapped");
+    } else if((lblk -= PTRS_PER_BLOCK) < (uint64_t)PTRS_PER_BLOCK*PTRS_PER_BLOCK){
+        if(!ino->dindirect) return vsfs_fail("block not mapped");
+        if(ino->dindirect >= fs->sb.data_region_blocks) return vsfs_fail("indirect block out of range");
+        uint32_t ind = ptr_block(fs, ino->dindirect)[lblk / PTRS_PER_BLOCK];
+        if(!ind) return vsfs_fail("block not mapped");
+        if(ind >= fs->sb.data_region_blocks) return vsfs_fail("indirect block out of range");
+        r = ptr_block(fs, ind)[lblk % PTRS_PER_BLOCK];
+        if(!r) return vsfs_fail("block not mapped");
+    } else {
+        return vsfs_fail("block %" PRIu64 " beyond maximum file size", lblk);
+    }
+    if(r >= fs->sb.data_region_blocks) return vsfs_fail("data block out of range");
+    *rel = r;
+    return 0;
+}
+
+typedef struct { vsfs_run_cb cb; void *ctx; uint64_t lblk; } runs_ext_ctx;
+static int runs_ext_fn(void *ctx, const vsfs_extent_t *e){
+    runs_ext_ctx *c = ctx;
+    int r = c->cb(c->ctx, c->lblk, e->start, e->len);
+    c->lblk += e->len;
+    return r;
+}
+
+int vsfs_file_runs(vsfs_t *fs, const inode_t *ino, vsfs_run_cb cb, void *ctx){
+    if(ino->flags & VSFS_INODE_INLINE) return 0;
+    if(ino->flags & VSFS_INODE_EXTENTS){
+        runs_ext_ctx c = { cb, ctx, 0 };
+        return extent_walk(fs, ino, runs_ext_fn, &c);
+    }
+    // block map: coalesce physically consecutive blocks
+    const uint64_t nblocks = (ino->flags & VSFS_INODE_COMPRESSED) ? ino->stored_blocks : (ino->size_bytes + BS - 1) / BS;
+    uint64_t run_l = 0; uint32_t run_r = 0, run_n = 0;
+    for(uint64_t l=0; l<nblocks; l++){
+        uint32_t r;
+        if(vsfs_bmap(fs, ino, l, &r)!=0) return -1;
+        if(run_n && r == run_r + run_n && run_n < UINT32_MAX){ run_n++; continue; }
+        if(run_n){ int rc = cb(ctx, run_l, run_r, run_n); if(rc) return rc; }
+        run_l = l; run_r = r; run_n = 1;
+    }
+    return run_n ? cb(ctx, run_l, run_r, run_n) : 0;
+}
+
+// Lays out a freshly allocated file. `all` holds nblocks + vsfs_map_meta_blocks()
+// relative blocks in disk order; pointer blocks are taken from it just before
+// the data they map (ext2-style), so a contiguous allocation stays sequential.
+// Fills the inode's pointers and data[lblk] with the data block of each file block.
+static void map_build(vsfs_t *fs, inode_t *ino, const uint32_t *all, uint64_t nblocks, uint32_t *data){
+    uint64_t next = 0;
+    uint32_t *ind = NULL, *dind = NULL;
+    for(uint64_t l=0; l<nblocks; l++){
+        uint32_t *slot;
+        if(l < DIRECT_MAX){
+            slot = &ino->direct[l];
+        } else {
+            uint64_t k = l - DIRECT_MAX;
+            if(k < PTRS_PER_BLOCK){
+                if(k == 0){
+                    ino->indirect = all[next++];
+                    ind = ptr_block(fs, ino->indirect);
+                    memset(ind, 0, BS);
+                    vsfs_mark_dirty(fs, fs->sb.data_region_start + ino->indirect);
+                }
+                slot = &ind[k];
+            } else {
+                k -= PTRS_PER_BLOCK;
+                if(k == 0){
+                    ino->dindirect = all[next++];
+                    dind = ptr_block(fs, ino->dindirect);
+                    memset(dind, 0, BS);
+                    vsfs_mark_dirty(fs, fs->sb.data_region_start + ino->dindirect);
+                }
+                if(k % PTRS_PER_BLOCK == 0){
+                    uint32_t r = all[next++];
+                    dind[k / PTRS_PER_BLOCK] = r;
+                    ind = ptr_block(fs, r);
+                    memset(ind, 0, BS);
+                    vsfs_mark_dirty(fs, fs->sb.data_region_start + r);
+                }
+                slot = &ind[k % PTRS_PER_BLOCK];
+            }
+        }
+        *slot = data[l] = all[next++];
+    }
+}
+
+// Frees every block a file or directory references (data, pointer / extent
+// blocks, and the cluster table or directory index at aux_ptr). Relative
+// block 0 is never part of a file, so 0 pointers are skipped.
+static void free_file_blocks(vsfs_t *fs, const inode_t *ino){
+    if(ino->flags & VSFS_INODE_INLINE) return;
+    for(uint32_t k=0; (ino->flags & (VSFS_INODE_COMPRESSED | VSFS_INODE_INDEXED)) && k<ino->aux_len; k++) vsfs_free_block(fs, ino->aux_ptr+k);
+    if(ino->flags & VSFS_INODE_EXTENTS){
+        vsfs_extent_root_t er;
+        vsfs_extent_root_get(ino, &er);
+        uint32_t n = er.count < INODE_EXTENTS ? er.count : INODE_EXTENTS;
+        for(uint32_t i=0;i<n;i++)
+            for(uint32_t k=0;k<er.ext[i].len;k++) vsfs_free_block(fs, er.ext[i].start+k);
+        for(uint32_t blk=er.overflow, left=er.count-n; blk && blk<fs->sb.data_region_blocks; ){
+            const vsfs_extent_block_t *eb = (const vsfs_extent_block_t *)vsfs_data_block(fs, blk);
+            uint32_t next = eb->next, cnt = eb->count < left ? eb->count : left;
+            for(uint32_t i=0;i<cnt && i<EXTENTS_PER_BLOCK;i++)
+                for(uint32_t k=0;k<eb->ext[i].len;k++) vsfs_free_block(fs, eb->ext[i].start+k);
+            vsfs_free_block(fs, blk);
+            left -= cnt;
+            if(left==0) break;
+            blk = next;
+        }
+        return;
+    }
+    for(int i=0;i<DIRECT_MAX;i++) if(ino->direct[i]) vsfs_free_block(fs, ino->direct[i]);
+    if(ino->indirect){
+        const uint32_t *ind = ptr_block(fs, ino->indirect);
+        for(uint32_t i=0;i<PTRS_PER_BLOCK;i++) if(ind[i]) vsfs_free_block(fs, ind[i]);
+        vsfs_free_block(fs, ino->indirect);
+    }
+    if(ino->dindirect){
+        const uint32_t *dind = ptr_block(fs, ino->dindirect);
+        for(uint32_t j=0;j<PTRS_PER_BLOCK;j++){
+            if(!dind[j]) continue;
+            const uint32_t *ind = ptr_block(fs, dind[j]);
+            for(uint32_t i=0;i<PTRS_PER_BLOCK;i++) if(ind[i]) vsfs_free_block(fs, ind[i]);
+            vsfs_free_block(fs, dind[j]);
+        }
+        vsfs_free_block(fs, ino->dindirect);
+    }
+}
+
+// Block-map layout: data + pointer blocks from one allocation.
+static int alloc_mapped_file(vsfs_t *fs, inode_t *ino, uint64_t nblocks, uint32_t *data){
+    const uint64_t total = nblocks + vsfs_map_meta_blocks(nblocks);
+    if(total > fs->sbx.free_blocks) return vsfs_fail("not enough free data blocks");
+    uint32_t *all = malloc((size_t)total * sizeof(uint32_t));
+    if(!all) return vsfs_fail_errno("malloc block list");
+    if(vsfs_alloc_blocks(fs,total,all)!=0){ free(all); return -1; }
+    map_build(fs,ino,all,nblocks,data);
+    free(all);
+    return 0;
+}
+
+// Extent layout: as few runs as the free space allows, plus overflow blocks
+// when the list does not fit in the inode.
+static int alloc_extent_file(vsfs_t *fs, inode_t *ino, uint64_t nblocks, uint32_t *data){
+    size_t cap = 8, count = 0;
+    vsfs_extent_t *ext = malloc(cap * sizeof(*ext));
+    if(!ext) return vsfs_fail_errno("malloc extent list");
+    for(uint64_t done=0; done<nblocks; ){
+        if(count==cap){
+            vsfs_extent_t *ne = realloc(ext, (cap*2) * sizeof(*ext));
+            if(!ne){ vsfs_fail_errno("malloc extent list"); goto fail; }
+            ext = ne; cap *= 2;
+        }
+        uint64_t want = nblocks - done;
+        if(want > UINT32_MAX) want = UINT32_MAX;
+        if(vsfs_alloc_run(fs, want, &ext[count].start, &ext[count].len)!=0) goto fail;
+        for(uint32_t k=0;k<ext[count].len;k++) data[done+k] = ext[count].start + k;
+        done += ext[count].len;
+        count++;
+    }
+
+    vsfs_extent_root_t er;
+    memset(&er, 0, sizeof(er));
+    er.count = (uint32_t)count;
+    for(size_t i=0;i<count && i<INODE_EXTENTS;i++) er.ext[i] = ext[i];
+    if(count > INODE_EXTENTS){
+        uint64_t nover = (count - INODE_EXTENTS + EXTENTS_PER_BLOCK - 1) / EXTENTS_PER_BLOCK;
+        uint32_t *over = malloc((size_t)nover * sizeof(uint32_t));
+        if(!over){ vsfs_fail_errno("malloc extent list"); goto fail; }
+        if(vsfs_alloc_blocks(fs, nover, over)!=0){ free(over); goto fail; }
+        size_t next = INODE_EXTENTS;
+        for(uint64_t b=0;b<nover;b++){
+            vsfs_extent_block_t *eb = (vsfs_extent_block_t *)vsfs_data_block(fs, over[b]);
+            memset(eb, 0, BS);
+            eb->next = b+1<nover ? over[b+1] : 0;
+            while(next<count && eb->count<EXTENTS_PER_BLOCK) eb->ext[eb->count++] = ext[next++];
+            vsfs_mark_dirty(fs, fs->sb.data_region_start + over[b]);
+        }
+        er.overflow = over[0];
+        free(over);
+    }
+    vsfs_extent_root_set(ino, &er);
+    ino->flags |= VSFS_INODE_EXTENTS;
+    free(ext);
+    return 0;
+fail:
+    for(size_t i=0;i<count;i++)
+        for(uint32_t k=0;k<ext[i].len;k++) vsfs_free_block(fs, ext[i].start+k);
+    free(ext);
+    return -1;
+}
+
+// ========================== Deduplication ==========================
+// Writes n whole blocks from buf to RELATIVE blocks [rel, rel+n) of a file
+// being filled: through the fd when a journal keeps content out of the mapping.
+static int data_write(vsfs_t *fs, uint32_t rel, const uint8_t *buf, uint64_t n){
+    uint8_t *dst = vsfs_data_block(fs,rel);
+    if(jnl_direct(fs)) return pwrite_full(fs->fd,buf,n*BS,(uint64_t)(dst-fs->img))==0 ? 0 : vsfs_fail_errno("write image");
+    memcpy(dst,buf,n*BS);
+    return 0;
+}
+
+// Points file block lblk of a block-mapped file at data block rel.
+static void map_set(vsfs_t *fs, inode_t *ino, uint64_t lblk, uint32_t rel){
+    uint32_t *slot;
+    if(lblk < DIRECT_MAX){ ino->direct[lblk] = rel; return; }
+    if((lblk -= DIRECT_MAX) < PTRS_PER_BLOCK){
+        slot = &ptr_block(fs, ino->indirect)[lblk];
+    } else {
+        lblk -= PTRS_PER_BLOCK;
+        slot = &ptr_block(fs, ptr_block(fs, ino->dindirect)[lblk / PTRS_PER_BLOCK])[lblk % PTRS_PER_BLOCK];
+    }
+    *slot = rel;
+    vsfs_mark_dirty_range(fs, slot, sizeof(*slot));
+}
+
+// file_fill() for a deduplicating handle. Each block is staged in a buffer and
+// looked up in the index; a hit takes a reference to the existing block and
+// gives back the one file_alloc() reserved, a miss is written to that block
+// and indexed. Map and allocation changes happen under the index lock. The
+// zeroed block of an empty file is left alone: it is not one of the file's
+// runs, so sharing it would hide the reference from vsfs_scrub().
+static int dedup_fill(vsfs_t *fs, inode_t *ino, int fd, const uint8_t *data){
+    struct vsfs_dedup *d = fs->dedup;
+    const uint64_t size = ino->size_bytes, nblocks = (size+BS-1)/BS;
+    uint8_t *buf = malloc(BS);
+    if(!buf) return vsfs_fail_errno("malloc dedup buffer");
+    for(uint64_t l=0; l<nblocks; l++){
+        const uint64_t off = l*BS, n = size-off < BS ? size-off : BS;
+        uint32_t rel;
+        if(data) memcpy(buf,data+off,n);
+        else if(n && host_read(fd,buf,n,off)!=0){ free(buf); return vsfs_fail_errno("reading host file"); }
+        memset(buf+n,0,BS-n);
+        const uint32_t crc = crc_of(buf,BS);
+        if(vsfs_bmap(fs,ino,l,&rel)!=0){ free(buf); return -1; }
+
+        pthread_mutex_lock(&d->lock);
+        const uint32_t hit = dedup_find(fs,crc,buf);
+        if(hit){
+            fs->ref_tbl[hit] = fs->ref_tbl[hit] ? fs->ref_tbl[hit]+1 : 2;
+            vsfs_mark_dirty_range(fs,&fs->ref_tbl[hit],sizeof(uint32_t));
+            map_set(fs,ino,l,hit);
+            free_unindexed(fs,rel);
+            fs->dedup_blocks++;
+        }
+        pthread_mutex_unlock(&d->lock);
+        if(hit) continue;
+
+        if(data_write(fs,rel,buf,1)!=0){ free(buf); return -1; }
+        pthread_mutex_lock(&d->lock);
+        dedup_insert(d,crc,rel);
+        pthread_mutex_unlock(&d->lock);
+    }
+    free(buf);
+    return 0;
+}
+
+static int seed_run(void *ctx, uint64_t lblk, uint32_t rel, uint32_t len){
+    vsfs_t *fs = ctx;
+    (void)lblk;
+    for(uint32_t k=0;k<len;k++)
+        dedup_insert(fs->dedup, fs->crc_tbl ? fs->crc_tbl[rel+k] : crc_of(vsfs_data_block(fs,rel+k),BS), rel+k);
+    return 0;
+}
+
+int vsfs_dedup_enable(vsfs_t *fs){
+    if(!fs->ref_tbl) return vsfs_fail("image has no refcount table (build it with --dedup)");
+    if(fs->mode==VSFS_OPEN_RDONLY) return vsfs_fail("image opened read-only");
+    if(fs->dedup) return 0;
+    struct vsfs_dedup *d = calloc(1,sizeof(*d));
+    if(!d) return vsfs_fail_errno("calloc dedup index");
+    if(pthread_mutex_init(&d->lock,NULL)!=0){ free(d); return vsfs_fail("cannot create dedup lock"); }
+    fs->dedup = d;
+
+    // index the blocks of existing files; the crc table already holds their keys
+    const uint64_t ninodes = fs->sb.inode_count;
+    for(uint64_t i=bitmap_find_one(fs->inode_bm,ninodes,0); i<ninodes; i=bitmap_find_one(fs->inode_bm,ninodes,i+1)){
+        inode_t in;
+        if(vsfs_inode_get(fs,(uint32_t)(i+1),&in)!=0) continue;   // scrub reports it
+        if((in.mode & VSFS_MODE_DIR) || (in.flags & VSFS_INODE_INLINE)) continue;
+        vsfs_file_runs(fs,&in,seed_run,fs);
+    }
+    return 0;
+}
+
+// ========================== Compression ==========================
+// A compressed file is allocated like a plain one (worst case: nothing
+// compresses) plus its cluster table. compress_fill() packs the clusters into
+// the first stored blocks, and compress_trim() then gives back the rest.
+
+// Reserves the cluster table of a file of `size` bytes; without contiguous
+// space for it the file is simply stored uncompressed.
+static void cluster_table_alloc(vsfs_t *fs, inode_t *ino, uint64_t size){
+    const uint64_t cl = vsfs_cluster_bytes(fs), nclusters = (size+cl-1)/cl;
+    const uint64_t nblocks = (nclusters + CLUSTERS_PER_BLOCK - 1)/CLUSTERS_PER_BLOCK;
+    uint64_t s = find_run(fs, fs->data_hint, fs->sb.data_region_blocks, nblocks, 0);
+    if(s==UINT64_MAX) return;
+    take_run(fs,s,nblocks);
+    for(uint64_t b=0;b<nblocks;b++){
+        memset(vsfs_data_block(fs,(uint32_t)(s+b)),0,BS);
+        vsfs_mark_dirty(fs, fs->sb.data_region_start + s + b);
+    }
+    ino->flags |= VSFS_INODE_COMPRESSED;
+    ino->aux_ptr = (uint32_t)s; ino->aux_len = (uint32_t)nblocks;
+}
+
+// Writes n blocks from buf to stored blocks [lblk, lblk+n), a physical run at a time.
+static int stored_write(vsfs_t *fs, const inode_t *ino, uint64_t lblk, const uint8_t *buf, uint64_t n){
+    for(uint64_t i=0; i<n; ){
+        uint32_t rel, next;
+        if(vsfs_bmap(fs,ino,lblk+i,&rel)!=0) return -1;
+        uint64_t run = 1;
+        while(i+run<n && vsfs_bmap(fs,ino,lblk+i+run,&next)==0 && next==rel+run) run++;
+        if(data_write(fs,rel,buf+i*BS,run)!=0) return -1;
+        i += run;
+    }
+    return 0;
+}
+
+// file_fill() for a compressed file: each cluster that LZ4 shrinks by at least
+// one block is stored compressed, any other as is.
+static int compress_fill(vsfs_t *fs, inode_t *ino, int fd, const uint8_t *data){
+    const uint64_t cl = vsfs_cluster_bytes(fs), size = ino->size_bytes;
+    vsfs_cluster_t *tab = (vsfs_cluster_t *)vsfs_data_block(fs,ino->aux_ptr);
+    uint8_t *raw = malloc(cl), *packed = malloc(cl);
+    if(!raw || !packed){ free(raw); free(packed); return vsfs_fail_errno("malloc cluster buffers"); }
+    uint64_t next = 0;
+    for(uint64_t c=0; c*cl<size; c++){
+        const uint64_t off = c*cl, n = size-off < cl ? size-off : cl, nblocks = (n+BS-1)/BS;
+        if(data) memcpy(raw,data+off,n);
+        else if(host_read(fd,raw,n,off)!=0){ free(raw); free(packed); return vsfs_fail_errno("reading host file"); }
+        const size_t z = nblocks>1 ? lz4_compress(raw,(size_t)n,packed,(size_t)(nblocks-1)*BS) : 0;
+        uint8_t *src = z ? packed : raw;
+        const uint64_t len = z ? z : n, used = (len+BS-1)/BS;
+        memset(src+len,0,used*BS-len);
+        if(stored_write(fs,ino,next,src,used)!=0){ free(raw); free(packed); return -1; }
+        tab[c].lblk = (uint32_t)next; tab[c].csize = (uint32_t)z;
+        next += used;
+    }
+    free(raw); free(packed);
+    ino->stored_blocks = (uint32_t)next;
+    return 0;
+}
+
+// Unmaps and frees file blocks [keep, nblocks) of a block-mapped file, with
+// the pointer blocks that no longer map anything.
+static void map_trim(vsfs_t *fs, inode_t *ino, uint64_t keep, uint64_t nblocks){
+    uint64_t lo = UINT64_MAX;
+    for(uint64_t l=keep; l<nblocks; l++){
+        uint32_t rel;
+        if(vsfs_bmap(fs,ino,l,&rel)!=0) continue;
+        map_set(fs,ino,l,0);
+        vsfs_free_block(fs,rel);
+        if(rel < lo) lo = rel;
+    }
+    if(keep <= DIRECT_MAX && ino->indirect){
+        if(ino->indirect < lo) lo = ino->indirect;
+        vsfs_free_block(fs,ino->indirect);
+        ino->indirect = 0;
+    }
+    const uint64_t dbase = DIRECT_MAX + PTRS_PER_BLOCK;
+    if(ino->dindirect){
+        uint32_t *dind = ptr_block(fs,ino->dindirect);
+        for(uint32_t j=0;j<PTRS_PER_BLOCK;j++){
+            if(!dind[j] || keep > dbase + (uint64_t)j*PTRS_PER_BLOCK) continue;
+            if(dind[j] < lo) lo = dind[j];
+            vsfs_free_block(fs,dind[j]);
+            dind[j] = 0;
+            vsfs_mark_dirty_range(fs,&dind[j],sizeof(dind[j]));
+        }
+        if(keep <= dbase){
+            if(ino->dindirect < lo) lo = ino->dindirect;
+            vsfs_free_block(fs,ino->dindirect);
+            ino->dindirect = 0;
+        }
+    }
+    // a trimmed tail right behind the next-fit rover is where the next file goes
+    if(lo < fs->data_rover && !fs->jnl && bitmap_find_one(fs->data_bm,fs->data_rover,lo) >= fs->data_rover)
+        fs->data_rover = lo;
+}
+
+// Releases what compress_fill() did not use. A file none of whose clusters
+// compressed is turned back into a plain one (its stored blocks are then
+// exactly its plain layout).
+static void compress_trim(vsfs_t *fs, inode_t *ino){
+    if(!(ino->flags & VSFS_INODE_COMPRESSED)) return;
+    const uint64_t nblocks = (ino->size_bytes+BS-1)/BS;
+    if(ino->stored_blocks < nblocks){ map_trim(fs,ino,ino->stored_blocks,nblocks); return; }
+    for(uint32_t k=0;k<ino->aux_len;k++) vsfs_free_block(fs,ino->aux_ptr+k);
+    ino->flags &= ~VSFS_INODE_COMPRESSED;
+    ino->aux_ptr = ino->aux_len = ino->stored_blocks = 0;
+}
+
+int vsfs_read_cluster(vsfs_t *fs, const inode_t *ino, uint64_t c, uint8_t *buf){
+    const uint64_t cl = vsfs_cluster_bytes(fs), size = ino->size_bytes;
+    if(!(ino->flags & VSFS_INODE_COMPRESSED) || !cl) return vsfs_fail("file is not compressed");
+    if(c*cl >= size) return vsfs_fail("cluster %" PRIu64 " beyond end of file",c);
+    if(c/CLUSTERS_PER_BLOCK >= ino->aux_len || (uint64_t)ino->aux_ptr + ino->aux_len > fs->sb.data_region_blocks)
+        return vsfs_fail("cluster table out of range");
+    const vsfs_cluster_t e = ((const vsfs_cluster_t *)vsfs_data_block(fs,ino->aux_ptr))[c];
+    const uint64_t n = size-c*cl < cl ? size-c*cl : cl, nblocks = (n+BS-1)/BS;
+    const uint64_t len = e.csize ? e.csize : n, used = (len+BS-1)/BS;
+    if(used > nblocks || (e.csize && used==nblocks) || (uint64_t)e.lblk + used > ino->stored_blocks)
+        return vsfs_fail("cluster %" PRIu64 ": bad table entry",c);
+
+    // the stored blocks are normally one run and decoded straight from the image
+    uint32_t first, rel;
+    int contiguous = 1;
+    if(vsfs_bmap(fs,ino,e.lblk,&first)!=0) return -1;
+    for(uint64_t i=1; i<used && contiguous; i++){
+        if(vsfs_bmap(fs,ino,e.lblk+i,&rel)!=0) return -1;
+        contiguous = rel==first+i;
+    }
+    const uint8_t *src = vsfs_data_block(fs,first);
+    uint8_t *stage = NULL;
+    if(!contiguous){
+        if(!(stage = malloc((size_t)used*BS))) return vsfs_fail_errno("malloc cluster buffer");
+        for(uint64_t i=0; i<used; i++){
+            if(vsfs_bmap(fs,ino,e.lblk+i,&rel)!=0){ free(stage); return -1; }
+            memcpy(stage+i*BS,vsfs_data_block(fs,rel),BS);
+        }
+        src = stage;
+    }
+    int rc = 0;
+    if(!e.csize) memcpy(buf,src,(size_t)n);
+    else if(lz4_decompress(src,(size_t)len,buf,(size_t)n)!=n) rc = vsfs_fail("cluster %" PRIu64 ": corrupt compressed data",c);
+    memset(buf+n,0,(size_t)(cl-n));
+    free(stage);
+    return rc;
+}
+
+// ========================== Files ==========================
+// Copies len bytes of host file fd from off into the image at dst. In place,
+// copy_file_range() lets the kernel move the data into the image file (the
+// mapping shares its page cache); when it is not supported for this pair of
+// files, or the image is a private copy, pread() fills the destination directly.
+// A journaled image is mapped privately, so there the data either bypasses the
+// mapping completely (4 KiB pages, see file_alloc()) or goes only into it.
+static int stream_in(vsfs_t *fs, int fd, uint64_t off, uint8_t *dst, uint64_t len){
+    if(fs->mode==VSFS_OPEN_INPLACE && (!fs->jnl || fs->jnl->direct)){
+        loff_t in=(loff_t)off, out=(loff_t)(dst - fs->img);
+        while(len){
+            ssize_t n=copy_file_range(fd,&in,fs->fd,&out,(size_t)(len > (1u<<30) ? (1u<<30) : len),0);
+            if(n>0){
+                stat_add(STAT_HOST_READ,(uint64_t)n);   // written when vsfs_commit() flushes the block
+                dst+=n; off+=(uint64_t)n; len-=(uint64_t)n; continue;
+            }
+            if(n<0 && errno==EINTR) continue;
+            if(n==0){ errno=EIO; return vsfs_fail_errno("reading host file"); }
+            if(errno!=EXDEV && errno!=ENOSYS && errno!=EINVAL && errno!=EOPNOTSUPP && errno!=EBADF)
+                return vsfs_fail_errno("copying host file");
+            break;  // fall back to pread for the rest
+        }
+    }
+    if(len && jnl_direct(fs)){
+        // not through the mapping either: bounce via a small buffer
+        const size_t cap = 1u<<20;
+        uint8_t *buf = malloc(cap);
+        if(!buf) return vsfs_fail_errno("malloc copy buffer");
+        uint64_t out = (uint64_t)(dst - fs->img);
+        while(len){
+            size_t n = len > cap ? cap : (size_t)len;
+            if(host_read(fd,buf,n,off)!=0){ free(buf); return vsfs_fail_errno("reading host file"); }
+            if(pwrite_full(fs->fd,buf,n,out)!=0){ free(buf); return vsfs_fail_errno("write image"); }
+            off+=n; out+=n; len-=n;
+        }
+        free(buf);
+        return 0;
+    }
+    if(len && host_read(fd,dst,len,off)!=0) return vsfs_fail_errno("reading host file");
+    return 0;
+}
+
+// Allocates the inode number and the data (plus pointer / extent) blocks of a
+// file of `size` bytes into *ino, marks the data blocks dirty and zeroes the
+// tail of the last one, so only bytes [0, size) remain to be filled. With
+// VSFS_FEAT_INLINE_DATA a file that fits in the inode gets no block at all;
+// with VSFS_FEAT_COMPRESS a file of more than one block also gets a cluster table.
+static int file_alloc(vsfs_t *fs, const char *name, uint64_t size, uint32_t *ino_no, inode_t *ino){
+    if((fs->sb.flags & VSFS_FEAT_INLINE_DATA) && size <= VSFS_INLINE_MAX){
+        if(vsfs_alloc_inode(fs,ino_no)!=0) return -1;
+        memset(ino,0,sizeof(*ino));   // bytes past size stay zero
+        ino->flags=VSFS_INODE_INLINE;
+        ino->mode=VSFS_MODE_FILE; ino->links=1; ino->size_bytes=size;
+        uint64_t now=vsfs_now(fs); ino->atime=ino->mtime=ino->ctime=now;
+        return 0;
+    }
+    uint64_t need_blocks = (size+BS-1)/BS;
+    if(need_blocks==0) need_blocks=1;
+    const int extents = (fs->sb.flags & VSFS_FEAT_EXTENTS) != 0;
+    if(!extents && need_blocks>VSFS_MAX_FILE_BLOCKS) return vsfs_fail("file too large: %s",name);
+    if(need_blocks > fs->sbx.free_blocks) return vsfs_fail("not enough free data blocks");
+
+    uint32_t *blocks = malloc((size_t)need_blocks * sizeof(uint32_t));
+    if(!blocks) return vsfs_fail_errno("malloc block list");
+    if(vsfs_alloc_inode(fs,ino_no)!=0){ free(blocks); return -1; }
+    memset(ino,0,sizeof(*ino));
+    if((fs->sb.flags & VSFS_FEAT_COMPRESS) && need_blocks > 1) cluster_table_alloc(fs,ino,size);
+    if((extents ? alloc_extent_file(fs,ino,need_blocks,blocks) : alloc_mapped_file(fs,ino,need_blocks,blocks))!=0){
+        for(uint32_t k=0;k<ino->aux_len;k++) vsfs_free_block(fs,ino->aux_ptr+k);
+        vsfs_free_inode(fs,*ino_no); free(blocks); return -1;
+    }
+    for(uint64_t i=0;i<need_blocks;i++) vsfs_mark_dirty(fs, fs->sb.data_region_start + blocks[i]);
+    uint64_t tail = size - (need_blocks-1)*BS;
+    uint8_t *last = vsfs_data_block(fs,blocks[need_blocks-1]);
+    if(jnl_direct(fs)){
+        // the content will go straight to the file, so does the zero tail
+        static const uint8_t zero[BS];
+        for(uint64_t i=0;i<need_blocks;i++) bit_set(fs->jnl->ondisk,blocks[i]);
+        if(pwrite_full(fs->fd,zero,BS-tail,(uint64_t)(last-fs->img)+tail)!=0){
+            vsfs_fail_errno("write image");
+            free_file_blocks(fs,ino); vsfs_free_inode(fs,*ino_no); free(blocks);
+            return -1;
+        }
+    } else {
+        memset(last + tail, 0, BS - tail);
+    }
+    free(blocks);
+
+    ino->mode=VSFS_MODE_FILE; ino->links=1; ino->size_bytes=size;
+    uint64_t now=vsfs_now(fs); ino->atime=ino->mtime=ino->ctime=now;
+    return 0;
+}
+
+typedef struct { vsfs_t *fs; int fd; const uint8_t *data; uint64_t size; } fill_ctx;
+static int fill_run(void *ctx, uint64_t lblk, uint32_t rel, uint32_t len){
+    fill_ctx *c = ctx;
+    uint64_t off = lblk*BS;
+    if(off >= c->size) return 0;
+    uint64_t n = (uint64_t)len*BS;
+    if(n > c->size-off) n = c->size-off;
+    uint8_t *dst = vsfs_data_block(c->fs,rel);
+    if(c->data && jnl_direct(c->fs))
+        return pwrite_full(c->fs->fd,c->data+off,n,(uint64_t)(dst-c->fs->img))==0 ? 0 : vsfs_fail_errno("write image");
+    if(c->data){ memcpy(dst,c->data+off,n); return 0; }
+    return stream_in(c->fs,c->fd,off,dst,n);
+}
+
+// Copies a file's content into its allocated blocks, one physically contiguous
+// run at a time, from `data` if non-NULL or else from host fd. Touches only
+// those data bytes (or the in-memory inode of an inline file, plus the cluster
+// table of a compressed one), so different files can be filled concurrently;
+// deduplication serializes its metadata changes on the index lock.
+static int file_fill(vsfs_t *fs, inode_t *ino, int fd, const void *data){
+    if(ino->flags & VSFS_INODE_INLINE){
+        uint8_t *dst = (uint8_t *)ino->direct;
+        if(data){ memcpy(dst,data,ino->size_bytes); return 0; }
+        return host_read(fd,dst,ino->size_bytes,0)==0 ? 0 : vsfs_fail_errno("reading host file");
+    }
+    if(ino->flags & VSFS_INODE_COMPRESSED) return compress_fill(fs,ino,fd,data);
+    if(fs->dedup) return dedup_fill(fs,ino,fd,data);
+    fill_ctx c = { fs, fd, data, ino->size_bytes };
+    return vsfs_file_runs(fs,ino,fill_run,&c) ? -1 : 0;
+}
+
+// Where a new file called name goes in dir_ino: a free dirent position from
+// dir_prepare(), or, with fs->replace, the dirent of the regular file of that
+// name (*old = its inode, else 0).
+static int dir_slot(vsfs_t *fs, uint32_t dir_ino, const char *name, uint64_t *pos, uint32_t *old){
+    *old=0;
+    if(fs->replace){
+        inode_t dir;
+        dirent64_t *de;
+        if(vsfs_inode_get(fs,dir_ino,&dir)!=0) return -1;
+        int r=dir_find(fs,&dir,name,pos);
+        if(r<0) return -1;
+        if(r){
+            if(dir_entry(fs,&dir,*pos,&de)!=0) return -1;
+            if(de->type!=VSFS_DT_FILE) return vsfs_fail("'%s' already exists and is not a file",name);
+            *old=de->inode_no;
+            return 0;
+        }
+    }
+    return dir_prepare(fs,dir_ino,name,pos);
+}
+
+// Links the stored inode ino at pos from dir_slot(): a new dirent, or the
+// dirent of the file it replaces, which is then released.
+static int file_link(vsfs_t *fs, uint32_t dir_ino, uint64_t pos, const char *name, uint32_t ino, uint32_t old){
+    if(!old) return dir_link(fs,dir_ino,pos,name,ino,VSFS_DT_FILE);
+    inode_t dir, prev;
+    dirent64_t *de;
+    if(vsfs_inode_get(fs,old,&prev)!=0) return -1;
+    if(vsfs_inode_get(fs,dir_ino,&dir)!=0 || dir_entry(fs,&dir,pos,&de)!=0) return -1;
+    de->inode_no=ino;
+    dirent_checksum_finalize(de);
+    vsfs_mark_dirty_range(fs,de,sizeof(*de));
+    free_file_blocks(fs,&prev);
+    vsfs_free_inode(fs,old);
+    return 0;
+}
+
+// Creates inode + blocks + dirent for a file of `size` bytes at image path
+// `path` (parents created as needed). The content comes from `data` if
+// non-NULL, else it is streamed from host_fd straight into the image blocks.
+static int add_common(vsfs_t *fs, const char *path, int host_fd, const void *data, uint64_t size, uint32_t *out_ino){
+    if(fs->mode==VSFS_OPEN_RDONLY) return vsfs_fail("image opened read-only");
+    if(jnl_reserve(fs)!=0) return -1;
+    char norm[VSFS_MAX_PATH];
+    if(path_norm(path,norm)!=0) return -1;
+    if(norm[0]=='\0') return vsfs_fail("empty file name");
+    uint32_t dir_ino;
+    const char *name;
+    size_t made=0;
+    if(path_parent(fs,norm,&made,&dir_ino,&name)!=0) goto undo;
+
+    uint64_t slot=0;
+    uint32_t old=0;
+    if(dir_slot(fs,dir_ino,name,&slot,&old)!=0) goto undo;
+
+    uint32_t new_ino;
+    inode_t ino;
+    if(file_alloc(fs,name,size,&new_ino,&ino)!=0) goto undo;
+    if(file_fill(fs,&ino,host_fd,data)!=0) goto release;
+    compress_trim(fs,&ino);
+    if(vsfs_inode_put(fs,new_ino,&ino)!=0 || file_link(fs,dir_ino,slot,name,new_ino,old)!=0) goto release;
+
+    *out_ino=new_ino;
+    return 0;
+release:
+    free_file_blocks(fs,&ino);
+    vsfs_free_inode(fs,new_ino);
+undo:
+    path_undo(fs,norm,&made);
+    return -1;
+}
+
+int vsfs_add_file(vsfs_t *fs, const char *host_path, const char *name, uint32_t *ino, uint64_t *size){
+    int fd=open(host_path,O_RDONLY);
+    if(fd<0) return vsfs_fail_errno("open host file");
+    struct stat st;
+    if(fstat(fd,&st)!=0){ vsfs_fail_errno("stat host file"); close(fd); return -1; }
+    if(!S_ISREG(st.st_mode)){ close(fd); return vsfs_fail("host file '%s' is not regular",host_path); }
+    if(!name){
+        const char *slash=strrchr(host_path,'/');
+        name=slash?slash+1:host_path;
+    }
+    posix_fadvise(fd,0,0,POSIX_FADV_SEQUENTIAL);
+    int rc=add_common(fs,name,fd,NULL,(uint64_t)st.st_size,ino);
+    close(fd);
+    if(rc!=0) return -1;
+    if(size) *size=(uint64_t)st.st_size;
+    return 0;
+}
+
+int vsfs_add_data(vsfs_t *fs, const char *name, const void *data, uint64_t size, uint32_t *ino){
+    static const uint8_t empty[1];
+    if(!data && size) return vsfs_fail("no data for '%s'",name);
+    return add_common(fs,name,-1,data?data:empty,size,ino);
+}
+
+static int not_dot(void *ctx, const dirent64_t *de){
+    (void)ctx;
+    return strncmp(de->name,".",MAX_FILENAME)!=0 && strncmp(de->name,"..",MAX_FILENAME)!=0;
+}
+
+int vsfs_unlink(vsfs_t *fs, const char *path){
+    char norm[VSFS_MAX_PATH];
+    uint32_t parent;
+    const char *leaf;
+    if(fs->mode==VSFS_OPEN_RDONLY) return vsfs_fail("image opened read-only");
+    if(jnl_reserve(fs)!=0) return -1;
+    if(path_norm(path,norm)!=0) return -1;
+    if(norm[0]=='\0') return vsfs_fail("cannot remove the root directory");
+    if(path_parent(fs,norm,NULL,&parent,&leaf)!=0) return -1;
+
+    inode_t dir, in;
+    uint64_t pos;
+    dirent64_t *de;
+    if(vsfs_inode_get(fs,parent,&dir)!=0) return -1;
+    int r=dir_find(fs,&dir,leaf,&pos);
+    if(r<0) return -1;
+    if(!r) return vsfs_fail("'%s' not found",path);
+    if(dir_entry(fs,&dir,pos,&de)!=0) return -1;
+    const uint32_t ino=de->inode_no;
+    if(vsfs_inode_get(fs,ino,&in)!=0) return -1;
+    const int is_dir=(in.mode & VSFS_MODE_DIR)!=0;
+    if(is_dir){
+        if((r=vsfs_dir_iter(fs,ino,not_dot,NULL))<0) return -1;
+        if(r) return vsfs_fail("'%s': directory not empty",path);
+    }
+
+    if(dir_unlink(fs,parent,pos)!=0) return -1;
+    free_file_blocks(fs,&in);
+    vsfs_free_inode(fs,ino);
+    if(is_dir){
+        dcache_free(fs->dcache);
+        fs->dcache=NULL;
+    }
+    return 0;
+}
+
+typedef struct { vsfs_t *fs; uint8_t *buf; uint64_t n; } read_ctx;
+static int read_run(void *ctx, uint64_t lblk, uint32_t rel, uint32_t len){
+    read_ctx *c = ctx;
+    const uint64_t off = lblk*BS;
+    if(off >= c->n) return 1;
+    const uint64_t n = (uint64_t)len*BS < c->n-off ? (uint64_t)len*BS : c->n-off;
+    memcpy(c->buf+off, vsfs_data_block(c->fs,rel), n);
+    return 0;
+}
+
+// Copies the first n bytes of a file's content to buf.
+static int file_read(vsfs_t *fs, const inode_t *in, uint8_t *buf, uint64_t n){
+    if(in->flags & VSFS_INODE_INLINE){ memcpy(buf,vsfs_inline_data(in),n); return 0; }
+    if(in->flags & VSFS_INODE_COMPRESSED){
+        const uint64_t cl = vsfs_cluster_bytes(fs);
+        uint8_t *tmp = malloc(cl);
+        if(!tmp) return vsfs_fail_errno("malloc cluster buffer");
+        for(uint64_t c=0; c*cl<n; c++){
+            if(vsfs_read_cluster(fs,in,c,tmp)!=0){ free(tmp); return -1; }
+            memcpy(buf+c*cl,tmp,n-c*cl < cl ? n-c*cl : cl);
+        }
+        free(tmp);
+        return 0;
+    }
+    read_ctx c = { fs, buf, n };
+    return vsfs_file_runs(fs,in,read_run,&c) < 0 ? -1 : 0;
+}
+
+// vsfs_truncate() for layouts that cannot be cut or extended in place: the
+// content is read, stored again as a new file of `size` bytes, and that inode
+// is moved into slot ino (the number it was allocated under is given back).
+static int file_rewrite(vsfs_t *fs, const char *path, uint32_t ino, const inode_t *old, uint64_t size){
+    if(size > SIZE_MAX) return vsfs_fail("file too large: %s",path);
+    uint8_t *buf = calloc(1,size ? (size_t)size : 1);
+    if(!buf) return vsfs_fail_errno("calloc file buffer");
+    if(file_read(fs,old,buf,size < old->size_bytes ? size : old->size_bytes)!=0){ free(buf); return -1; }
+    uint32_t tmp;
+    inode_t in;
+    if(file_alloc(fs,path,size,&tmp,&in)!=0){ free(buf); return -1; }
+    if(file_fill(fs,&in,-1,buf)!=0){
+        free_file_blocks(fs,&in);
+        vsfs_free_inode(fs,tmp);
+        free(buf);
+        return -1;
+    }
+    free(buf);
+    compress_trim(fs,&in);
+    free_file_blocks(fs,old);
+    vsfs_free_inode(fs,tmp);
+    return vsfs_inode_put(fs,ino,&in);
+}
+
+// Clears bytes [size, end of block) of the block holding offset size of a
+// block-mapped file, copying it first if other files share it.
+static int tail_zero(vsfs_t *fs, inode_t *in, uint64_t size){
+    const uint64_t lblk = size/BS, from = size%BS;
+    uint32_t rel;
+    if(size && from==0) return 0;
+    if(vsfs_bmap(fs,in,lblk,&rel)!=0) return -1;
+    if(fs->ref_tbl && fs->ref_tbl[rel] > 1){
+        uint32_t copy;
+        if(vsfs_alloc_blocks(fs,1,&copy)!=0) return -1;
+        memcpy(vsfs_data_block(fs,copy),vsfs_data_block(fs,rel),BS);
+        vsfs_mark_dirty(fs, fs->sb.data_region_start + copy);
+        map_set(fs,in,lblk,copy);
+        vsfs_free_block(fs,rel);
+        rel = copy;
+    } else if(fs->dedup){
+        dedup_forget(fs,rel);   // its content is about to change
+    }
+    uint8_t *blk = vsfs_data_block(fs,rel);
+    if(jnl_direct(fs) && bit_get(fs->jnl->ondisk,rel)){
+        // written through the fd in this transaction: so is the cut
+        static const uint8_t zero[BS];
+        if(pwrite_full(fs->fd,zero,BS-from,(uint64_t)(blk-fs->img)+from)!=0) return vsfs_fail_errno("write image");
+        return 0;
+    }
+    memset(blk+from,0,BS-from);
+    vsfs_mark_dirty(fs, fs->sb.data_region_start + rel);
+    return 0;
+}
+
+int vsfs_truncate(vsfs_t *fs, const char *path, uint64_t size){
+    uint32_t ino;
+    inode_t in;
+    if(fs->mode==VSFS_OPEN_RDONLY) return vsfs_fail("image opened read-only");
+    if(jnl_reserve(fs)!=0) return -1;
+    if(vsfs_lookup(fs,path,&ino)!=0 || vsfs_inode_get(fs,ino,&in)!=0) return -1;
+    if(in.mode & VSFS_MODE_DIR) return vsfs_fail("'%s' is a directory",path);
+    if((in.flags & (VSFS_INODE_INLINE | VSFS_INODE_EXTENTS | VSFS_INODE_COMPRESSED)) ||
+       ((fs->sb.flags & VSFS_FEAT_INLINE_DATA) && size <= VSFS_INLINE_MAX))
+        return file_rewrite(fs,path,ino,&in,size);
+
+    // block map: every file has at least one block
+    const uint64_t have = in.size_bytes ? (in.size_bytes+BS-1)/BS : 1, want = size ? (size+BS-1)/BS : 1;
+    if(want > VSFS_MAX_FILE_BLOCKS) return vsfs_fail("file too large: %s",path);
+    if(want > have){
+        if(want-have + vsfs_map_meta_blocks(want)-vsfs_map_meta_blocks(have) > fs->sbx.free_blocks)
+            return vsfs_fail("not enough free data blocks");
+        for(uint64_t l=have; l<want; l++){
+            if(map_grow(fs,&in,l)!=0){ map_trim(fs,&in,have,l); return -1; }
+        }
+    } else {
+        map_trim(fs,&in,want,have);
+        if(size < in.size_bytes && tail_zero(fs,&in,size)!=0) return -1;
+    }
+    in.size_bytes=size;
+    in.mtime=in.ctime=vsfs_now(fs);
+    return vsfs_inode_put(fs,ino,&in);
+}
+
+// ========================== Batch import ==========================
+// Three phases: allocation (serial), content copy (parallel, each worker owns
+// whole files and writes only their data blocks), then inode + dirent linking
+// (serial). A file is linked only once its content is complete. Compression
+// runs in the copy phase; the blocks it saved are given back at linking.
+typedef struct {
+    vsfs_t *fs;
+    vsfs_add_req_t *reqs;
+    inode_t *inodes;
+    size_t n;
+    atomic_size_t next;
+} batch_t;
+
+static void req_fail(vsfs_add_req_t *r){
+    r->status=-1;
+    snprintf(r->error,sizeof(r->error),"%s",vsfs_errbuf);
+}
+
+static const char *req_name(const vsfs_add_req_t *r){
+    if(r->name) return r->name;
+    const char *slash=strrchr(r->host_path,'/');
+    return slash ? slash+1 : r->host_path;
+}
+
+static void *batch_worker(void *arg){
+    batch_t *b=arg;
+    for(size_t i; (i=atomic_fetch_add(&b->next,1)) < b->n; ){
+        vsfs_add_req_t *r=&b->reqs[i];
+        if(r->status!=0) continue;
+        int fd=open(r->host_path,O_RDONLY);
+        if(fd<0){ vsfs_fail_errno("open host file"); req_fail(r); continue; }
+        struct stat st;
+        if(fstat(fd,&st)!=0 || (uint64_t)st.st_size!=r->size){
+            vsfs_fail("host file '%s' changed during import",r->host_path); req_fail(r);
+        } else {
+            posix_fadvise(fd,0,0,POSIX_FADV_SEQUENTIAL);
+            if(file_fill(b->fs,&b->inodes[i],fd,NULL)!=0) req_fail(r);
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+int vsfs_add_files(vsfs_t *fs, vsfs_add_req_t *reqs, size_t n, int jobs){
+    if(fs->mode==VSFS_OPEN_RDONLY) return vsfs_fail("image opened read-only");
+    batch_t b = { fs, reqs, calloc(n ? n : 1, sizeof(inode_t)), n, 0 };
+    size_t *made = calloc(n ? n : 1, sizeof(size_t));   // see path_undo()
+    if(!b.inodes || !made){ free(b.inodes); free(made); return vsfs_fail_errno("calloc batch"); }
+    char norm[VSFS_MAX_PATH];
+
+    // 1. metadata allocation, in request order (same inode numbers as serial adds)
+    for(size_t i=0;i<n;i++){
+        vsfs_add_req_t *r=&reqs[i];
+        const char *name=req_name(r);
+        uint32_t dir_ino, hit;
+        uint8_t type=0;
+        struct stat st;
+        r->status=0; r->error[0]='\0'; r->ino=0; r->size=0;
+        if(stat(r->host_path,&st)!=0){ vsfs_fail_errno("stat host file"); req_fail(r); continue; }
+        if(!S_ISREG(st.st_mode)){ vsfs_fail("host file '%s' is not regular",r->host_path); req_fail(r); continue; }
+        if(path_norm(name,norm)!=0){ req_fail(r); continue; }
+        if(norm[0]=='\0'){ vsfs_fail("empty file name"); req_fail(r); continue; }
+        if(path_parent(fs,norm,&made[i],&dir_ino,&name)!=0){ req_fail(r); path_undo(fs,norm,&made[i]); continue; }
+        int found=dir_lookup(fs,dir_ino,name,&hit,&type);
+        if(found>0 && fs->replace && type==VSFS_DT_FILE) found=0;   // replaced when linked
+        if(found){ if(found>0) vsfs_fail("'%s' already exists",name); req_fail(r); path_undo(fs,norm,&made[i]); continue; }
+        r->size=(uint64_t)st.st_size;
+        if(file_alloc(fs,name,r->size,&r->ino,&b.inodes[i])!=0){ r->ino=0; req_fail(r); path_undo(fs,norm,&made[i]); }
+    }
+
+    // 2. content copy
+    pthread_t *tid = jobs>1 ? calloc((size_t)jobs,sizeof(pthread_t)) : NULL;
+    int started=0;
+    while(tid && started<jobs-1 && pthread_create(&tid[started],NULL,batch_worker,&b)==0) started++;
+    batch_worker(&b);          // the calling thread works too
+    for(int t=0;t<started;t++) pthread_join(tid[t],NULL);
+    free(tid);
+
+    // 3. linking, in request order
+    size_t failed=0;
+    for(size_t i=0;i<n;i++){
+        vsfs_add_req_t *r=&reqs[i];
+        uint32_t dir_ino, old;
+        uint64_t slot=0;
+        const char *name=req_name(r);
+        if(r->status==0){
+            compress_trim(fs,&b.inodes[i]);
+            // contents are complete by now, so an early commit writes them out
+            if(jnl_reserve(fs)!=0 || path_norm(name,norm)!=0 || path_parent(fs,norm,&made[i],&dir_ino,&name)!=0 ||
+               dir_slot(fs,dir_ino,name,&slot,&old)!=0 ||
+               vsfs_inode_put(fs,r->ino,&b.inodes[i])!=0 ||
+               file_link(fs,dir_ino,slot,name,r->ino,old)!=0) req_fail(r);
+            else continue;
+        }
+        if(r->ino){
+            free_file_blocks(fs,&b.inodes[i]);
+            vsfs_free_inode(fs,r->ino);
+            r->ino=0;
+        }
+        // directories made for it, unless phase 1 already took them back
+        if(made[i] && path_norm(req_name(r),norm)==0) path_undo(fs,norm,&made[i]);
+        failed++;
+    }
+    free(b.inodes);
+    free(made);
+    if(failed) return vsfs_fail("%zu of %zu files not added",failed,n);
+    return 0;
+}
+
+// ========================== Defragmentation ==========================
+// Every referenced block gets its new place in inode order, each file's blocks
+// in the order a fresh allocation would lay them out, and the pointers to it
+// are rewritten where they are; then the block contents are moved along the
+// cycles of that permutation with two spare blocks. The placement is run once
+// without writing anything, so a corrupt block map fails before any change.
+typedef struct {
+    vsfs_t *fs;
+    uint32_t *to;           // old relative block -> new one, UINT32_MAX = unreferenced
+    uint64_t next;          // next new place
+    uint32_t ino;           // inode being placed, for errors
+    int apply;              // 0: check only
+} defrag_t;
+
+// Gives block rel its new place (on first use) and stores it in *slot. Only a
+// data block of a --dedup image may be reached more than once.
+static int defrag_place(defrag_t *d, uint32_t rel, int shared_ok, uint32_t *slot){
+    vsfs_t *fs = d->fs;
+    if(rel >= fs->sb.data_region_blocks || !bit_get(fs->data_bm,rel))
+        return vsfs_fail("inode %u refers to free or out-of-range block %u",d->ino,rel);
+    if(d->to[rel]==UINT32_MAX) d->to[rel] = (uint32_t)d->next++;
+    else if(!shared_ok || !fs->ref_tbl) return vsfs_fail("block %u is used twice (inode %u)",rel,d->ino);
+    if(d->apply) *slot = d->to[rel];
+    return 0;
+}
+
+// A pointer block, then what it maps: data blocks (depth 0) or indirect blocks.
+static int defrag_ptrs(defrag_t *d, uint32_t *slot, int depth){
+    const uint32_t old = *slot;
+    if(!old) return 0;
+    if(defrag_place(d,old,0,slot)!=0) return -1;
+    if(d->apply) vsfs_mark_dirty(d->fs, d->fs->sb.data_region_start + *slot);   // its crc changes
+    uint32_t *p = ptr_block(d->fs,old);
+    for(uint32_t i=0;i<PTRS_PER_BLOCK;i++){
+        if(!p[i]) continue;
+        if((depth ? defrag_ptrs(d,&p[i],0) : defrag_place(d,p[i],1,&p[i]))!=0) return -1;
+    }
+    return 0;
+}
+
+// Extent-mapped data is never shared, so it lands in one run: [start, start+n).
+typedef struct { defrag_t *d; uint32_t start; uint64_t n; } defrag_ext_ctx;
+static int defrag_ext_fn(void *ctx, const vsfs_extent_t *e){
+    defrag_ext_ctx *c = ctx;
+    for(uint32_t k=0;k<e->len;k++){
+        uint32_t rel;
+        if(defrag_place(c->d,e->start+k,0,&rel)!=0) return -1;
+        if(c->n++ == 0) c->start = c->d->to[e->start+k];
+    }
+    return 0;
+}
+
+static int defrag_inode(defrag_t *d, uint32_t ino_no){
+    vsfs_t *fs = d->fs;
+    inode_t in;
+    if(vsfs_inode_get(fs,ino_no,&in)!=0) return -1;
+    if(in.flags & VSFS_INODE_INLINE) return 0;
+    d->ino = ino_no;
+    if(in.flags & (VSFS_INODE_COMPRESSED | VSFS_INODE_INDEXED)){
+        const uint32_t aux = in.aux_ptr;
+        uint32_t rel;
+        for(uint32_t k=0;k<in.aux_len;k++) if(defrag_place(d,aux+k,0,k ? &rel : &in.aux_ptr)!=0) return -1;
+    }
+    if(in.flags & VSFS_INODE_EXTENTS){
+        defrag_ext_ctx c = { d, 0, 0 };
+        if(extent_walk(fs,&in,defrag_ext_fn,&c)!=0) return -1;
+        // the overflow blocks are not needed any more and stay unplaced
+        vsfs_extent_root_t er;
+        memset(&er,0,sizeof(er));
+        if(c.n){ er.count = 1; er.ext[0].start = c.start; er.ext[0].len = (uint32_t)c.n; }
+        vsfs_extent_root_set(&in,&er);
+    } else {
+        for(int i=0;i<DIRECT_MAX;i++) if(in.direct[i] && defrag_place(d,in.direct[i],1,&in.direct[i])!=0) return -1;
+        if(defrag_ptrs(d,&in.indirect,0)!=0 || defrag_ptrs(d,&in.dindirect,1)!=0) return -1;
+    }
+    return d->apply ? vsfs_inode_put(fs,ino_no,&in) : 0;
+}
+
+static int defrag_pass(defrag_t *d){
+    vsfs_t *fs = d->fs;
+    memset(d->to,0xff,(size_t)fs->sb.data_region_blocks*sizeof(uint32_t));
+    d->to[0] = 0;           // the root's first block stays where the format put it
+    d->next = 1;
+    for(uint64_t i=bitmap_find_one(fs->inode_bm,fs->sb.inode_count,0); i<fs->sb.inode_count;
+        i=bitmap_find_one(fs->inode_bm,fs->sb.inode_count,i+1))
+        if(defrag_inode(d,(uint32_t)(i+1))!=0) return -1;
+    return 0;
+}
+
+static int count_run(void *ctx, uint64_t lblk, uint32_t rel, uint32_t len){
+    (void)lblk; (void)rel; (void)len;
+    (*(uint64_t *)ctx)++;
+    return 0;
+}
+
+static int count_runs(vsfs_t *fs, uint64_t *runs){
+    *runs = 0;
+    for(uint64_t i=bitmap_find_one(fs->inode_bm,fs->sb.inode_count,0); i<fs->sb.inode_count;
+        i=bitmap_find_one(fs->inode_bm,fs->sb.inode_count,i+1)){
+        inode_t in;
+        if(vsfs_inode_get(fs,(uint32_t)(i+1),&in)!=0 || vsfs_file_runs(fs,&in,count_run,runs)!=0) return -1;
+    }
+    return 0;
+}
+
+// Moves block contents so that block b ends up at to[b], and clears the
+// blocks in use before that are free afterwards (everything from next on),
+// so neither moved nor dropped contents stay behind in free space.
+static void defrag_move(vsfs_t *fs, const uint32_t *to, uint64_t next, uint8_t *picked, uint8_t *a, uint8_t *b){
+    const uint64_t nd = fs->sb.data_region_blocks;
+    for(uint64_t s=0;s<nd;s++){
+        if(to[s]==UINT32_MAX || to[s]==s || bit_get(picked,s)) continue;
+        memcpy(a,vsfs_data_block(fs,(uint32_t)s),BS);
+        bit_set(picked,s);
+        for(uint64_t cur=s;;){
+            const uint64_t t = to[cur];
+            if(to[t]!=UINT32_MAX && to[t]!=t && !bit_get(picked,t)){
+                // t still holds a block that has to move on: pick it up first
+                memcpy(b,vsfs_data_block(fs,(uint32_t)t),BS);
+                bit_set(picked,t);
+                memcpy(vsfs_data_block(fs,(uint32_t)t),a,BS);
+                uint8_t *x = a; a = b; b = x;
+                cur = t;
+            } else {
+                memcpy(vsfs_data_block(fs,(uint32_t)t),a,BS);
+                break;
+            }
+        }
+    }
+    for(uint64_t s=bitmap_find_one(fs->data_bm,nd,next); s<nd; s=bitmap_find_one(fs->data_bm,nd,s+1))
+        memset(vsfs_data_block(fs,(uint32_t)s),0,BS);
+}
+
+// Rearranges a per-block table (crc or refcount) like the blocks; free blocks get 0.
+static int defrag_table(vsfs_t *fs, uint32_t *tbl, const uint32_t *to, uint64_t tbl_blocks, uint64_t tbl_start){
+    const uint64_t nd = fs->sb.data_region_blocks;
+    uint32_t *t = calloc((size_t)nd,sizeof(uint32_t));
+    if(!t) return vsfs_fail_errno("calloc block table");
+    for(uint64_t b=0;b<nd;b++) if(to[b]!=UINT32_MAX) t[to[b]] = tbl[b];
+    memcpy(tbl,t,(size_t)nd*sizeof(uint32_t));
+    free(t);
+    for(uint64_t k=0;k<tbl_blocks;k++) vsfs_mark_dirty(fs,tbl_start+k);
+    return 0;
+}
+
+int vsfs_defrag(vsfs_t *fs, vsfs_defrag_stats_t *st){
+    memset(st,0,sizeof(*st));
+    if(fs->mode!=VSFS_OPEN_COPY) return vsfs_fail("defragmenting needs a private copy of the image");
+    if(fs->dedup) return vsfs_fail("defragment before enabling deduplication");
+    const uint64_t nd = fs->sb.data_region_blocks;
+    defrag_t d = { fs, malloc((size_t)nd*sizeof(uint32_t)), 0, 0, 0 };
+    uint8_t *picked = calloc((size_t)(nd+63)/64*8,1), *spare = malloc(2*(size_t)BS);
+    int rc = -1;
+    if(!d.to || !picked || !spare){ vsfs_fail_errno("malloc defrag maps"); goto out; }
+    if(count_runs(fs,&st->runs_before)!=0 || defrag_pass(&d)!=0) goto out;
+    d.apply = 1;
+    if(defrag_pass(&d)!=0) goto out;   // cannot fail after the check pass
+
+    for(uint64_t b=0;b<nd;b++){
+        if(d.to[b]!=UINT32_MAX && d.to[b]!=b) st->moved++;
+        if(d.to[b]==UINT32_MAX && bit_get(fs->data_bm,b)) st->dropped++;
+    }
+    defrag_move(fs,d.to,d.next,picked,spare,spare+BS);
+    if(fs->crc_tbl && defrag_table(fs,fs->crc_tbl,d.to,fs->sbx.crc_table_blocks,fs->sbx.crc_table_start)!=0) goto out;
+    if(fs->ref_tbl && defrag_table(fs,fs->ref_tbl,d.to,fs->sbx.ref_table_blocks,fs->sbx.ref_table_start)!=0) goto out;
+    for(uint64_t b=0;b<nd;b++){
+        if(b<d.next) bit_set(fs->data_bm,b); else bit_clear(fs->data_bm,b);
+    }
+    for(uint64_t k=0;k<fs->sb.data_bitmap_blocks;k++) vsfs_mark_dirty(fs,fs->sb.data_bitmap_start+k);
+    fs->sbx.free_blocks = nd - d.next;
+    fs->data_hint = fs->data_rover = d.next;
+    // moved blocks have to be verified again at their new place
+    memset(fs->verified,0,(size_t)((fs->sb.total_blocks+63)/64*8));
+    st->blocks = d.next;
+    rc = count_runs(fs,&st->runs_after);
+out:
+    free(d.to); free(picked); free(spare);
+    return rc;
+}
+
+// ========================== Resize ==========================
+// The data region is the last region of a formatted image, so it grows and
+// shrinks at its end. What covers it block by block - the data bitmap and the
+// crc and refcount tables - stays in front while it is large enough for the
+// new size; otherwise it moves past the end of the data region, and from then
+// on moves with that end. Each step writes the moved tables only where the
+// current superblock has nothing, syncs, and then switches the superblock, so
+// a crash leaves either the old or the new layout. Tables left behind in
+// front are not reused. Table entries past the data region are kept zero.
+enum { TBL_BITMAP, TBL_CRC, TBL_REF, TBL_N };
+static const uint64_t tbl_per_block[TBL_N] = { 8u*BS, CRCS_PER_BLOCK, CRCS_PER_BLOCK };
+
+typedef struct {
+    uint64_t start[TBL_N], blocks[TBL_N];   // where each table ends up (0 blocks: feature off)
+    int moved[TBL_N];                       // written to a new place by this step
+    uint64_t data_blocks;                   // new data region size
+} resize_plan_t;
+
+static uint64_t tbl_need(int t, uint64_t d){ return (d + tbl_per_block[t] - 1)/tbl_per_block[t]; }
+
+static void tbl_current(const vsfs_t *fs, uint64_t *start, uint64_t *blocks){
+    start[TBL_BITMAP] = fs->sb.data_bitmap_start; blocks[TBL_BITMAP] = fs->sb.data_bitmap_blocks;
+    start[TBL_CRC] = fs->sbx.crc_table_start; blocks[TBL_CRC] = fs->crc_tbl ? fs->sbx.crc_table_blocks : 0;
+    start[TBL_REF] = fs->sbx.ref_table_start; blocks[TBL_REF] = fs->ref_tbl ? fs->sbx.ref_table_blocks : 0;
+}
+
+static uint64_t tail_cost(const int *tail, uint64_t d){
+    uint64_t c = 0;
+    for(int t=0;t<TBL_N;t++) if(tail[t]) c += tbl_need(t,d);
+    return c;
+}
+
+// Layout for an image of `total` blocks: the largest data region that fits
+// next to the tables that have to sit past it.
+static int resize_plan(const vsfs_t *fs, uint64_t total, resize_plan_t *p){
+    const uint64_t drs = fs->sb.data_region_start;
+    uint64_t start[TBL_N], blocks[TBL_N];
+    int tail[TBL_N];
+    tbl_current(fs,start,blocks);
+    if(total <= drs + 1) return vsfs_fail("%" PRIu64 " blocks leave no data region",total);
+    for(int t=0;t<TBL_N;t++) tail[t] = blocks[t] && start[t] >= drs;
+    uint64_t d;
+    for(;;){
+        double per_data = 1.0;
+        for(int t=0;t<TBL_N;t++) if(tail[t]) per_data += 1.0/(double)tbl_per_block[t];
+        d = (uint64_t)((double)(total - drs) / per_data);
+        if(d > total - drs) d = total - drs;
+        while(d && drs + d + tail_cost(tail,d) > total) d--;
+        while(drs + d + 1 + tail_cost(tail,d+1) <= total) d++;
+        int more = 0;
+        for(int t=0;t<TBL_N;t++)
+            if(blocks[t] && !tail[t] && blocks[t]*tbl_per_block[t] < d){ tail[t] = 1; more = 1; }
+        if(!more) break;
+    }
+    if(d == 0) return vsfs_fail("%" PRIu64 " blocks leave no data region",total);
+    if(d > UINT32_MAX) return vsfs_fail("data region exceeds 2^32 blocks");
+    p->data_blocks = d;
+    uint64_t pos = drs + d;
+    int last = -1;
+    for(int t=0;t<TBL_N;t++){
+        p->moved[t] = tail[t];
+        p->start[t] = start[t]; p->blocks[t] = blocks[t];
+        if(!tail[t]) continue;
+        p->start[t] = pos; p->blocks[t] = tbl_need(t,d);
+        pos += p->blocks[t];
+        last = t;
+    }
+    if(last >= 0) p->blocks[last] += total - pos;   // rounding slack
+    return 0;
+}
+
+// Image bytes at off: into the copy, or into the file through the fd.
+static int img_write(vsfs_t *fs, uint64_t off, const void *p, uint64_t n){
+    if(fs->mode==VSFS_OPEN_COPY){ memmove(fs->img + off, p, (size_t)n); return 0; }
+    return pwrite_full(fs->fd,p,n,off)==0 ? 0 : vsfs_fail_errno("write image");
+}
+
+static int img_zero(vsfs_t *fs, uint64_t off, uint64_t n){
+    static const uint8_t zero_block[BS];
+    for(uint64_t k=0; k<n; k+=BS){
+        if(img_write(fs, off+k, zero_block, n-k < BS ? n-k : BS)!=0) return -1;
+    }
+    return 0;
+}
+
+static int img_sync(vsfs_t *fs){
+    if(fs->mode!=VSFS_OPEN_COPY && fdatasync(fs->fd)!=0) return vsfs_fail_errno("fdatasync image");
+    return 0;
+}
+
+// Makes the image `blocks` long; in place the file is mapped again, so the
+// mapping shows what was written through the fd.
+static int img_set_size(vsfs_t *fs, uint64_t blocks){
+    const size_t size = (size_t)(blocks*BS);
+    if(fs->mode==VSFS_OPEN_COPY){
+        if(size > fs->img_size){
+            uint8_t *m = realloc(fs->img, size);
+            if(!m) return vsfs_fail_errno("realloc image");
+            memset(m + fs->img_size, 0, size - fs->img_size);
+            fs->img = m;
+        }
+        fs->img_size = size;
+        return 0;
+    }
+    if(ftruncate(fs->fd,(off_t)size)!=0) return vsfs_fail_errno("resize image file");
+    munmap(fs->img, fs->img_size);
+    void *m = mmap(NULL, size, PROT_READ|PROT_WRITE, (fs->sb.flags & VSFS_FEAT_JOURNAL) ? MAP_PRIVATE : MAP_SHARED, fs->fd, 0);
+    if(m==MAP_FAILED){ fs->img = NULL; fs->img_size = 0; return vsfs_fail_errno("mmap image"); }
+    fs->img = m; fs->img_size = size;
+    return 0;
+}
+
+// A bitmap of n bits as whole 64-bit words, keeping the first `keep` bits of *map.
+static int map_resize(uint8_t **map, uint64_t keep, uint64_t n){
+    const size_t bytes = (size_t)((n+63)/64*8), kept = (size_t)((keep < n ? keep : n)+7)/8;
+    uint8_t *m = calloc(1, bytes);
+    if(!m) return vsfs_fail_errno("calloc block map");
+    if(*map){ memcpy(m, *map, kept); free(*map); }
+    *map = m;
+    return 0;
+}
+
+// Points the handle at the new layout.
+static int resize_handle(vsfs_t *fs, uint64_t old_total){
+    fs->inode_bm    = fs->img + fs->sb.inode_bitmap_start * BS;
+    fs->data_bm     = fs->img + fs->sb.data_bitmap_start  * BS;
+    fs->inode_tbl   = fs->img + fs->sb.inode_table_start * BS;
+    fs->data_region = fs->img + fs->sb.data_region_start * BS;
+    if(fs->crc_tbl) fs->crc_tbl = (uint32_t *)(fs->img + fs->sbx.crc_table_start * BS);
+    if(fs->ref_tbl) fs->ref_tbl = (uint32_t *)(fs->img + fs->sbx.ref_table_start * BS);
+    const uint64_t nd = fs->sb.data_region_blocks;
+    if(fs->data_hint > nd) fs->data_hint = nd;
+    if(fs->data_rover > nd) fs->data_rover = nd;
+    free(fs->verified); fs->verified = NULL;   // blocks are checked again at their new place
+    if(map_resize(&fs->verified, 0, fs->sb.total_blocks)!=0) return -1;
+    if(fs->dirty && map_resize(&fs->dirty, old_total, fs->sb.total_blocks)!=0) return -1;
+    if(fs->jnl){
+        struct vsfs_journal *j = fs->jnl;
+        if(map_resize(&j->fresh, 0, nd)!=0 || map_resize(&j->ondisk, 0, nd)!=0) return -1;
+        free(j->crc_logged);
+        if(!(j->crc_logged = calloc(1,(size_t)(fs->sbx.crc_table_blocks/8+1)))) return vsfs_fail_errno("calloc journal maps");
+    }
+    return 0;
+}
+
+static int resize_step(vsfs_t *fs, uint64_t total, const resize_plan_t *p){
+    const uint64_t old_total = fs->sb.total_blocks, old_nd = fs->sb.data_region_blocks;
+    const uint64_t d = p->data_blocks;
+    uint64_t start[TBL_N], blocks[TBL_N];
+    tbl_current(fs,start,blocks);
+    if(total > fs->img_size/BS && img_set_size(fs,total)!=0) return -1;
+    for(int t=0;t<TBL_N;t++){
+        if(!blocks[t]) continue;
+        if(p->moved[t]){
+            const uint64_t keep = (blocks[t] < p->blocks[t] ? blocks[t] : p->blocks[t]) * BS;
+            if(img_write(fs, p->start[t]*BS, fs->img + start[t]*BS, keep)!=0 ||
+               img_zero(fs, p->start[t]*BS + keep, p->blocks[t]*BS - keep)!=0) return -1;
+        } else if(t!=TBL_BITMAP && d < old_nd){
+            // entries of the blocks cut off (the bitmap bits are clear already)
+            if(img_zero(fs, start[t]*BS + d*4, (old_nd-d)*4)!=0) return -1;
+        }
+    }
+    if(img_sync(fs)!=0) return -1;
+
+    fs->sbx.free_blocks = fs->sbx.free_blocks + d - old_nd;
+    fs->sb.total_blocks = total;
+    fs->sb.data_region_blocks = d;
+    fs->sb.data_bitmap_start = p->start[TBL_BITMAP]; fs->sb.data_bitmap_blocks = p->blocks[TBL_BITMAP];
+    if(blocks[TBL_CRC]){ fs->sbx.crc_table_start = p->start[TBL_CRC]; fs->sbx.crc_table_blocks = p->blocks[TBL_CRC]; }
+    if(blocks[TBL_REF]){ fs->sbx.ref_table_start = p->start[TBL_REF]; fs->sbx.ref_table_blocks = p->blocks[TBL_REF]; }
+    fs->sb.mtime_epoch = vsfs_now(fs);
+    superblock_crc_finalize_ext(&fs->sb,&fs->sbx);
+    uint8_t b0[BS];
+    memset(b0,0,BS);
+    memcpy(b0,&fs->sb,sizeof(fs->sb));
+    memcpy(b0+VSFS_SB_EXT_OFFSET,&fs->sbx,sizeof(fs->sbx));
+    if(img_write(fs,0,b0,BS)!=0 || img_sync(fs)!=0) return -1;
+    if(img_set_size(fs,total)!=0) return -1;
+    return resize_handle(fs,old_total);
+}
+
+int vsfs_resize(vsfs_t *fs, uint64_t total_blocks){
+    if(fs->mode==VSFS_OPEN_RDONLY) return vsfs_fail("image opened read-only");
+    if(fs->mode==VSFS_OPEN_INPLACE && any_dirty(fs)) return vsfs_fail("commit pending changes before resizing");
+    if(fs->dedup) return vsfs_fail("resize before enabling deduplication");
+    if(total_blocks == fs->sb.total_blocks) return 0;
+    resize_plan_t p;
+    if(resize_plan(fs,total_blocks,&p)!=0) return -1;
+    const uint64_t nd = fs->sb.data_region_blocks;
+    const uint64_t used = bitmap_find_one(fs->data_bm, nd, p.data_blocks < nd ? p.data_blocks : nd);
+    if(used < nd) return vsfs_fail("data block %" PRIu64 " past the new end is in use",used);
+
+    // tables already past the data region end where the new ones go when the
+    // size changes by less than their length: go through a layout past both
+    const uint64_t old_tail = fs->sb.data_region_start + nd, new_tail = fs->sb.data_region_start + p.data_blocks;
+    int overlap = 0;
+    uint64_t start[TBL_N], blocks[TBL_N];
+    tbl_current(fs,start,blocks);
+    for(int t=0;t<TBL_N;t++)
+        if(blocks[t] && start[t] >= old_tail && new_tail < fs->sb.total_blocks && p.moved[t]) overlap = 1;
+    if(overlap){
+        const uint64_t top = total_blocks > fs->sb.total_blocks ? total_blocks : fs->sb.total_blocks;
+        uint64_t via = top + (total_blocks - new_tail);
+        resize_plan_t q;
+        for(;;){
+            if(resize_plan(fs,via,&q)!=0) return -1;
+            if(fs->sb.data_region_start + q.data_blocks >= top) break;
+            via += top - (fs->sb.data_region_start + q.data_blocks);
+        }
+        if(resize_step(fs,via,&q)!=0 || resize_plan(fs,total_blocks,&p)!=0) return -1;
+    }
+    return resize_step(fs,total_blocks,&p);
+}
+
+uint64_t vsfs_min_total_blocks(vsfs_t *fs){
+    const uint64_t nd = fs->sb.data_region_blocks;
+    uint64_t d = 1;     // the root directory block
+    for(uint64_t b=bitmap_find_one(fs->data_bm,nd,0); b<nd; b=bitmap_find_one(fs->data_bm,nd,b+1)) d = b+1;
+    uint64_t start[TBL_N], blocks[TBL_N];
+    int tail[TBL_N];
+    tbl_current(fs,start,blocks);
+    for(int t=0;t<TBL_N;t++) tail[t] = blocks[t] && start[t] >= fs->sb.data_region_start;
+    return fs->sb.data_region_start + d + tail_cost(tail,d);
+}
+
+// ========================== Scrub ==========================
+// Metadata is checked serially (it is small); data blocks are hashed by a pool
+// of threads that each claim 4 MiB chunks of the data region, prefetch the
+// chunk and crc its allocated blocks with the runtime-selected crc32 engine.
+#define SCRUB_CHUNK 1024u
+
+typedef struct {
+    vsfs_t *fs;
+    vsfs_scrub_stats_t *st;
+    vsfs_scrub_cb cb;
+    void *ctx;
+    pthread_mutex_t lock;       // cb and the data totals in *st
+    atomic_uint_fast64_t next;  // next chunk to claim
+    uint64_t nchunks;
+} scrub_t;
+
+static void scrub_report(scrub_t *s, const char *fmt, ...){
+    char msg[256];
+    va_list ap; va_start(ap,fmt);
+    vsnprintf(msg,sizeof(msg),fmt,ap);
+    va_end(ap);
+    pthread_mutex_lock(&s->lock);
+    if(s->cb) s->cb(s->ctx,msg);
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void *scrub_worker(void *arg){
+    scrub_t *s=arg;
+    vsfs_t *fs=s->fs;
+    const uint64_t nbits=fs->sb.data_region_blocks;
+    const uintptr_t page=(uintptr_t)sysconf(_SC_PAGESIZE);
+    uint64_t checked=0, bad=0;
+    for(uint64_t c; (c=atomic_fetch_add(&s->next,1)) < s->nchunks; ){
+        const uint64_t lo=c*SCRUB_CHUNK, hi = lo+SCRUB_CHUNK < nbits ? lo+SCRUB_CHUNK : nbits;
+        for(uint64_t b=bitmap_find_one(fs->data_bm,hi,lo); b<hi; b=bitmap_find_one(fs->data_bm,hi,b)){
+            const uint64_t end=bitmap_find_zero(fs->data_bm,hi,b);
+            if(fs->fd>=0){
+                // have the kernel read the run ahead of the crc loop; free
+                // blocks are never read, so holes of a sparse image stay holes
+                uintptr_t a=(uintptr_t)vsfs_data_block(fs,(uint32_t)b), start=a & ~(page-1);
+                madvise((void *)start,(size_t)(a + (end-b)*BS - start),MADV_WILLNEED);
+            }
+            for(; b<end; b++){
+                const uint32_t want=fs->crc_tbl[b], got=crc_of(vsfs_data_block(fs,(uint32_t)b),BS);
+                checked++;
+                if(got!=want){
+                    bad++;
+                    scrub_report(s,"data block %" PRIu64 ": crc %08x, table has %08x",b,got,want);
+                }
+            }
+        }
+    }
+    pthread_mutex_lock(&s->lock);
+    s->st->data_blocks+=checked;
+    s->st->bad_data_blocks+=bad;
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+static int count_refs(void *ctx, uint64_t lblk, uint32_t rel, uint32_t len){
+    uint32_t *refs = ctx;
+    (void)lblk;
+    for(uint32_t k=0;k<len;k++) if(refs[rel+k] < UINT32_MAX) refs[rel+k]++;
+    return 0;
+}
+
+int vsfs_scrub(vsfs_t *fs, int jobs, vsfs_scrub_stats_t *st, vsfs_scrub_cb cb, void *ctx){
+    vsfs_scrub_stats_t local;
+    if(!st) st=&local;
+    memset(st,0,sizeof(*st));
+    scrub_t s = { .fs=fs, .st=st, .cb=cb, .ctx=ctx, .lock=PTHREAD_MUTEX_INITIALIZER };
+    uint64_t problems=0;
+    if(!superblock_ok(fs->img)){ problems++; scrub_report(&s,"superblock checksum mismatch"); }
+    const uint64_t free_blocks = fs->sb.data_region_blocks - bitmap_count(fs->data_bm,fs->sb.data_region_blocks);
+    const uint64_t free_inodes = fs->sb.inode_count - bitmap_count(fs->inode_bm,fs->sb.inode_count);
+    if(fs->sbx.free_blocks!=free_blocks){
+        problems++; scrub_report(&s,"superblock: %" PRIu64 " free data blocks, bitmap has %" PRIu64,fs->sbx.free_blocks,free_blocks);
+    }
+    if(fs->sbx.free_inodes!=free_inodes){
+        problems++; scrub_report(&s,"superblock: %" PRIu64 " free inodes, bitmap has %" PRIu64,fs->sbx.free_inodes,free_inodes);
+    }
+    uint32_t *refs = NULL;      // file references per data block, against the refcount table
+    if(fs->ref_tbl && !(refs = calloc((size_t)fs->sb.data_region_blocks,sizeof(*refs)))){
+        pthread_mutex_destroy(&s.lock); return vsfs_fail_errno("calloc reference counts");
+    }
+
+    // every allocated inode, and every block of each directory
+    const uint64_t ninodes=fs->sb.inode_count;
+    for(uint64_t i=bitmap_find_one(fs->inode_bm,ninodes,0); i<ninodes; i=bitmap_find_one(fs->inode_bm,ninodes,i+1)){
+        const uint32_t ino=(uint32_t)(i+1);
+        const uint8_t *slot=fs->inode_tbl + i*INODE_SIZE;
+        st->inodes++;
+        if(!inode_ok(slot)){ st->bad_inodes++; scrub_report(&s,"inode %u: checksum mismatch",ino); continue; }
+        inode_t in;
+        memcpy(&in,slot,INODE_SIZE);
+        if(refs && !(in.mode & VSFS_MODE_DIR) && vsfs_file_runs(fs,&in,count_refs,refs)<0){
+            problems++; scrub_report(&s,"inode %u: %s",ino,vsfs_errbuf);
+        }
+        if(!(in.mode & VSFS_MODE_DIR)) continue;
+        for(uint64_t l=0; l<(in.size_bytes+BS-1)/BS; l++){
+            uint32_t rel;
+            size_t ent;
+            st->dir_blocks++;
+            if(vsfs_bmap(fs,&in,l,&rel)!=0){
+                st->bad_dir_blocks++;
+                scrub_report(&s,"directory inode %u, block %" PRIu64 ": %s",ino,l,vsfs_errbuf);
+            } else if(!dir_block_ok(fs,rel,&ent)){
+                st->bad_dir_blocks++;
+                scrub_report(&s,"directory inode %u, data block %u: dirent %zu checksum mismatch",ino,rel,ent);
+            }
+        }
+    }
+
+    if(fs->crc_tbl){
+        s.nchunks=(fs->sb.data_region_blocks+SCRUB_CHUNK-1)/SCRUB_CHUNK;
+        pthread_t *tid = jobs>1 ? calloc((size_t)jobs,sizeof(pthread_t)) : NULL;
+        int started=0;
+        while(tid && started<jobs-1 && pthread_create(&tid[started],NULL,scrub_worker,&s)==0) started++;
+        scrub_worker(&s);
+        for(int t=0;t<started;t++) pthread_join(tid[t],NULL);
+        free(tid);
+    }
+
+    for(uint64_t b=0; refs && b<fs->sb.data_region_blocks; b++){
+        const uint32_t want=fs->ref_tbl[b];
+        if(refs[b]>1) st->shared_blocks++;
+        if(want>1 ? refs[b]==want : refs[b]<=1) continue;
+        st->bad_refcounts++;
+        scrub_report(&s,"data block %" PRIu64 ": %u file references, refcount table has %u",b,refs[b],want);
+    }
+    free(refs);
+    pthread_mutex_destroy(&s.lock);
+
+    problems += st->bad_refcounts + st->bad_inodes + st->bad_dir_blocks + st->bad_data_blocks;
+    if(problems) return vsfs_fail("%" PRIu64 " problem%s found",problems,problems==1 ? "" : "s");
+    return 0;
+}
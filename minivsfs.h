@@ -0,0 +1,516 @@
+// minivsfs.h - shared MiniVSFS core: on-disk structures and image handle API
+//
+// Link: gcc -O2 -std=c17 -Wall -Wextra -pthread tool.c minivsfs.c crc32.c lz4.c -o tool
+//
+// All functions returning int use 0 for success and -1 for failure; the
+// failure reason is available from vsfs_last_error() (per thread).
+#ifndef MINIVSFS_H
+#define MINIVSFS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "crc32.h"
+
+#define BS 4096u               // block size
+#define INODE_SIZE 128u
+#define ROOT_INO 1u
+#define DIRECT_MAX 12
+#define MAX_FILENAME 58
+#define VSFS_MAX_PATH 4096    // image paths, including the terminating NUL
+#define PTRS_PER_BLOCK (BS/4u)  // uint32_t entries in an indirect block
+// direct + single-indirect + double-indirect
+#define VSFS_MAX_FILE_BLOCKS ((uint64_t)DIRECT_MAX + PTRS_PER_BLOCK + (uint64_t)PTRS_PER_BLOCK*PTRS_PER_BLOCK)
+
+#define VSFS_MAGIC 0x4D565346u // "MVSF"
+// superblock_t.version written by this build. Version 1 images have no free
+// counters in the extension; they are counted from the bitmaps on open.
+#define VSFS_VERSION 2u
+
+// superblock_t.flags feature bits (set by mkfs_builder). Images carrying a bit
+// this build does not know are refused.
+#define VSFS_FEAT_EXTENTS   0x0001u  // regular files use extents instead of block pointers
+#define VSFS_FEAT_DIR_INDEX 0x0002u  // directories keep a hashed name index (built on first add)
+#define VSFS_FEAT_DATA_CRC  0x0004u  // crc32 of every data-region block in a table after the inode table
+#define VSFS_FEAT_JOURNAL   0x0008u  // in-place commits go through a write-ahead metadata journal
+#define VSFS_FEAT_INLINE_DATA 0x0010u // files of up to VSFS_INLINE_MAX bytes live in their inode
+#define VSFS_FEAT_DEDUP     0x0020u  // data blocks may be shared between files; refcount table after the crc table
+#define VSFS_FEAT_COMPRESS  0x0040u  // file data is stored in LZ4-compressed clusters where that saves blocks
+#define VSFS_FEAT_KNOWN     (VSFS_FEAT_EXTENTS | VSFS_FEAT_DIR_INDEX | VSFS_FEAT_DATA_CRC | VSFS_FEAT_JOURNAL | \
+                             VSFS_FEAT_INLINE_DATA | VSFS_FEAT_DEDUP | VSFS_FEAT_COMPRESS)
+
+// inode_t.flags
+#define VSFS_INODE_EXTENTS 0x0001u // direct[]/indirect/dindirect hold a vsfs_extent_root_t
+#define VSFS_INODE_INDEXED 0x0002u // directory: aux_ptr/aux_len locate its vsfs_dir_index_t
+#define VSFS_INODE_INLINE  0x0004u // regular file: direct[]/indirect/dindirect hold the content itself
+#define VSFS_INODE_COMPRESSED 0x0008u // regular file: aux_ptr/aux_len locate its vsfs_cluster_t table
+
+#define VSFS_MODE_FILE 0x8000
+#define VSFS_MODE_DIR  0x4000
+#define VSFS_DT_FILE 1
+#define VSFS_DT_DIR  2
+
+// ====================== On-disk structures ======================
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t magic;               // 0x4D565346 ("MVSF")
+    uint32_t version;             // VSFS_VERSION (1 or 2)
+    uint32_t block_size;          // 4096
+    uint64_t total_blocks;
+
+    uint64_t inode_count;
+    uint64_t inode_bitmap_start;  // block index
+    uint64_t inode_bitmap_blocks; // = 1
+    uint64_t data_bitmap_start;   // block index
+    uint64_t data_bitmap_blocks;  // = 1
+    uint64_t inode_table_start;   // block index
+    uint64_t inode_table_blocks;  // ceil(inode_count*128 / 4096)
+    uint64_t data_region_start;   // block index
+    uint64_t data_region_blocks;  // remaining
+    uint64_t root_inode;          // = 1
+    uint64_t mtime_epoch;         // build time
+    uint32_t flags;               // VSFS_FEAT_* bits, 0 for a plain image
+
+    uint32_t checksum;            // crc32(superblock[0..4091]) (must be last)
+} superblock_t;
+#pragma pack(pop)
+_Static_assert(sizeof(superblock_t) == 116, "superblock must fit in one block");
+
+// Superblock extension: fields added after version 1, stored at
+// VSFS_SB_EXT_OFFSET in block 0. The superblock crc spans the whole block, so
+// they are covered too; on images without the features using them they are 0.
+// The free counters are exact on version 2 images and move with every bitmap
+// change (a block freed under a journal counts once the transaction commits).
+#define VSFS_SB_EXT_OFFSET 128u
+#pragma pack(push, 1)
+typedef struct {
+    uint64_t crc_table_start;     // VSFS_FEAT_DATA_CRC: block index
+    uint64_t crc_table_blocks;    // >= ceil(data_region_blocks*4 / 4096)
+    uint64_t journal_start;       // VSFS_FEAT_JOURNAL: block index
+    uint64_t journal_blocks;      // header + descriptors + logged blocks
+    uint64_t ref_table_start;     // VSFS_FEAT_DEDUP: block index
+    uint64_t ref_table_blocks;    // >= ceil(data_region_blocks*4 / 4096)
+    uint64_t cluster_blocks;      // VSFS_FEAT_COMPRESS: blocks per compression cluster (power of two)
+    uint64_t free_blocks;         // version 2: clear data bitmap bits
+    uint64_t free_inodes;         // version 2: clear inode bitmap bits
+    uint64_t reserved[23];
+} vsfs_sb_ext_t;
+#pragma pack(pop)
+_Static_assert(sizeof(vsfs_sb_ext_t) == 256, "superblock extension size mismatch");
+_Static_assert(VSFS_SB_EXT_OFFSET + sizeof(vsfs_sb_ext_t) <= BS - 4, "superblock extension must not reach the crc");
+#define CRCS_PER_BLOCK (BS/4u)      // uint32_t entries in a data crc table block
+// Refcount table (VSFS_FEAT_DEDUP): one uint32_t per data-region block, the
+// number of files sharing it. 0 means at most one owner, so the table is all
+// zero until a block is actually shared. Same entries per block as the crc table.
+
+// Write-ahead journal (VSFS_FEAT_JOURNAL), between the crc table and the data
+// region. Block 0 is the header; a committed transaction follows it as
+// ceil(n/512) descriptor blocks (the home block number of each logged block,
+// uint64_t) and then the n block images in descriptor order.
+#define VSFS_JOURNAL_MAGIC     0x4C4E4A56u // "VJNL"
+#define VSFS_JOURNAL_CLEAN     0u          // nothing to replay
+#define VSFS_JOURNAL_COMMITTED 1u          // the transaction must be (re)applied
+#define JOURNAL_TAGS_PER_BLOCK (BS/8u)
+#define VSFS_JOURNAL_MIN_BLOCKS 16u
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t magic;         // VSFS_JOURNAL_MAGIC
+    uint32_t state;         // VSFS_JOURNAL_*
+    uint64_t seq;           // transaction number, +1 per commit
+    uint64_t nblocks;       // blocks logged by the transaction
+    uint32_t body_crc;      // crc32 of the descriptor blocks and block images
+    uint32_t crc;           // crc32 of this header with crc = 0
+} vsfs_journal_hdr_t;
+#pragma pack(pop)
+
+#pragma pack(push,1)
+typedef struct {
+    uint16_t mode;          // 0x8000=file, 0x4000=dir
+    uint16_t links;         // root=2 (., ..); files=1
+    uint32_t uid;           // 0
+    uint32_t gid;           // 0
+    uint64_t size_bytes;    // file/dir size
+    uint64_t atime;         // now
+    uint64_t mtime;         // now
+    uint64_t ctime;         // now
+    uint32_t direct[DIRECT_MAX]; // MiniVSFS: use RELATIVE index inside data region
+    uint32_t indirect;      // RELATIVE block of 1024 data pointers (file blocks 12..1035); 0 = none
+    uint32_t dindirect;     // RELATIVE block of 1024 pointers to indirect blocks; 0 = none
+    uint32_t flags;         // VSFS_INODE_* bits (formerly reserved_2)
+    uint32_t proj_id;       // group id if you want; keep 0
+    uint32_t stored_blocks; // compressed file: mapped blocks holding its clusters (formerly uid16_gid16)
+    uint32_t aux_ptr;       // indexed dir: RELATIVE first block of the hash index (formerly xattr_ptr);
+                            // compressed file: RELATIVE first block of the cluster table
+    uint32_t aux_len;       // length of that run in blocks
+
+    uint64_t inode_crc;     // low 4 bytes = crc32 of bytes [0..119]
+} inode_t;
+#pragma pack(pop)
+_Static_assert(sizeof(inode_t)==INODE_SIZE, "inode size mismatch");
+
+// Inline mode: a file of up to 56 bytes keeps its content in the pointer area
+// (covered by the inode crc) and owns no data block at all.
+#define VSFS_INLINE_MAX (DIRECT_MAX*4u + 8u)
+static inline const uint8_t *vsfs_inline_data(const inode_t *ino){ return (const uint8_t *)ino->direct; }
+
+// Compressed mode: the file is cut into clusters of sbx.cluster_blocks blocks,
+// each LZ4-compressed into as few blocks as it needs, or stored as is if that
+// saves no block. The block map (block-mapped files only) covers the
+// stored_blocks stored blocks, clusters back to back; the table at aux_ptr
+// (aux_len contiguous blocks) holds one entry per cluster, in file order.
+#pragma pack(push,1)
+typedef struct {
+    uint32_t lblk;          // first stored block of the cluster
+    uint32_t csize;         // compressed bytes; 0 = stored uncompressed
+} vsfs_cluster_t;
+#pragma pack(pop)
+#define CLUSTERS_PER_BLOCK (BS/8u)
+#define VSFS_CLUSTER_KIB_DEFAULT 16u
+
+// Extent mode: the 56 bytes of direct[] + indirect + dindirect hold the first
+// extents; longer lists continue in a chain of overflow blocks. Extents are
+// stored in file order, so the logical offset of each is implicit.
+#define INODE_EXTENTS 6
+#define EXTENTS_PER_BLOCK 511
+#pragma pack(push,1)
+typedef struct {
+    uint32_t start;         // RELATIVE first data block
+    uint32_t len;           // number of blocks
+} vsfs_extent_t;
+
+typedef struct {
+    uint32_t count;         // total extents of the file
+    uint32_t overflow;      // RELATIVE block of the first vsfs_extent_block_t; 0 = none
+    vsfs_extent_t ext[INODE_EXTENTS];
+} vsfs_extent_root_t;
+
+typedef struct {
+    uint32_t count;         // extents used in this block
+    uint32_t next;          // RELATIVE block of the next overflow block; 0 = last
+    vsfs_extent_t ext[EXTENTS_PER_BLOCK];
+} vsfs_extent_block_t;
+#pragma pack(pop)
+_Static_assert(sizeof(vsfs_extent_root_t) == DIRECT_MAX*4 + 8, "extent root must overlay the pointer area");
+_Static_assert(sizeof(vsfs_extent_block_t) == BS, "extent block size mismatch");
+
+#pragma pack(push,1)
+typedef struct {
+    uint32_t inode_no;           // 0 if free (NOTE: inodes are 1-based)
+    uint8_t  type;               // 1=file, 2=dir
+    char     name[MAX_FILENAME]; // not null-terminated if full
+    uint8_t  checksum;           // XOR of bytes 0..62
+} dirent64_t;
+#pragma pack(pop)
+_Static_assert(sizeof(dirent64_t)==64, "dirent size mismatch");
+#define DIRENTS_PER_BLOCK (BS/sizeof(dirent64_t))
+
+// Hashed directory index (VSFS_FEAT_DIR_INDEX): an open-addressing table on a
+// contiguous run of aux_len data blocks, header first, slots right after it.
+// Each slot maps the FNV-1a hash of a name to the dirent position (dirent
+// number within the directory, +1) holding it; probing is linear.
+#define VSFS_DIR_INDEX_MAGIC 0x58444956u // "VIDX"
+#define VSFS_DIX_EMPTY 0u                // slot never used: ends a probe
+#define VSFS_DIX_TOMB  UINT32_MAX        // slot of a removed name: probing continues
+#pragma pack(push,1)
+typedef struct {
+    uint32_t magic;         // VSFS_DIR_INDEX_MAGIC
+    uint32_t nslots;        // table size
+    uint32_t used;          // live slots
+    uint32_t tombs;         // VSFS_DIX_TOMB slots
+    uint32_t next_free;     // every dirent position below this is in use
+    uint32_t reserved[3];
+} vsfs_dir_index_t;
+
+typedef struct {
+    uint32_t hash;          // vsfs_name_hash() of the name
+    uint32_t pos;           // dirent number + 1, or VSFS_DIX_EMPTY / VSFS_DIX_TOMB
+} vsfs_dix_slot_t;
+#pragma pack(pop)
+_Static_assert(sizeof(vsfs_dir_index_t) == 32, "dir index header size mismatch");
+
+// ====================== Checksums ======================
+uint32_t superblock_crc_finalize(superblock_t *sb);
+// Same, for a block 0 that also holds *ext at VSFS_SB_EXT_OFFSET (ext may be NULL).
+uint32_t superblock_crc_finalize_ext(superblock_t *sb, const vsfs_sb_ext_t *ext);
+void inode_crc_finalize(inode_t *ino);
+void dirent_checksum_finalize(dirent64_t *de);
+
+// ====================== Bitmaps ======================
+static inline int  bit_get(const uint8_t *bm, uint64_t idx){ return (bm[idx/8] >> (idx%8)) & 1; }
+static inline void bit_set(uint8_t *bm, uint64_t idx){ bm[idx/8] |=  (1u << (idx%8)); }
+static inline void bit_clear(uint8_t *bm, uint64_t idx){ bm[idx/8] &= ~(1u << (idx%8)); }
+
+// Word-at-a-time scans over bm[0..nbits). The bitmap storage must be a whole
+// number of 64-bit words (on-disk bitmaps are whole blocks). Both return nbits
+// when no such bit exists at or after start.
+uint64_t bitmap_find_zero(const uint8_t *bm, uint64_t nbits, uint64_t start);
+uint64_t bitmap_find_one(const uint8_t *bm, uint64_t nbits, uint64_t start);
+
+// ====================== Statistics ======================
+// Process-wide counters of the work done by this library, for the tools'
+// --stats output. Counting is off until vsfs_stats_enable(1); then each event
+// costs one relaxed atomic add, so the worker threads of vsfs_add_files() and
+// vsfs_scrub() are counted too. Accesses through a mapping are not I/O calls:
+// in place, the image is not "read", and what vsfs_commit() flushes is
+// counted as written.
+typedef struct {
+    uint64_t image_read_bytes;  // read from image files (private copies)
+    uint64_t image_write_bytes; // written to image files: format, commit, journal, vsfs_write_image()
+    uint64_t host_read_bytes;   // host file contents read or copied into an image
+    uint64_t inodes_allocated;
+    uint64_t blocks_allocated;  // data blocks
+    uint64_t bitmap_words;      // 64-bit words examined by bitmap searches
+    uint64_t crc_bytes;         // bytes run through crc32 (not counting crc32_zeros)
+} vsfs_stats_t;
+void vsfs_stats_enable(int on);
+void vsfs_stats_reset(void);
+void vsfs_stats_get(vsfs_stats_t *out);
+
+// ====================== Formatting ======================
+typedef struct {
+    uint64_t size_kib;      // image size, multiple of 4
+    uint64_t inodes;        // inode count
+    int sparse;             // leave the data region as a hole instead of writing zeros
+    uint32_t features;      // VSFS_FEAT_* to enable
+    uint64_t journal_blocks; // VSFS_FEAT_JOURNAL: journal size, 0 = min(1024, 1/8 of the image)
+    uint64_t cluster_kib;   // VSFS_FEAT_COMPRESS: power of two, 8..1024; 0 = VSFS_CLUSTER_KIB_DEFAULT
+    int fixed_time;         // stamp epoch instead of the current time (reproducible builds)
+    uint64_t epoch;
+} vsfs_format_opts_t;
+
+// Computes the on-disk layout for opts into *sb and *ext (no I/O).
+int vsfs_layout(const vsfs_format_opts_t *opts, superblock_t *sb, vsfs_sb_ext_t *ext);
+// Creates a new image with an empty root directory. *sb_out and *ext_out
+// (optional) receive the superblock and its extension.
+int vsfs_format(const char *path, const vsfs_format_opts_t *opts, superblock_t *sb_out, vsfs_sb_ext_t *ext_out);
+
+// ====================== Image handle ======================
+#define VSFS_OPEN_RDONLY  0   // read-only shared mapping
+#define VSFS_OPEN_COPY    1   // private in-memory copy; save with vsfs_write_image()
+#define VSFS_OPEN_INPLACE 2   // MAP_SHARED read-write; vsfs_commit() msyncs dirty blocks only
+                              // (VSFS_FEAT_JOURNAL: MAP_PRIVATE, vsfs_commit() journals; see below)
+
+typedef struct {
+    superblock_t sb;        // working copy, stored back into block 0 by vsfs_commit()
+    vsfs_sb_ext_t sbx;      // likewise for the superblock extension
+    uint8_t *img;           // whole image (mapping or copy)
+    size_t img_size;
+    uint8_t *inode_bm;
+    uint8_t *data_bm;
+    uint8_t *inode_tbl;
+    uint8_t *data_region;
+    uint32_t *crc_tbl;      // VSFS_FEAT_DATA_CRC: crc32 per data-region block, else NULL
+    uint32_t *ref_tbl;      // VSFS_FEAT_DEDUP: refcount per data-region block, else NULL
+    int mode;               // VSFS_OPEN_*
+    int fd;                 // mapped modes: image fd, else -1
+    uint8_t *dirty;         // one bit per image block modified since open / last commit
+    uint64_t inode_hint;    // every inode bit below this index is known to be set
+    uint64_t data_hint;     // every data bit below this index is known to be set
+    uint64_t data_rover;    // next-fit: where the last contiguous allocation ended
+    int alloc_policy;       // VSFS_ALLOC_*
+    struct vsfs_dcache *dcache; // directory path -> inode, filled by path resolution
+    uint8_t *verified;      // one bit per image block whose checksums have been checked
+    struct vsfs_journal *jnl; // in-place journaled handle: open transaction state, else NULL
+    uint64_t replayed;      // blocks restored from the journal by vsfs_open()
+    struct vsfs_dedup *dedup; // content index after vsfs_dedup_enable(), else NULL
+    uint64_t dedup_blocks;  // file blocks shared instead of written since then
+    int replace;            // adds of an existing file name replace that file instead of failing
+    int fixed_time;         // every inode and superblock timestamp written is epoch, not the current time
+    uint64_t epoch;
+} vsfs_t;
+
+// Checks the superblock crc. Inode crcs and dirent checksums are verified lazily:
+// each inode-table or directory block the first time it is read through the
+// handle, remembered in fs->verified, so opening a large image costs no sweep.
+int  vsfs_open(vsfs_t *fs, const char *path, int mode);
+void vsfs_close(vsfs_t *fs);
+// If anything changed: refreshes the data crc of every dirty data-region block
+// (VSFS_FEAT_DATA_CRC), stamps and checksums the superblock, then (in place)
+// flushes the dirty blocks.
+//
+// With VSFS_FEAT_JOURNAL an in-place handle maps the image privately, so
+// nothing reaches the file before vsfs_commit() (closing without a commit
+// discards the changes). Commit writes blocks that are new in this
+// transaction straight home, then logs the modified metadata (superblock,
+// bitmaps, inode table, existing directory and index blocks) to the journal,
+// syncs, marks it committed, copies the logged blocks home and syncs again.
+// vsfs_open() replays a committed transaction left by a crash. Adds commit
+// early by themselves when a transaction approaches the journal size.
+int  vsfs_commit(vsfs_t *fs);
+// Writes the whole (committed) image to path; for VSFS_OPEN_COPY handles.
+// Free data blocks and all-zero blocks are left as holes of a sparse file.
+int  vsfs_write_image(vsfs_t *fs, const char *path);
+
+const char *vsfs_last_error(void);
+// SOURCE_DATE_EPOCH (see reproducible-builds.org): returns 1 with *epoch when
+// it is set, 0 when it is not, -1 when it is not a number of seconds.
+int  vsfs_source_date_epoch(uint64_t *epoch);
+
+// ====================== Blocks and inodes ======================
+static inline uint8_t *vsfs_block(vsfs_t *fs, uint64_t blk){ return fs->img + blk * BS; }
+static inline uint8_t *vsfs_data_block(vsfs_t *fs, uint32_t rel){ return fs->data_region + (uint64_t)rel * BS; }
+void vsfs_mark_dirty(vsfs_t *fs, uint64_t blk);
+void vsfs_mark_dirty_range(vsfs_t *fs, const void *p, size_t len);
+
+// Fails if the inode's crc does not match.
+int  vsfs_inode_get(vsfs_t *fs, uint32_t ino, inode_t *out);
+// Recomputes the inode crc, stores it and marks the table block dirty.
+int  vsfs_inode_put(vsfs_t *fs, uint32_t ino, inode_t *in);
+
+// Data block placement. Contiguous policies look for a single free run of the
+// requested length and fall back to scattered first-fit blocks when none exists.
+#define VSFS_ALLOC_NEXT_FIT 0   // first run that fits, continuing after the previous one (default)
+#define VSFS_ALLOC_BEST_FIT 1   // smallest run that fits
+#define VSFS_ALLOC_SCATTER  2   // lowest free blocks in any order (original behaviour)
+
+// Allocators mark the bitmap bits (and the bitmap blocks dirty).
+int  vsfs_alloc_inode(vsfs_t *fs, uint32_t *ino);
+int  vsfs_alloc_blocks(vsfs_t *fs, uint64_t n, uint32_t *out);
+// Allocates one run of up to `want` blocks: the full length if the policy finds
+// a contiguous run, else the lowest free run (possibly shorter).
+int  vsfs_alloc_run(vsfs_t *fs, uint64_t want, uint32_t *start, uint32_t *len);
+void vsfs_free_inode(vsfs_t *fs, uint32_t ino);
+// Drops one reference to a data block; the block is freed with its last one.
+void vsfs_free_block(vsfs_t *fs, uint32_t rel);
+
+// ====================== Block maps ======================
+// Relative data block 0 always belongs to the root directory, so a 0 pointer
+// in an indirect block (or in indirect/dindirect) means "not mapped".
+
+// Number of indirect/double-indirect pointer blocks a file of nblocks needs.
+uint64_t vsfs_map_meta_blocks(uint64_t nblocks);
+// Maps file block lblk of ino to its RELATIVE data block (block map or extents).
+// Inline files have no blocks: read them through vsfs_inline_data(). For a
+// compressed file lblk counts stored blocks: read it through vsfs_read_cluster().
+int  vsfs_bmap(vsfs_t *fs, const inode_t *ino, uint64_t lblk, uint32_t *rel);
+
+// Calls cb for each physically contiguous run of a file's data, in file order:
+// file blocks [lblk, lblk+len) live at RELATIVE blocks [rel, rel+len).
+// A non-zero return from cb stops the walk and is returned. Inline files have
+// no runs; those of a compressed file hold its stored (compressed) blocks.
+typedef int (*vsfs_run_cb)(void *ctx, uint64_t lblk, uint32_t rel, uint32_t len);
+int  vsfs_file_runs(vsfs_t *fs, const inode_t *ino, vsfs_run_cb cb, void *ctx);
+
+// Bytes of file content per cluster on a VSFS_FEAT_COMPRESS image.
+static inline uint64_t vsfs_cluster_bytes(const vsfs_t *fs){ return fs->sbx.cluster_blocks * BS; }
+// Decodes cluster c of a compressed file into buf (vsfs_cluster_bytes() bytes;
+// past the end of the file it is zero-filled).
+int  vsfs_read_cluster(vsfs_t *fs, const inode_t *ino, uint64_t c, uint8_t *buf);
+
+void vsfs_extent_root_get(const inode_t *ino, vsfs_extent_root_t *er);
+void vsfs_extent_root_set(inode_t *ino, const vsfs_extent_root_t *er);
+
+// ====================== Directory ======================
+// Image paths are '/'-separated and relative to the root ("a/b/c.o"; a leading
+// '/' is ignored, "." and ".." components are rejected).
+
+// Path lookup; returns 0 and *ino on a hit, -1 if absent. Each directory level
+// is answered in O(1) probes when indexed, else by a linear scan; parent
+// directories already resolved through this handle come from its dentry cache.
+int  vsfs_lookup(vsfs_t *fs, const char *path, uint32_t *ino);
+// Calls cb for every used dirent of directory dir_ino (including . and ..), in
+// on-disk order. A non-zero return from cb stops the walk and is returned.
+typedef int (*vsfs_dirent_cb)(void *ctx, const dirent64_t *de);
+int  vsfs_dir_iter(vsfs_t *fs, uint32_t dir_ino, vsfs_dirent_cb cb, void *ctx);
+// Creates directory path. parents!=0 behaves like mkdir -p (missing parents are
+// created, an existing directory is not an error).
+int  vsfs_mkdir(vsfs_t *fs, const char *path, int parents, uint32_t *ino);
+// Checks the dirent checksums of directory block rel (once per handle).
+int  vsfs_verify_dir_block(vsfs_t *fs, uint32_t rel);
+// FNV-1a over the stored name (at most MAX_FILENAME-1 bytes).
+uint32_t vsfs_name_hash(const char *name);
+
+// ====================== Files ======================
+// Adds a file at image path `name`, creating missing parent directories.
+// name==NULL uses the basename of host_path (in the root directory). Fails if
+// the name is already present (unless fs->replace is set and it names a
+// regular file, which is then released once the new one is linked in its
+// dirent) or a component is longer than MAX_FILENAME-1 bytes.
+int  vsfs_add_file(vsfs_t *fs, const char *host_path, const char *name, uint32_t *ino, uint64_t *size);
+// Adds a file whose content is already in memory.
+int  vsfs_add_data(vsfs_t *fs, const char *name, const void *data, uint64_t size, uint32_t *ino);
+
+// Batch import. Inodes and blocks for every file are allocated first, in request
+// order; the file contents are then copied by `jobs` threads (the caller
+// included), and finally each completed file is linked into its directory.
+// Failed requests are released again; the others are added even if some fail.
+typedef struct {
+    const char *host_path;  // in
+    const char *name;       // in: image path, NULL = basename of host_path
+    uint32_t ino;           // out
+    uint64_t size;          // out
+    int status;             // out: 0 added, -1 failed (reason in error)
+    char error[256];
+} vsfs_add_req_t;
+// Returns 0 if every file was added, else -1 ("N of M files not added").
+int  vsfs_add_files(vsfs_t *fs, vsfs_add_req_t *reqs, size_t n, int jobs);
+
+// Removes the regular file or empty directory at path: clears its dirent
+// (the parent's size_bytes shrinks to its last used dirent and its links
+// count drops by one) and frees its inode and blocks. A shared block only
+// loses one reference.
+int  vsfs_unlink(vsfs_t *fs, const char *path);
+// Sets the size of the regular file at path; bytes past the old end read as
+// zero. Block-mapped files are cut or extended in place (a shared last block
+// is copied before its tail is cleared); inline, extent and compressed files,
+// and files becoming small enough to be inline, are rewritten. The inode
+// number stays the same.
+int  vsfs_truncate(vsfs_t *fs, const char *path, uint64_t size);
+
+// Deduplicates the content of every file added from now on (VSFS_FEAT_DEDUP
+// images): a file block identical to one already indexed points at that block
+// and bumps its refcount instead of being written. The index starts with the
+// blocks of existing files, keyed from the data crc table when the image has
+// one and by hashing every file block otherwise.
+int  vsfs_dedup_enable(vsfs_t *fs);
+
+// ====================== Defragmentation ======================
+typedef struct {
+    uint64_t blocks;            // data-region blocks in use afterwards
+    uint64_t moved;             // blocks that changed place
+    uint64_t dropped;           // allocated blocks no inode needs any more, freed
+    uint64_t runs_before;       // contiguous runs of file and directory data, summed
+    uint64_t runs_after;
+} vsfs_defrag_stats_t;
+// Rewrites a private copy (VSFS_OPEN_COPY) so that every file and directory,
+// in inode order, occupies one contiguous run at the start of the data region:
+// a directory index or cluster table first, then the blocks in file order with
+// each pointer block just before the blocks it maps. Extent-mapped files end up
+// as a single extent. A block shared on a --dedup image stays with the first
+// file using it. Allocated blocks no inode refers to (and extent overflow
+// blocks) are freed; the crc and refcount tables move with the blocks.
+int  vsfs_defrag(vsfs_t *fs, vsfs_defrag_stats_t *st);
+
+// ====================== Resize ======================
+// Grows or shrinks the image to total_blocks by moving the end of the data
+// region. The data bitmap and the crc and refcount tables stay where they are
+// while they cover the new size, and otherwise move past the data region. On
+// VSFS_OPEN_INPLACE handles the file is resized and synced step by step, so
+// pending changes must be committed first; shrinking fails if a data block
+// past the new end is in use. Not available after vsfs_dedup_enable().
+int  vsfs_resize(vsfs_t *fs, uint64_t total_blocks);
+// Smallest total_blocks vsfs_resize() accepts with the blocks in use now.
+uint64_t vsfs_min_total_blocks(vsfs_t *fs);
+
+// ====================== Scrub ======================
+typedef struct {
+    uint64_t inodes;            // allocated inodes checked
+    uint64_t bad_inodes;
+    uint64_t dir_blocks;        // directory blocks checked
+    uint64_t bad_dir_blocks;
+    uint64_t data_blocks;       // allocated data-region blocks checked (VSFS_FEAT_DATA_CRC)
+    uint64_t bad_data_blocks;
+    uint64_t shared_blocks;     // VSFS_FEAT_DEDUP: data blocks referenced by more than one file
+    uint64_t bad_refcounts;     // reference count disagrees with the refcount table
+} vsfs_scrub_stats_t;
+// Called once per problem found, never concurrently.
+typedef void (*vsfs_scrub_cb)(void *ctx, const char *problem);
+
+// Full integrity check: superblock, every allocated inode, every directory
+// block, and (with VSFS_FEAT_DATA_CRC) every allocated data-region block
+// against the crc table, the latter by `jobs` threads in 4 MiB chunks. With
+// VSFS_FEAT_DEDUP the file references of every data block are counted against
+// the refcount table. The superblock free counters are checked against the bitmaps.
+// Returns 0 if nothing is wrong, else -1 ("N problems found").
+int  vsfs_scrub(vsfs_t *fs, int jobs, vsfs_scrub_stats_t *st, vsfs_scrub_cb cb, void *ctx);
+
+#endif
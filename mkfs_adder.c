@@ -1,5 +1,7 @@
 // mkfs_adder.c
+// Build: gcc -O2 -std=c17 -Wall -Wextra -pthread mkfs_adder.c minivsfs.c crc32.c lz4.c -o mkfs_adder
 #define _FILE_OFFSET_BITS 64
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -7,263 +9,315 @@
 #include <inttypes.h>
 #include <errno.h>
 #include <time.h>
-#include <sys/stat.h>
-#include <assert.h>
+#include "minivsfs.h"
 
-#define BS 4096u
-#define INODE_SIZE 128u
-#define ROOT_INO 1u
-#define DIRECT_MAX 12
-#define MAX_FILENAME 58
-
-#pragma pack(push, 1)
+// ========================== File list ==========================
 typedef struct {
-    uint32_t magic;              // 0x4D565346 ("MVSF")
-    uint32_t version;            // 1
-    uint32_t block_size;         // 4096
-    uint64_t total_blocks;
-
-    uint64_t inode_count;
-    uint64_t inode_bitmap_start;
-    uint64_t inode_bitmap_blocks;
-    uint64_t data_bitmap_start;
-    uint64_t data_bitmap_blocks;
-    uint64_t inode_table_start;
-    uint64_t inode_table_blocks;
-    uint64_t data_region_start;
-    uint64_t data_region_blocks;
-    uint64_t root_inode;
-    uint64_t mtime_epoch;
-    uint32_t flags;
+    char **paths;
+    size_t count;
+    size_t cap;
+} file_list_t;
+
+static int file_list_push(file_list_t *fl, const char *path){
+    if(fl->count==fl->cap){
+        size_t ncap = fl->cap ? fl->cap*2 : 16;
+        char **np = realloc(fl->paths, ncap*sizeof(*np));
+        if(!np) return -1;
+        fl->paths=np; fl->cap=ncap;
+    }
+    size_t len=strlen(path);
+    char *copy=malloc(len+1);
+    if(!copy) return -1;
+    memcpy(copy,path,len+1);
+    fl->paths[fl->count++]=copy;
+    return 0;
+}
 
-    uint32_t checksum;           // last field
-} superblock_t;
-#pragma pack(pop)
-_Static_assert(sizeof(superblock_t) == 116, "superblock must fit in one block");
+static void file_list_free(file_list_t *fl){
+    for(size_t i=0;i<fl->count;i++) free(fl->paths[i]);
+    free(fl->paths);
+    memset(fl,0,sizeof(*fl));
+}
 
-#pragma pack(push,1)
-typedef struct {
-    uint16_t mode;
-    uint16_t links;
-    uint32_t uid;
-    uint32_t gid;
-    uint64_t size_bytes;
-    uint64_t atime;
-    uint64_t mtime;
-    uint64_t ctime;
-    uint32_t direct[DIRECT_MAX];
-    uint32_t reserved_0;
-    uint32_t reserved_1;
-    uint32_t reserved_2;
-    uint32_t proj_id;
-    uint32_t uid16_gid16;
-    uint64_t xattr_ptr;
-    uint64_t inode_crc;          // low 4 bytes = crc32 of bytes [0..119]
-} inode_t;
-#pragma pack(pop)
-_Static_assert(sizeof(inode_t) == INODE_SIZE, "inode size mismatch");
+static void lists_free(file_list_t *files, file_list_t *dirs, file_list_t *removes, file_list_t *truncs){
+    file_list_free(files); file_list_free(dirs); file_list_free(removes); file_list_free(truncs);
+}
 
-#pragma pack(push,1)
-typedef struct {
-    uint32_t inode_no;           // 0 if free
-    uint8_t type;                // 1=file, 2=dir
-    char name[MAX_FILENAME];     // not null-terminated if full
-    uint8_t checksum;            // XOR of bytes 0..62
-} dirent64_t;
-#pragma pack(pop)
-_Static_assert(sizeof(dirent64_t) == 64, "dirent size mismatch");
+static int parse_u64(const char *s, uint64_t *out){
+    char *end=NULL; errno=0;
+    unsigned long long v=strtoull(s,&end,10);
+    if(errno!=0 || end==s || *end!='\0' || s[0]=='-') return -1;
+    *out=(uint64_t)v; return 0;
+}
 
-// ========================== CRC32 helpers ==========================
-static uint32_t CRC32_TAB[256];
-static void crc32_init(void){
-    for (uint32_t i=0;i<256;i++){
-        uint32_t c=i;
-        for(int j=0;j<8;j++) c = (c&1)?(0xEDB88320u^(c>>1)):(c>>1);
-        CRC32_TAB[i]=c;
+// manifest: one host path per line, blank lines and lines starting with '#' are skipped
+static int file_list_load_manifest(file_list_t *fl, const char *manifest){
+    FILE *mf = strcmp(manifest,"-")==0 ? stdin : fopen(manifest,"r");
+    if(!mf){ perror("fopen manifest"); return -1; }
+    char line[4096];
+    int rc=0;
+    while(fgets(line,sizeof(line),mf)){
+        size_t len=strlen(line);
+        if(len==sizeof(line)-1 && line[len-1]!='\n'){ fprintf(stderr,"manifest line too long\n"); rc=-1; break; }
+        while(len>0 && (line[len-1]=='\n' || line[len-1]=='\r')) line[--len]='\0';
+        if(len==0 || line[0]=='#') continue;
+        if(file_list_push(fl,line)!=0){ perror("manifest"); rc=-1; break; }
     }
+    if(rc==0 && ferror(mf)){ perror("reading manifest"); rc=-1; }
+    if(mf!=stdin) fclose(mf);
+    return rc;
 }
-static uint32_t crc32(const void* data, size_t n){
-    const uint8_t* p=(const uint8_t*)data; uint32_t c=0xFFFFFFFFu;
-    for(size_t i=0;i<n;i++) c = CRC32_TAB[(c^p[i])&0xFF] ^ (c>>8);
-    return c ^ 0xFFFFFFFFu;
+
+// --keep-paths stores a file under its host path, minus any leading '/' and "./"
+static const char *image_path(const char *host_path){
+    while(host_path[0]=='/' || (host_path[0]=='.' && host_path[1]=='/')) host_path += host_path[0]=='/' ? 1 : 2;
+    return host_path;
 }
 
-static uint32_t superblock_crc_finalize(superblock_t *sb) {
-    sb->checksum = 0;
-    uint8_t block[BS]; memset(block, 0, BS);
-    memcpy(block, sb, sizeof(*sb));
-    uint32_t s = crc32(block, BS-4);
-    sb->checksum = s;
-    return s;
+// ========================== Progress ==========================
+// The per-step lines on stdout. In copy mode they are held back until the
+// output image is written, so a run that aborts does not report changes to an
+// image that never appears.
+static FILE *report;
+static char *report_buf;
+static size_t report_len;
+
+static int report_open(int in_place){
+    report = in_place ? stdout : open_memstream(&report_buf,&report_len);
+    if(!report){ perror("open_memstream"); return -1; }
+    return 0;
 }
 
-static void inode_crc_finalize(inode_t* ino){
-    uint8_t tmp[INODE_SIZE]; memcpy(tmp, ino, INODE_SIZE);
-    memset(&tmp[120], 0, 8);
-    uint32_t c = crc32(tmp, 120);
-    ino->inode_crc = (uint64_t)c;
+// Ends the report; show=0 drops what copy mode held back.
+static void report_end(int show){
+    if(!report || report==stdout) return;
+    fclose(report);
+    if(show) fwrite(report_buf,1,report_len,stdout);
+    free(report_buf);
+    report=NULL;
 }
 
-static void dirent_checksum_finalize(dirent64_t* de){
-    const uint8_t* p = (const uint8_t*)de;
-    uint8_t x = 0;
-    for(int i=0;i<63;i++) x ^= p[i];
-    de->checksum = x;
+// ========================== Stats ==========================
+// --stats: wall time per phase, printed with the library counters as one JSON line on stderr
+static struct { const char *name; double sec; } phases[8];
+static int nphases;
+
+static double now_sec(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec*1e-9;
 }
 
-// ========================== Bitmap helpers ==========================
-static inline int bit_get(const uint8_t *bm, uint64_t idx){ return (bm[idx/8] >> (idx%8)) & 1; }
-static inline void bit_set(uint8_t *bm, uint64_t idx){ bm[idx/8] |=  (1u << (idx%8)); }
-static inline void bit_clear(uint8_t *bm, uint64_t idx){ bm[idx/8] &= ~(1u << (idx%8)); }
+static void phase_done(const char *name, double t0){
+    if(nphases < (int)(sizeof(phases)/sizeof(phases[0]))){ phases[nphases].name=name; phases[nphases].sec=now_sec()-t0; nphases++; }
+}
 
-// ========================== File helpers ==========================
-static void *read_file_all(const char *path, size_t *out_size){
-    FILE *f = fopen(path,"rb");
-    if(!f) return NULL;
-    if(fseek(f,0,SEEK_END)!=0){ fclose(f); return NULL; }
-    long s = ftell(f);
-    if(s<0){ fclose(f); return NULL; }
-    if(fseek(f,0,SEEK_SET)!=0){ fclose(f); return NULL; }
-    size_t alloc_size = (size_t)s ? (size_t)s : 1;
-    void *buf = malloc(alloc_size);
-    if(!buf){ fclose(f); return NULL; }
-    if(s>0 && fread(buf,1,(size_t)s,f)!=(size_t)s){ free(buf); fclose(f); return NULL; }
-    fclose(f);
-    *out_size = (size_t)s;
-    return buf;
+static void print_stats(double t_start){
+    vsfs_stats_t st;
+    vsfs_stats_get(&st);
+    fprintf(stderr,"{\"tool\": \"mkfs_adder\", \"total_ms\": %.3f, \"phases_ms\": {",(now_sec()-t_start)*1e3);
+    for(int i=0;i<nphases;i++) fprintf(stderr,"%s\"%s\": %.3f",i ? ", " : "",phases[i].name,phases[i].sec*1e3);
+    fprintf(stderr,"}, \"image_read_bytes\": %" PRIu64 ", \"image_write_bytes\": %" PRIu64 ", \"host_read_bytes\": %" PRIu64
+            ", \"inodes_allocated\": %" PRIu64 ", \"blocks_allocated\": %" PRIu64 ", \"bitmap_words\": %" PRIu64 ", \"crc_bytes\": %" PRIu64 "}\n",
+            st.image_read_bytes,st.image_write_bytes,st.host_read_bytes,st.inodes_allocated,st.blocks_allocated,st.bitmap_words,st.crc_bytes);
 }
 
 // ========================== Main ==========================
 int main(int argc, char **argv){
     crc32_init();
 
-    const char *input_img=NULL, *output_img=NULL, *host_file=NULL;
+    const char *input_img=NULL, *output_img=NULL;
+    int in_place=0, keep_paths=0, dedup=0, replace=0, stats=0, jobs=1;
+    const double t_start=now_sec();
+    int alloc_policy=VSFS_ALLOC_NEXT_FIT;
+    file_list_t files; memset(&files,0,sizeof(files));
+    file_list_t dirs; memset(&dirs,0,sizeof(dirs));
+    file_list_t removes; memset(&removes,0,sizeof(removes));
+    file_list_t truncs; memset(&truncs,0,sizeof(truncs));   // path, size, path, size, ...
     // parse CLI
     for(int i=1;i<argc;i++){
         if(strcmp(argv[i],"--input")==0 && i+1<argc) input_img=argv[++i];
         else if(strcmp(argv[i],"--output")==0 && i+1<argc) output_img=argv[++i];
-        else if(strcmp(argv[i],"--file")==0 && i+1<argc) host_file=argv[++i];
-        else { fprintf(stderr,"Unknown parameter %s\n",argv[i]); return EXIT_FAILURE;}
+        else if(strcmp(argv[i],"--in-place")==0) in_place=1;
+        else if(strcmp(argv[i],"--keep-paths")==0) keep_paths=1;
+        else if(strcmp(argv[i],"--dedup")==0) dedup=1;
+        else if(strcmp(argv[i],"--replace")==0) replace=1;
+        else if(strcmp(argv[i],"--stats")==0) stats=1;
+        else if(strcmp(argv[i],"--rm")==0 && i+1<argc){
+            if(file_list_push(&removes,argv[++i])!=0){ perror("--rm"); lists_free(&files,&dirs,&removes,&truncs); return EXIT_FAILURE; }
+        }
+        else if(strcmp(argv[i],"--truncate")==0 && i+2<argc){
+            uint64_t size;
+            if(parse_u64(argv[i+2],&size)!=0){ fprintf(stderr,"Invalid --truncate size\n"); lists_free(&files,&dirs,&removes,&truncs); return EXIT_FAILURE; }
+            if(file_list_push(&truncs,argv[i+1])!=0 || file_list_push(&truncs,argv[i+2])!=0){ perror("--truncate"); lists_free(&files,&dirs,&removes,&truncs); return EXIT_FAILURE; }
+            i+=2;
+        }
+        else if(strcmp(argv[i],"--jobs")==0 && i+1<argc){
+            char *end=NULL; long v=strtol(argv[++i],&end,10);
+            if(end==argv[i] || *end!='\0' || v<1 || v>1024){ fprintf(stderr,"--jobs must be 1..1024\n"); lists_free(&files,&dirs,&removes,&truncs); return EXIT_FAILURE; }
+            jobs=(int)v;
+        }
+        else if(strcmp(argv[i],"--mkdir")==0 && i+1<argc){
+            if(file_list_push(&dirs,argv[++i])!=0){ perror("--mkdir"); lists_free(&files,&dirs,&removes,&truncs); return EXIT_FAILURE; }
+        }
+        else if(strcmp(argv[i],"--alloc")==0 && i+1<argc){
+            const char *p=argv[++i];
+            if(strcmp(p,"next-fit")==0) alloc_policy=VSFS_ALLOC_NEXT_FIT;
+            else if(strcmp(p,"best-fit")==0) alloc_policy=VSFS_ALLOC_BEST_FIT;
+            else if(strcmp(p,"scatter")==0) alloc_policy=VSFS_ALLOC_SCATTER;
+            else { fprintf(stderr,"--alloc must be next-fit, best-fit or scatter\n"); lists_free(&files,&dirs,&removes,&truncs); return EXIT_FAILURE; }
+        }
+        else if(strcmp(argv[i],"--file")==0 && i+1<argc){
+            if(file_list_push(&files,argv[++i])!=0){ perror("--file"); lists_free(&files,&dirs,&removes,&truncs); return EXIT_FAILURE; }
+        }
+        else if(strcmp(argv[i],"--files-from")==0 && i+1<argc){
+            if(file_list_load_manifest(&files,argv[++i])!=0){ lists_free(&files,&dirs,&removes,&truncs); return EXIT_FAILURE; }
+        }
+        else { fprintf(stderr,"Unknown parameter %s\n",argv[i]); lists_free(&files,&dirs,&removes,&truncs); return EXIT_FAILURE;}
     }
-    if(!input_img || !output_img || !host_file){
-        fprintf(stderr,"Usage: %s --input in.img --output out.img --file filename\n",argv[0]);
+    if(in_place && !output_img) output_img=input_img;
+    if(!input_img || !output_img || files.count+dirs.count+removes.count+truncs.count==0){
+        fprintf(stderr,"Usage: %s --input in.img (--output out.img | --in-place) --file filename [--file filename ...] [--files-from manifest] [--mkdir dir ...] [--rm path ...] [--truncate path size ...] [--replace] [--keep-paths] [--dedup] [--jobs N] [--stats] [--alloc next-fit|best-fit|scatter]\n",argv[0]);
+        lists_free(&files,&dirs,&removes,&truncs);
         return EXIT_FAILURE;
     }
-
-    // read input image
-    size_t img_size;
-    uint8_t *img = read_file_all(input_img,&img_size);
-    if(!img){ perror("reading input image"); return EXIT_FAILURE; }
-    if(img_size < BS){ fprintf(stderr,"input image too small\n"); free(img); return EXIT_FAILURE; }
-
-    // parse superblock
-    superblock_t sb;
-    memcpy(&sb,img,sizeof(sb));
-    if(sb.magic != 0x4D565346u){ fprintf(stderr,"bad magic\n"); free(img); return EXIT_FAILURE; }
-
-    // pointers
-    uint8_t *inode_bm = img + sb.inode_bitmap_start * BS;
-    uint8_t *data_bm  = img + sb.data_bitmap_start  * BS;
-    uint8_t *inode_tbl = img + sb.inode_table_start * BS;
-    uint8_t *data_region = img + sb.data_region_start * BS;
-
-    // read host file
-    struct stat st;
-    if(stat(host_file,&st)!=0){ perror("stat host file"); free(img); return EXIT_FAILURE; }
-    if(!S_ISREG(st.st_mode)){ fprintf(stderr,"host file is not regular\n"); free(img); return EXIT_FAILURE; }
-    uint64_t file_size = (uint64_t)st.st_size;
-    uint64_t need_blocks = (file_size+BS-1)/BS;
-    if(need_blocks==0) need_blocks=1;
-    if(need_blocks>DIRECT_MAX){ fprintf(stderr,"file too large\n"); free(img); return EXIT_FAILURE; }
-
-    // find free inode
-    int found_inode=-1;
-    for(uint64_t i=0;i<sb.inode_count;i++){
-        if(!bit_get(inode_bm,i)){ found_inode=(int)i; break; }
+    if(in_place && strcmp(input_img,output_img)!=0){
+        fprintf(stderr,"--in-place requires --output to be omitted or equal to --input\n");
+        lists_free(&files,&dirs,&removes,&truncs);
+        return EXIT_FAILURE;
     }
-    if(found_inode<0){ fprintf(stderr,"no free inode\n"); free(img); return EXIT_FAILURE; }
-    uint32_t new_ino = (uint32_t)(found_inode+1);
 
-    // find free data blocks
-    uint32_t blocks_found[DIRECT_MAX];
-    uint64_t found=0;
-    for(uint64_t i=0;i<sb.data_region_blocks && found<need_blocks;i++){
-        if(!bit_get(data_bm,i)) blocks_found[found++] = (uint32_t)i;
+    // load the image once for the whole batch: mmap it when editing in place, else read a private copy
+    vsfs_stats_enable(stats);
+    double t=now_sec();
+    vsfs_t fs;
+    if(vsfs_open(&fs,input_img,in_place ? VSFS_OPEN_INPLACE : VSFS_OPEN_COPY)!=0){
+        fprintf(stderr,"%s\n",vsfs_last_error()); lists_free(&files,&dirs,&removes,&truncs); return EXIT_FAILURE;
     }
-    if(found<need_blocks){ fprintf(stderr,"not enough free data blocks\n"); free(img); return EXIT_FAILURE; }
-
-    // read host file content
-    size_t fsize;
-    uint8_t *file_buf = read_file_all(host_file,&fsize);
-    if(!file_buf){ perror("reading host file"); free(img); return EXIT_FAILURE; }
-
-    // create inode
-    inode_t ino;
-    memset(&ino,0,sizeof(ino));
-    ino.mode=0x8000; ino.links=1; ino.uid=0; ino.gid=0; ino.size_bytes=file_size;
-    time_t now = time(NULL); ino.atime=ino.mtime=ino.ctime=(uint64_t)now;
-    for(uint64_t i=0;i<need_blocks;i++) ino.direct[i]=blocks_found[i];
-    inode_crc_finalize(&ino);
-
-    // mark inode and data blocks
-    bit_set(inode_bm,(uint64_t)found_inode);
-    for(uint64_t i=0;i<need_blocks;i++){
-        bit_set(data_bm,blocks_found[i]);
-        uint64_t copy_off=i*BS;
-        uint64_t remain = file_size>copy_off ? file_size-copy_off:0;
-        uint64_t tocopy = remain>BS ? BS:remain;
-        if(tocopy) memcpy(data_region+((uint64_t)blocks_found[i]*BS),file_buf+copy_off,tocopy);
-        if(tocopy<BS) memset(data_region+((uint64_t)blocks_found[i]*BS)+tocopy,0,BS-tocopy);
+    fs.alloc_policy=alloc_policy;
+    fs.replace=replace;
+    switch(vsfs_source_date_epoch(&fs.epoch)){   // pins the timestamps, for reproducible images
+        case 1: fs.fixed_time=1; break;
+        case -1: fprintf(stderr,"%s\n",vsfs_last_error()); vsfs_close(&fs); lists_free(&files,&dirs,&removes,&truncs); return EXIT_FAILURE;
     }
-
-    // write inode
-    memcpy(inode_tbl + ((uint64_t)found_inode*INODE_SIZE), &ino, INODE_SIZE);
-
-    // update root directory
-    inode_t root_inode;
-    memcpy(&root_inode,inode_tbl + ((ROOT_INO-1)*INODE_SIZE),INODE_SIZE);
-    uint32_t root_rel = root_inode.direct[0];
-    if(root_rel>=sb.data_region_blocks){ fprintf(stderr,"root data block invalid\n"); free(file_buf); free(img); return EXIT_FAILURE; }
-
-    uint8_t *root_block = data_region + ((uint64_t)root_rel*BS);
-    int added=0;
-    for(size_t off=0; off+sizeof(dirent64_t)<=BS; off+=sizeof(dirent64_t)){
-        dirent64_t *de = (dirent64_t *)(root_block+off);
-        if(de->inode_no==0){
-            dirent64_t nde; memset(&nde,0,sizeof(nde));
-            nde.inode_no=new_ino; nde.type=1;
-            const char *slash=strrchr(host_file,'/');
-            const char *fname=slash?slash+1:host_file;
-            strncpy(nde.name,fname,MAX_FILENAME-1);
-            dirent_checksum_finalize(&nde);
-            memcpy(de,&nde,sizeof(nde));
-            added=1; break;
+    if(dedup && vsfs_dedup_enable(&fs)!=0){
+        fprintf(stderr,"%s\n",vsfs_last_error()); vsfs_close(&fs); lists_free(&files,&dirs,&removes,&truncs); return EXIT_FAILURE;
+    }
+    phase_done("open",t);
+    if(report_open(in_place)!=0){ vsfs_close(&fs); lists_free(&files,&dirs,&removes,&truncs); return EXIT_FAILURE; }
+
+    // removals and truncations first, then directories (with parents), then every file. In copy
+    // mode a failure aborts the batch before output is written; in place, what was done before
+    // the failure is kept.
+    int rc=EXIT_SUCCESS;
+    size_t added=0;
+    t=now_sec();
+    for(size_t i=0;i<removes.count;i++){
+        if(vsfs_unlink(&fs,removes.paths[i])!=0){
+            fprintf(stderr,"%s\n",vsfs_last_error());
+            if(!in_place){
+                fprintf(stderr,"aborting: '%s' not removed, output not written\n",removes.paths[i]);
+                report_end(0); vsfs_close(&fs); lists_free(&files,&dirs,&removes,&truncs); return EXIT_FAILURE;
+            }
+            fprintf(stderr,"aborting: '%s' not removed\n",removes.paths[i]);
+            rc=EXIT_FAILURE;
+            break;
         }
+        fprintf(report,"Removed '%s' from '%s'.\n",removes.paths[i],output_img);
     }
-    if(!added){ fprintf(stderr,"no free dirent slot in root\n"); bit_clear(inode_bm,(uint64_t)found_inode);
-        for(uint64_t i=0;i<need_blocks;i++) bit_clear(data_bm,blocks_found[i]);
-        free(file_buf); free(img); return EXIT_FAILURE;
+    if(removes.count) phase_done("remove",t);
+    t=now_sec();
+    for(size_t i=0;i+1<truncs.count && rc==EXIT_SUCCESS;i+=2){
+        uint64_t size=0;
+        parse_u64(truncs.paths[i+1],&size);
+        if(vsfs_truncate(&fs,truncs.paths[i],size)!=0){
+            fprintf(stderr,"%s\n",vsfs_last_error());
+            if(!in_place){
+                fprintf(stderr,"aborting: '%s' not truncated, output not written\n",truncs.paths[i]);
+                report_end(0); vsfs_close(&fs); lists_free(&files,&dirs,&removes,&truncs); return EXIT_FAILURE;
+            }
+            fprintf(stderr,"aborting: '%s' not truncated\n",truncs.paths[i]);
+            rc=EXIT_FAILURE;
+            break;
+        }
+        fprintf(report,"File '%s' truncated to %" PRIu64 " bytes in '%s'.\n",truncs.paths[i],size,output_img);
+    }
+    if(truncs.count) phase_done("truncate",t);
+    t=now_sec();
+    for(size_t i=0;i<dirs.count && rc==EXIT_SUCCESS;i++){
+        uint32_t dir_ino;
+        if(vsfs_mkdir(&fs,dirs.paths[i],1,&dir_ino)!=0){
+            fprintf(stderr,"%s\n",vsfs_last_error());
+            if(!in_place){
+                fprintf(stderr,"aborting: directory '%s' not created, output not written\n",dirs.paths[i]);
+                report_end(0); vsfs_close(&fs); lists_free(&files,&dirs,&removes,&truncs); return EXIT_FAILURE;
+            }
+            fprintf(stderr,"aborting: directory '%s' not created\n",dirs.paths[i]);
+            rc=EXIT_FAILURE;
+            break;
+        }
+        fprintf(report,"Directory '%s' is inode %u in '%s'.\n",dirs.paths[i],dir_ino,output_img);
+    }
+    if(dirs.count) phase_done("mkdir",t);
+    t=now_sec();
+    if(jobs>1 && rc==EXIT_SUCCESS && files.count>0){
+        // --jobs: allocate everything, copy contents in parallel, then link
+        vsfs_add_req_t *reqs=calloc(files.count,sizeof(*reqs));
+        if(!reqs){ perror("calloc"); report_end(0); vsfs_close(&fs); lists_free(&files,&dirs,&removes,&truncs); return EXIT_FAILURE; }
+        for(size_t i=0;i<files.count;i++){
+            reqs[i].host_path=files.paths[i];
+            reqs[i].name=keep_paths ? image_path(files.paths[i]) : NULL;
+        }
+        int brc=vsfs_add_files(&fs,reqs,files.count,jobs);
+        for(size_t i=0;i<files.count;i++){
+            if(reqs[i].status==0) fprintf(report,"File '%s' added as inode %u (%" PRIu64 " bytes) into '%s'.\n", files.paths[i],reqs[i].ino,reqs[i].size,output_img);
+            else fprintf(stderr,"%s: %s\n",files.paths[i],reqs[i].error);
+        }
+        free(reqs);
+        if(brc!=0){
+            fprintf(stderr,"%s\n",vsfs_last_error());
+            if(!in_place){
+                fprintf(stderr,"aborting: output not written\n");
+                report_end(0); vsfs_close(&fs); lists_free(&files,&dirs,&removes,&truncs); return EXIT_FAILURE;
+            }
+            rc=EXIT_FAILURE;
+        }
+    }
+    for(size_t i=0;i<files.count && rc==EXIT_SUCCESS && jobs==1;i++){
+        uint32_t new_ino; uint64_t file_size;
+        const char *name = keep_paths ? image_path(files.paths[i]) : NULL;
+        if(vsfs_add_file(&fs,files.paths[i],name,&new_ino,&file_size)!=0){
+            fprintf(stderr,"%s\n",vsfs_last_error());
+            if(!in_place){
+                fprintf(stderr,"aborting: '%s' not added, output not written\n",files.paths[i]);
+                report_end(0); vsfs_close(&fs); lists_free(&files,&dirs,&removes,&truncs); return EXIT_FAILURE;
+            }
+            fprintf(stderr,"aborting: '%s' not added, keeping %zu file(s) added before it\n",files.paths[i],added);
+            rc=EXIT_FAILURE;
+            break;
+        }
+        added++;
+        fprintf(report,"File '%s' added as inode %u (%" PRIu64 " bytes) into '%s'.\n", files.paths[i],new_ino,file_size,output_img);
     }
 
-    root_inode.links+=1;
-    root_inode.size_bytes+=sizeof(dirent64_t);
-    inode_crc_finalize(&root_inode);
-    memcpy(inode_tbl + ((ROOT_INO-1)*INODE_SIZE), &root_inode, INODE_SIZE);
+    if(files.count) phase_done("add",t);
 
-    // update superblock
-    sb.mtime_epoch=(uint64_t)time(NULL);
-    superblock_crc_finalize(&sb);
-    memcpy(img,&sb,sizeof(sb));
+    if(dedup) fprintf(report,"%" PRIu64 " block(s) shared with identical blocks already in '%s'.\n",fs.dedup_blocks,output_img);
 
-    // write output
-    FILE *of=fopen(output_img,"wb");
-    if(!of){ perror("fopen output"); free(file_buf); free(img); return EXIT_FAILURE; }
-    if(fwrite(img,1,img_size,of)!=img_size){ perror("write output"); fclose(of); free(file_buf); free(img); return EXIT_FAILURE; }
-    fclose(of);
+    // update superblock; in place this also flushes only the touched blocks
+    t=now_sec();
+    if(vsfs_commit(&fs)!=0){ fprintf(stderr,"%s\n",vsfs_last_error()); report_end(0); vsfs_close(&fs); lists_free(&files,&dirs,&removes,&truncs); return EXIT_FAILURE; }
+    phase_done("commit",t);
 
-    printf("File '%s' added as inode %u (%" PRIu64 " bytes) into '%s'.\n", host_file,new_ino,file_size,output_img);
+    // copy mode: write output once
+    t=now_sec();
+    if(!in_place && vsfs_write_image(&fs,output_img)!=0){
+        fprintf(stderr,"%s\n",vsfs_last_error()); rc=EXIT_FAILURE;
+    }
+    if(!in_place) phase_done("write",t);
+    report_end(rc==EXIT_SUCCESS);
+    if(stats) print_stats(t_start);
 
-    free(file_buf); free(img);
-    return EXIT_SUCCESS;
+    vsfs_close(&fs); lists_free(&files,&dirs,&removes,&truncs);
+    return rc;
 }
-
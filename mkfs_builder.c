@@ -1,5 +1,6 @@
-// Build: gcc -O2 -std=c17 -Wall -Wextra mkfs_builder.c -o mkfs_builder
+// Build: gcc -O2 -std=c17 -Wall -Wextra -pthread mkfs_builder.c minivsfs.c crc32.c lz4.c -o mkfs_builder
 #define _FILE_OFFSET_BITS 64
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -7,113 +8,137 @@
 #include <inttypes.h>
 #include <errno.h>
 #include <time.h>
-#include <assert.h>
+#include <unistd.h>
+#include "minivsfs.h"
+
+// Relative block pointers are 32-bit, so the data region tops out just under 2^32 blocks (16 TiB).
+#define MIN_SIZE_KIB   180ull
+#define MAX_SIZE_KIB   (4ull * UINT32_MAX)
+#define MIN_INODES     128ull
+#define MAX_INODES     ((uint64_t)UINT32_MAX)
+#define MAX_JOBS       1024
+
+static double now_sec(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec*1e-9;
+}
 
-#define BS 4096u               // block size
-#define INODE_SIZE 128u
-#define ROOT_INO 1u
-#define DIRECT_MAX 12
+// --stats: wall time and the library counters as one JSON line on stderr
+static void print_stats(double format_sec, double populate_sec, int populated){
+    vsfs_stats_t st;
+    vsfs_stats_get(&st);
+    fprintf(stderr, "{\"tool\": \"mkfs_builder\", \"total_ms\": %.3f, \"phases_ms\": {\"format\": %.3f", (format_sec+populate_sec)*1e3, format_sec*1e3);
+    if(populated) fprintf(stderr, ", \"populate\": %.3f", populate_sec*1e3);
+    fprintf(stderr, "}, \"image_read_bytes\": %" PRIu64
+            ", \"image_write_bytes\": %" PRIu64 ", \"host_read_bytes\": %" PRIu64 ", \"inodes_allocated\": %" PRIu64
+            ", \"blocks_allocated\": %" PRIu64 ", \"bitmap_words\": %" PRIu64 ", \"crc_bytes\": %" PRIu64 "}\n",
+            st.image_read_bytes, st.image_write_bytes, st.host_read_bytes,
+            st.inodes_allocated, st.blocks_allocated, st.bitmap_words, st.crc_bytes);
+}
 
-// ====================== On-disk structures ======================
-#pragma pack(push, 1)
+// ============================= Manifest ================================
+// One entry per line: "host_path", stored under the same path (minus leading
+// '/' and "./"), or "image_path<TAB>host_path"; "image_path/" alone is an empty
+// directory. Blank lines and lines starting with '#' are skipped.
 typedef struct {
-    uint32_t magic;               // 0x4D565346 ("MVSF")
-    uint32_t version;             // 1
-    uint32_t block_size;          // 4096
-    uint64_t total_blocks;
-
-    uint64_t inode_count;
-    uint64_t inode_bitmap_start;  // block index
-    uint64_t inode_bitmap_blocks; // = 1
-    uint64_t data_bitmap_start;   // block index
-    uint64_t data_bitmap_blocks;  // = 1
-    uint64_t inode_table_start;   // block index
-    uint64_t inode_table_blocks;  // ceil(inode_count*128 / 4096)
-    uint64_t data_region_start;   // block index
-    uint64_t data_region_blocks;  // remaining
-    uint64_t root_inode;          // = 1
-    uint64_t mtime_epoch;         // build time
-    uint32_t flags;               // 0
+    char *image;    // normalized image path
+    char *host;     // NULL: directory
+} entry_t;
 
-    uint32_t checksum;            // crc32(superblock[0..4091]) (must be last)
-} superblock_t;
-#pragma pack(pop)
-_Static_assert(sizeof(superblock_t) == 116, "superblock must fit in one block");
-
-#pragma pack(push,1)
 typedef struct {
-    uint16_t mode;          // 0x8000=file, 0x4000=dir
-    uint16_t links;         // root=2 (., ..); files=1
-    uint32_t uid;           // 0
-    uint32_t gid;           // 0
-    uint64_t size_bytes;    // file/dir size
-    uint64_t atime;         // now
-    uint64_t mtime;         // now
-    uint64_t ctime;         // now
-    uint32_t direct[12];    // MiniVSFS: use RELATIVE index inside data region
-    uint32_t reserved_0;    // 0
-    uint32_t reserved_1;    // 0
-    uint32_t reserved_2;    // 0
-    uint32_t proj_id;       // group id if you want; keep 0
-    uint32_t uid16_gid16;   // 0
-    uint64_t xattr_ptr;     // 0
-
-    uint64_t inode_crc;     // low 4 bytes = crc32 of bytes [0..119]
-} inode_t;
-#pragma pack(pop)
-_Static_assert(sizeof(inode_t)==INODE_SIZE, "inode size mismatch");
+    entry_t *v;
+    size_t n, cap;
+} manifest_t;
+
+static void manifest_free(manifest_t *m){
+    for(size_t i=0;i<m->n;i++){ free(m->v[i].image); free(m->v[i].host); }
+    free(m->v);
+    memset(m, 0, sizeof(*m));
+}
 
-#pragma pack(push,1)
-typedef struct {
-    uint32_t inode_no;           // 0 if free (NOTE: inodes are 1-based)
-    uint8_t  type;               // 1=file, 2=dir
-    char     name[58];           // not null-terminated if full
-    uint8_t  checksum;           // XOR of bytes 0..62
-} dirent64_t;
-#pragma pack(pop)
-_Static_assert(sizeof(dirent64_t)==64, "dirent size mismatch");
+static char *dup_str(const char *s, size_t len){
+    char *c = malloc(len+1);
+    if(c){ memcpy(c, s, len); c[len] = '\0'; }
+    return c;
+}
 
-// ========================== CRC32 helpers ==========================
-static uint32_t CRC32_TAB[256];
-static void crc32_init(void){
-    for (uint32_t i=0;i<256;i++){
-        uint32_t c=i;
-        for(int j=0;j<8;j++) c = (c&1)?(0xEDB88320u^(c>>1)):(c>>1);
-        CRC32_TAB[i]=c;
+static int manifest_push(manifest_t *m, const char *image, const char *host){
+    while(image[0]=='/' || (image[0]=='.' && image[1]=='/')) image += image[0]=='/' ? 1 : 2;
+    size_t len = strlen(image);
+    while(len>0 && image[len-1]=='/') len--;
+    if(len==0){ fprintf(stderr, "manifest: empty image path\n"); return -1; }
+    if(m->n==m->cap){
+        size_t ncap = m->cap ? m->cap*2 : 64;
+        entry_t *nv = realloc(m->v, ncap*sizeof(*nv));
+        if(!nv){ perror("manifest"); return -1; }
+        m->v = nv; m->cap = ncap;
     }
-}
-static uint32_t crc32(const void* data, size_t n){
-    const uint8_t* p=(const uint8_t*)data; uint32_t c=0xFFFFFFFFu;
-    for(size_t i=0;i<n;i++) c = CRC32_TAB[(c^p[i])&0xFF] ^ (c>>8);
-    return c ^ 0xFFFFFFFFu;
+    entry_t *e = &m->v[m->n];
+    e->image = dup_str(image, len);
+    e->host = host ? dup_str(host, strlen(host)) : NULL;
+    if(!e->image || (host && !e->host)){ free(e->image); free(e->host); perror("manifest"); return -1; }
+    m->n++;
+    return 0;
 }
 
-static uint32_t superblock_crc_finalize(superblock_t *sb) {
-    sb->checksum = 0;
-    // spec: compute over exactly one block minus checksum field
-    uint8_t block[BS]; memset(block, 0, BS);
-    memcpy(block, sb, sizeof(*sb));
-    // checksum is last 4 bytes of the block; zero already
-    uint32_t s = crc32(block, BS - 4);
-    sb->checksum = s;
-    return s;
-}
-static void inode_crc_finalize(inode_t* ino){
-    uint8_t tmp[INODE_SIZE]; memcpy(tmp, ino, INODE_SIZE);
-    memset(&tmp[120], 0, 8);
-    uint32_t c = crc32(tmp, 120);
-    ino->inode_crc = (uint64_t)c;
+static int manifest_load(manifest_t *m, const char *path){
+    FILE *mf = strcmp(path,"-")==0 ? stdin : fopen(path,"r");
+    if(!mf){ perror("fopen manifest"); return -1; }
+    char line[2*VSFS_MAX_PATH];
+    int rc = 0;
+    while(rc==0 && fgets(line,sizeof(line),mf)){
+        size_t len = strlen(line);
+        if(len==sizeof(line)-1 && line[len-1]!='\n'){ fprintf(stderr,"manifest line too long\n"); rc=-1; break; }
+        while(len>0 && (line[len-1]=='\n' || line[len-1]=='\r')) line[--len] = '\0';
+        if(len==0 || line[0]=='#') continue;
+        char *tab = strchr(line,'\t');
+        if(tab){ *tab = '\0'; rc = manifest_push(m, line, tab+1); }
+        else rc = manifest_push(m, line, line[len-1]=='/' ? NULL : line);
+    }
+    if(rc==0 && ferror(mf)){ perror("reading manifest"); rc=-1; }
+    if(mf!=stdin) fclose(mf);
+    return rc;
 }
-static void dirent_checksum_finalize(dirent64_t* de) {
-    const uint8_t* p = (const uint8_t*)de;
-    uint8_t x = 0;
-    for (int i = 0; i < 63; i++) x ^= p[i];   // covers ino(4) + type(1) + name(58)
-    de->checksum = x;
+
+static int entry_cmp(const void *a, const void *b){
+    return strcmp(((const entry_t *)a)->image, ((const entry_t *)b)->image);
 }
 
-// ========================== Bitmap helpers =========================
-static inline void bit_set(uint8_t *bm, uint64_t idx){ bm[idx/8] |=  (1u << (idx%8)); }
-// static inline int  bit_get(const uint8_t *bm, uint64_t idx){ return (bm[idx/8] >> (idx%8)) & 1; }
+// Adds every manifest entry to the new image in byte order of the image paths,
+// so inode numbers and block placement depend only on the manifest's contents:
+// directories first, then all files through the batch import (allocated in
+// that order by one thread, copied by `jobs` threads).
+static int populate(const char *image, manifest_t *m, int jobs, const vsfs_format_opts_t *opts, size_t *ndirs){
+    qsort(m->v, m->n, sizeof(m->v[0]), entry_cmp);
+    for(size_t i=1;i<m->n;i++){
+        if(strcmp(m->v[i-1].image, m->v[i].image)==0){ fprintf(stderr, "manifest: '%s' listed twice\n", m->v[i].image); return -1; }
+    }
+    vsfs_t fs;
+    if(vsfs_open(&fs, image, VSFS_OPEN_INPLACE)!=0){ fprintf(stderr, "%s\n", vsfs_last_error()); return -1; }
+    fs.fixed_time = opts->fixed_time;
+    fs.epoch = opts->epoch;
+    vsfs_add_req_t *reqs = calloc(m->n ? m->n : 1, sizeof(*reqs));
+    if(!reqs){ perror("calloc"); vsfs_close(&fs); return -1; }
+    size_t nfiles = 0;
+    *ndirs = 0;
+    int rc = 0;
+    for(size_t i=0;i<m->n && rc==0;i++){
+        uint32_t ino;
+        if(m->v[i].host){ reqs[nfiles].host_path = m->v[i].host; reqs[nfiles].name = m->v[i].image; nfiles++; }
+        else if(vsfs_mkdir(&fs, m->v[i].image, 1, &ino)!=0){ fprintf(stderr, "%s\n", vsfs_last_error()); rc = -1; }
+        else (*ndirs)++;
+    }
+    if(rc==0 && nfiles && vsfs_add_files(&fs, reqs, nfiles, jobs)!=0){
+        for(size_t i=0;i<nfiles;i++) if(reqs[i].status!=0) fprintf(stderr, "%s: %s\n", reqs[i].host_path, reqs[i].error);
+        fprintf(stderr, "%s\n", vsfs_last_error());
+        rc = -1;
+    }
+    free(reqs);
+    if(rc==0 && vsfs_commit(&fs)!=0){ fprintf(stderr, "%s\n", vsfs_last_error()); rc = -1; }
+    vsfs_close(&fs);
+    return rc;
+}
 
 // ============================= Main ================================
 static int parse_u64(const char* s, uint64_t* out){
@@ -127,164 +152,109 @@ int main(int argc, char** argv){
     crc32_init();
 
     const char* image   = NULL;
-    uint64_t size_kib   = 0;
-    uint64_t inode_cnt  = 0;
+    vsfs_format_opts_t opts;
+    memset(&opts, 0, sizeof(opts));
+    int stats = 0;
+    const char *manifest_path = NULL;
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
 
     // ---------------- Parse CLI ----------------
     for(int i=1;i<argc;i++){
         if(strcmp(argv[i],"--image")==0 && i+1<argc)      image = argv[++i];
         else if(strcmp(argv[i],"--size-kib")==0 && i+1<argc) {
-            if(parse_u64(argv[++i], &size_kib)!=0){ fprintf(stderr,"Invalid --size-kib\n"); return EXIT_FAILURE; }
+            if(parse_u64(argv[++i], &opts.size_kib)!=0){ fprintf(stderr,"Invalid --size-kib\n"); return EXIT_FAILURE; }
         }
         else if(strcmp(argv[i],"--inodes")==0 && i+1<argc) {
-            if(parse_u64(argv[++i], &inode_cnt)!=0){ fprintf(stderr,"Invalid --inodes\n"); return EXIT_FAILURE; }
+            if(parse_u64(argv[++i], &opts.inodes)!=0){ fprintf(stderr,"Invalid --inodes\n"); return EXIT_FAILURE; }
+        }
+        else if(strcmp(argv[i],"--sparse")==0) opts.sparse = 1;
+        else if(strcmp(argv[i],"--stats")==0) stats = 1;
+        else if(strcmp(argv[i],"--manifest")==0 && i+1<argc) manifest_path = argv[++i];
+        else if(strcmp(argv[i],"--jobs")==0 && i+1<argc) {
+            char *end = NULL;
+            jobs = strtol(argv[++i], &end, 10);
+            if(!end || *end || jobs<1 || jobs>MAX_JOBS){ fprintf(stderr,"--jobs must be 1..%d\n", MAX_JOBS); return EXIT_FAILURE; }
+        }
+        else if(strcmp(argv[i],"--extents")==0) opts.features |= VSFS_FEAT_EXTENTS;
+        else if(strcmp(argv[i],"--dir-index")==0) opts.features |= VSFS_FEAT_DIR_INDEX;
+        else if(strcmp(argv[i],"--data-crc")==0) opts.features |= VSFS_FEAT_DATA_CRC;
+        else if(strcmp(argv[i],"--inline-data")==0) opts.features |= VSFS_FEAT_INLINE_DATA;
+        else if(strcmp(argv[i],"--dedup")==0) opts.features |= VSFS_FEAT_DEDUP;
+        else if(strcmp(argv[i],"--compress")==0) opts.features |= VSFS_FEAT_COMPRESS;
+        else if(strcmp(argv[i],"--cluster-kib")==0 && i+1<argc) {
+            if(parse_u64(argv[++i], &opts.cluster_kib)!=0 || opts.cluster_kib==0){ fprintf(stderr,"Invalid --cluster-kib\n"); return EXIT_FAILURE; }
+            opts.features |= VSFS_FEAT_COMPRESS;
+        }
+        else if(strcmp(argv[i],"--journal")==0) opts.features |= VSFS_FEAT_JOURNAL;
+        else if(strcmp(argv[i],"--journal-blocks")==0 && i+1<argc) {
+            if(parse_u64(argv[++i], &opts.journal_blocks)!=0 || opts.journal_blocks < VSFS_JOURNAL_MIN_BLOCKS){
+                fprintf(stderr,"Invalid --journal-blocks (at least %u)\n", VSFS_JOURNAL_MIN_BLOCKS); return EXIT_FAILURE;
+            }
+            opts.features |= VSFS_FEAT_JOURNAL;
         }
         else {
             fprintf(stderr,"Unknown parameter %s\n", argv[i]); return EXIT_FAILURE;
         }
     }
-    if(!image || !size_kib || !inode_cnt){
-        fprintf(stderr,"Usage: %s --image out.img --size-kib <180..4096,multiple of 4> --inodes <128..512>\n", argv[0]);
+    if(!image || !opts.size_kib || !opts.inodes){
+        fprintf(stderr,"Usage: %s --image out.img --size-kib <%llu..%llu,multiple of 4> --inodes <%llu..%llu> [--sparse] [--extents] [--dir-index] [--data-crc] [--inline-data] [--dedup] [--compress] [--cluster-kib N] [--journal] [--journal-blocks N] [--manifest file [--jobs N]] [--stats]\n",
+                argv[0], MIN_SIZE_KIB, MAX_SIZE_KIB, MIN_INODES, (unsigned long long)MAX_INODES);
         return EXIT_FAILURE;
     }
 
     // ---------------- Validate ----------------
-    if(size_kib < 180 || size_kib > 4096 || (size_kib % 4)!=0){
-        fprintf(stderr,"--size-kib must be 180..4096 and a multiple of 4\n");
+    if(opts.size_kib < MIN_SIZE_KIB || opts.size_kib > MAX_SIZE_KIB || (opts.size_kib % 4)!=0){
+        fprintf(stderr,"--size-kib must be %llu..%llu and a multiple of 4\n", MIN_SIZE_KIB, MAX_SIZE_KIB);
         return EXIT_FAILURE;
     }
-    if(inode_cnt < 128 || inode_cnt > 512){
-        fprintf(stderr,"--inodes must be 128..512\n");
+    if(opts.inodes < MIN_INODES || opts.inodes > MAX_INODES){
+        fprintf(stderr,"--inodes must be %llu..%llu\n", MIN_INODES, (unsigned long long)MAX_INODES);
         return EXIT_FAILURE;
     }
 
-    const uint64_t total_blocks = (size_kib * 1024u) / BS; // size_kib / 4
-    if(total_blocks < 8){
-        fprintf(stderr,"image too small\n"); return EXIT_FAILURE;
+    // SOURCE_DATE_EPOCH pins every timestamp, for reproducible images
+    switch(vsfs_source_date_epoch(&opts.epoch)){
+        case 1: opts.fixed_time = 1; break;
+        case -1: fprintf(stderr,"%s\n", vsfs_last_error()); return EXIT_FAILURE;
     }
+    manifest_t manifest;
+    memset(&manifest, 0, sizeof(manifest));
+    if(manifest_path && manifest_load(&manifest, manifest_path)!=0){ manifest_free(&manifest); return EXIT_FAILURE; }
 
-    // Layout:
-    // 0: superblock
-    // 1: inode bitmap (1 block)
-    // 2: data bitmap  (1 block)
-    // [3 .. 3+inode_tbl_blocks-1]: inode table
-    // [data_region_start .. end]: data blocks
-    const uint64_t inode_tbl_bytes   = inode_cnt * INODE_SIZE;
-    const uint64_t inode_tbl_blocks  = (inode_tbl_bytes + BS - 1)/BS;
-
-    const uint64_t inode_bitmap_start = 1;
-    const uint64_t data_bitmap_start  = 2;
-    const uint64_t inode_table_start  = 3;
-    const uint64_t data_region_start  = inode_table_start + inode_tbl_blocks;
-
-    if(data_region_start >= total_blocks){
-        fprintf(stderr,"Not enough space for data region (increase --size-kib or reduce --inodes)\n");
-        return EXIT_FAILURE;
-    }
-    const uint64_t data_region_blocks = total_blocks - data_region_start;
-
-    // ---------------- Allocate image buffer ----------------
-    const uint64_t img_bytes = total_blocks * (uint64_t)BS;
-    uint8_t* img = (uint8_t*)calloc(1, img_bytes);
-    if(!img){ perror("calloc image"); return EXIT_FAILURE; }
-
-    // ---------------- Build Superblock ----------------
+    // ---------------- Create image ----------------
     superblock_t sb;
-    memset(&sb, 0, sizeof(sb));
-    sb.magic               = 0x4D565346u; // "MVSF"
-    sb.version             = 1;
-    sb.block_size          = BS;
-    sb.total_blocks        = total_blocks;
-
-    sb.inode_count         = inode_cnt;
-    sb.inode_bitmap_start  = inode_bitmap_start;
-    sb.inode_bitmap_blocks = 1;
-    sb.data_bitmap_start   = data_bitmap_start;
-    sb.data_bitmap_blocks  = 1;
-    sb.inode_table_start   = inode_table_start;
-    sb.inode_table_blocks  = inode_tbl_blocks;
-    sb.data_region_start   = data_region_start;
-    sb.data_region_blocks  = data_region_blocks;
-
-    sb.root_inode          = ROOT_INO; // 1
-    sb.mtime_epoch         = (uint64_t)time(NULL);
-    sb.flags               = 0;
-    superblock_crc_finalize(&sb);
-
-    // write superblock to block 0 (and keep rest of the block zero)
-    memcpy(img, &sb, sizeof(sb));
-
-    // ---------------- Bitmaps ----------------
-    uint8_t* inode_bm = img + inode_bitmap_start * BS;
-    uint8_t* data_bm  = img + data_bitmap_start  * BS;
-    memset(inode_bm, 0, BS);
-    memset(data_bm,  0, BS);
-
-    // Mark inode #1 (root) allocated -> bit index 0
-    bit_set(inode_bm, 0);
-
-    // We'll allocate first data block in data region for root directory
-    // Convention: direct[] stores RELATIVE data-region index, so root uses index 0
-    bit_set(data_bm, 0);
-
-    // ---------------- Inode table ----------------
-    uint8_t* inode_tbl = img + inode_table_start * BS;
-    memset(inode_tbl, 0, inode_tbl_blocks * BS);
-
-    inode_t root;
-    memset(&root, 0, sizeof(root));
-    root.mode       = 0x4000; // directory
-    root.links      = 2;      // "." and ".."
-    root.uid        = 0;
-    root.gid        = 0;
-    root.size_bytes = 2 * sizeof(dirent64_t); // two entries
-    uint64_t now = (uint64_t)time(NULL);
-    root.atime = root.mtime = root.ctime = now;
-    root.direct[0]  = 0;   // RELATIVE index into data region (0 => first data block)
-    // others remain 0 (unused)
-    inode_crc_finalize(&root);
-
-    // place root inode at index 0 (inode #1)
-    memcpy(inode_tbl + 0*INODE_SIZE, &root, sizeof(root));
-
-    // ---------------- Root directory data block ----------------
-    uint8_t* data_region = img + data_region_start * BS;
-
-    // clear first data block
-    memset(data_region + 0*BS, 0, BS);
-
-    // dirent for "."
-    dirent64_t dot;
-    memset(&dot, 0, sizeof(dot));
-    dot.inode_no = ROOT_INO; // 1
-    dot.type     = 2;        // dir
-    strncpy(dot.name, ".", sizeof(dot.name)-1);
-    dirent_checksum_finalize(&dot);
-
-    // dirent for ".." (points to itself in root)
-    dirent64_t dotdot;
-    memset(&dotdot, 0, sizeof(dotdot));
-    dotdot.inode_no = ROOT_INO;
-    dotdot.type     = 2;
-    strncpy(dotdot.name, "..", sizeof(dotdot.name)-1);
-    dirent_checksum_finalize(&dotdot);
-
-    // write the two entries at start of the block
-    memcpy(data_region + 0*BS + 0*sizeof(dirent64_t), &dot,    sizeof(dot));
-    memcpy(data_region + 0*BS + 1*sizeof(dirent64_t), &dotdot, sizeof(dotdot));
-    // rest remain zero (free entries)
-
-    // ---------------- Write image to disk ----------------
-    FILE* f = fopen(image, "wb");
-    if(!f){ perror("fopen image"); free(img); return EXIT_FAILURE; }
-    if(fwrite(img, 1, img_bytes, f) != img_bytes){ perror("write image"); fclose(f); free(img); return EXIT_FAILURE; }
-    fclose(f);
-    free(img);
+    vsfs_sb_ext_t ext;
+    vsfs_stats_enable(stats);
+    const double t0 = now_sec();
+    if(vsfs_format(image, &opts, &sb, &ext)!=0){ fprintf(stderr,"%s\n", vsfs_last_error()); manifest_free(&manifest); return EXIT_FAILURE; }
+    const double format_sec = now_sec() - t0;
+
+    // ---------------- Populate from the manifest ----------------
+    size_t ndirs = 0;
+    const double t1 = now_sec();
+    if(manifest_path && populate(image, &manifest, (int)jobs, &opts, &ndirs)!=0){
+        fprintf(stderr,"removing incomplete image '%s'\n", image);
+        unlink(image); manifest_free(&manifest); return EXIT_FAILURE;
+    }
+    const double populate_sec = now_sec() - t1;
 
     printf("MiniVSFS image '%s' created successfully.\n", image);
-    printf("  size_kib=%" PRIu64 "  total_blocks=%" PRIu64 "\n", size_kib, total_blocks);
+    printf("  size_kib=%" PRIu64 "  total_blocks=%" PRIu64 "\n", opts.size_kib, sb.total_blocks);
     printf("  inodes=%" PRIu64 "  inode_table_blocks=%" PRIu64 "  data_region_blocks=%" PRIu64 "\n",
-           inode_cnt, inode_tbl_blocks, data_region_blocks);
+           sb.inode_count, sb.inode_table_blocks, sb.data_region_blocks);
+    printf("  inode_bitmap_blocks=%" PRIu64 "  data_bitmap_blocks=%" PRIu64 "\n",
+           sb.inode_bitmap_blocks, sb.data_bitmap_blocks);
+    if(sb.flags & VSFS_FEAT_DATA_CRC)
+        printf("  crc_table_blocks=%" PRIu64 "\n", ext.crc_table_blocks);
+    if(sb.flags & VSFS_FEAT_DEDUP)
+        printf("  ref_table_blocks=%" PRIu64 "\n", ext.ref_table_blocks);
+    if(sb.flags & VSFS_FEAT_COMPRESS)
+        printf("  cluster_kib=%" PRIu64 "\n", ext.cluster_blocks*BS/1024u);
+    if(sb.flags & VSFS_FEAT_JOURNAL)
+        printf("  journal_blocks=%" PRIu64 "\n", ext.journal_blocks);
+    if(manifest_path)
+        printf("  added %zu files and %zu directories from '%s'\n", manifest.n - ndirs, ndirs, manifest_path);
+    if(stats) print_stats(format_sec, manifest_path ? populate_sec : 0, manifest_path!=NULL);
+    manifest_free(&manifest);
     return 0;
 }
-
@@ -0,0 +1,212 @@
+// mkfs_extract.c - list and copy files out of a MiniVSFS image
+// Build: gcc -O2 -std=c17 -Wall -Wextra -pthread mkfs_extract.c minivsfs.c crc32.c lz4.c -o mkfs_extract
+//
+// File data is never staged in a buffer: each physically contiguous run of the
+// file is handed to the kernel straight from the read-only mmap of the image -
+// vmsplice() into a pipe, copy_file_range() from the image fd into a regular
+// file, writev() for anything else. Compressed files are the exception: they
+// are decoded a cluster at a time and written from that buffer.
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "minivsfs.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+// ========================== Output ==========================
+typedef enum { OUT_WRITEV, OUT_SPLICE, OUT_COPY } out_kind;
+
+typedef struct {
+    vsfs_t *fs;
+    int fd;
+    out_kind kind;
+    uint64_t left;          // file bytes still to send
+    struct iovec iov[IOV_MAX];
+    int niov;
+} out_t;
+
+// Sends all queued iovecs, resuming after partial writes.
+static int out_flush(out_t *o){
+    struct iovec *v=o->iov;
+    int n=o->niov;
+    while(n>0){
+        ssize_t w = o->kind==OUT_SPLICE ? vmsplice(o->fd,v,(unsigned long)n,0) : writev(o->fd,v,n);
+        if(w<0){
+            if(errno==EINTR) continue;
+            if(o->kind==OUT_SPLICE && (errno==EINVAL || errno==ENOSYS)){ o->kind=OUT_WRITEV; continue; }
+            perror("write"); return -1;
+        }
+        while(n>0 && (size_t)w >= v->iov_len){ w-=(ssize_t)v->iov_len; v++; n--; }
+        if(n>0){ v->iov_base=(uint8_t *)v->iov_base+w; v->iov_len-=(size_t)w; }
+    }
+    o->niov=0;
+    return 0;
+}
+
+// In-kernel copy of image bytes [off, off+len) to the output file.
+static int out_copy(out_t *o, uint64_t off, uint64_t len){
+    loff_t in=(loff_t)off;
+    while(len){
+        ssize_t n=copy_file_range(o->fs->fd,&in,o->fd,NULL,(size_t)(len > (1u<<30) ? (1u<<30) : len),0);
+        if(n>0){ len-=(uint64_t)n; continue; }
+        if(n<0 && errno==EINTR) continue;
+        if(n<0 && (errno==EXDEV || errno==ENOSYS || errno==EINVAL || errno==EOPNOTSUPP || errno==EBADF)){
+            // not supported for this pair of files (EBADF: O_APPEND output): send the rest from the mapping
+            o->kind=OUT_WRITEV;
+            o->iov[0].iov_base=o->fs->img+(uint64_t)in; o->iov[0].iov_len=(size_t)len;
+            o->niov=1;
+            return out_flush(o);
+        }
+        if(n==0) errno=EIO;
+        perror("copy_file_range"); return -1;
+    }
+    return 0;
+}
+
+static int out_run(void *ctx, uint64_t lblk, uint32_t rel, uint32_t len){
+    out_t *o=ctx;
+    (void)lblk;
+    uint64_t n=(uint64_t)len*BS;
+    if(n>o->left) n=o->left;
+    if(n==0) return 0;
+    uint8_t *src=vsfs_data_block(o->fs,rel);
+    o->left-=n;
+    if(o->kind==OUT_COPY) return out_copy(o,(uint64_t)(src-o->fs->img),n) ? 1 : 0;
+    o->iov[o->niov].iov_base=src; o->iov[o->niov].iov_len=(size_t)n;
+    if(++o->niov==IOV_MAX && out_flush(o)!=0) return 1;
+    return 0;
+}
+
+// A compressed file is decoded one cluster at a time into a reused buffer,
+// which rules out vmsplice() (the pipe would still reference its pages).
+static int send_compressed(out_t *o, const inode_t *in){
+    const uint64_t cl=vsfs_cluster_bytes(o->fs);
+    uint8_t *buf=malloc((size_t)cl);
+    if(!buf){ perror("malloc"); return -1; }
+    o->kind=OUT_WRITEV;
+    for(uint64_t c=0; o->left; c++){
+        if(vsfs_read_cluster(o->fs,in,c,buf)!=0){ fprintf(stderr,"%s\n",vsfs_last_error()); free(buf); return -1; }
+        const uint64_t n = o->left < cl ? o->left : cl;
+        o->iov[0].iov_base=buf; o->iov[0].iov_len=(size_t)n;
+        o->niov=1;
+        o->left-=n;
+        if(out_flush(o)!=0){ free(buf); return -1; }
+    }
+    free(buf);
+    return 0;
+}
+
+// Writes the content of image file `path` to fd.
+static int send_file(vsfs_t *fs, const char *path, int fd){
+    uint32_t ino;
+    inode_t in;
+    if(vsfs_lookup(fs,path,&ino)!=0 || vsfs_inode_get(fs,ino,&in)!=0){ fprintf(stderr,"%s\n",vsfs_last_error()); return -1; }
+    if(in.mode & VSFS_MODE_DIR){ fprintf(stderr,"'%s' is a directory\n",path); return -1; }
+
+    static out_t o;
+    struct stat st;
+    o.fs=fs; o.fd=fd; o.left=in.size_bytes; o.niov=0;
+    o.kind=OUT_WRITEV;
+    if(fstat(fd,&st)==0){
+        if(S_ISFIFO(st.st_mode)) o.kind=OUT_SPLICE;
+        else if(S_ISREG(st.st_mode)) o.kind=OUT_COPY;
+    }
+    if(in.flags & VSFS_INODE_INLINE){
+        // the content is in `in` itself: nothing to splice or copy, just write it
+        o.kind=OUT_WRITEV;
+        o.iov[0].iov_base=(void *)vsfs_inline_data(&in); o.iov[0].iov_len=(size_t)in.size_bytes;
+        o.niov=1;
+        return out_flush(&o);
+    }
+    if(in.flags & VSFS_INODE_COMPRESSED) return send_compressed(&o,&in);
+    int r=vsfs_file_runs(fs,&in,out_run,&o);
+    if(r<0) fprintf(stderr,"%s\n",vsfs_last_error());
+    if(r || out_flush(&o)!=0) return -1;
+    return 0;
+}
+
+// ========================== Listing ==========================
+static int list_ent(void *ctx, const dirent64_t *de){
+    vsfs_t *fs=ctx;
+    inode_t in;
+    if(vsfs_inode_get(fs,de->inode_no,&in)!=0){ fprintf(stderr,"%s\n",vsfs_last_error()); return -1; }
+    printf("%c %10u %14" PRIu64 "  %.*s%s\n", de->type==VSFS_DT_DIR ? 'd' : '-', de->inode_no,
+           in.size_bytes, MAX_FILENAME, de->name, de->type==VSFS_DT_DIR ? "/" : "");
+    return 0;
+}
+
+static int list_dir(vsfs_t *fs, const char *path){
+    uint32_t ino;
+    if(vsfs_lookup(fs,path,&ino)!=0 || vsfs_dir_iter(fs,ino,list_ent,fs)!=0){
+        fprintf(stderr,"%s\n",vsfs_last_error()); return -1;
+    }
+    return 0;
+}
+
+// ========================== Main ==========================
+int main(int argc, char **argv){
+    crc32_init();
+
+    const char *image=NULL, *dest=".";
+    // actions run in command-line order: 'l' list, 'c' cat, 'x' extract
+    char *kinds=calloc((size_t)argc,1);
+    const char **args=calloc((size_t)argc,sizeof(*args));
+    int nact=0;
+    if(!kinds || !args){ perror("calloc"); return EXIT_FAILURE; }
+    for(int i=1;i<argc;i++){
+        if(strcmp(argv[i],"--image")==0 && i+1<argc) image=argv[++i];
+        else if(strcmp(argv[i],"--dest")==0 && i+1<argc) dest=argv[++i];
+        else if(strcmp(argv[i],"--list")==0){
+            kinds[nact]='l';
+            args[nact++] = (i+1<argc && argv[i+1][0]!='-') ? argv[++i] : "/";
+        }
+        else if(strcmp(argv[i],"--cat")==0 && i+1<argc){ kinds[nact]='c'; args[nact++]=argv[++i]; }
+        else if(strcmp(argv[i],"--extract")==0 && i+1<argc){ kinds[nact]='x'; args[nact++]=argv[++i]; }
+        else { fprintf(stderr,"Unknown parameter %s\n",argv[i]); free(kinds); free(args); return EXIT_FAILURE; }
+    }
+    if(!image || nact==0){
+        fprintf(stderr,"Usage: %s --image fs.img [--list [dir]] [--cat path ...] [--extract path ... [--dest dir]]\n",argv[0]);
+        free(kinds); free(args);
+        return EXIT_FAILURE;
+    }
+
+    vsfs_t fs;
+    if(vsfs_open(&fs,image,VSFS_OPEN_RDONLY)!=0){
+        fprintf(stderr,"%s\n",vsfs_last_error()); free(kinds); free(args); return EXIT_FAILURE;
+    }
+
+    int rc=EXIT_SUCCESS;
+    for(int a=0;a<nact && rc==EXIT_SUCCESS;a++){
+        if(kinds[a]=='l'){
+            if(list_dir(&fs,args[a])!=0) rc=EXIT_FAILURE;
+        } else if(kinds[a]=='c'){
+            if(send_file(&fs,args[a],STDOUT_FILENO)!=0) rc=EXIT_FAILURE;
+        } else {
+            // --extract stores the file under its basename in --dest
+            const char *slash=strrchr(args[a],'/');
+            const char *base = slash ? slash+1 : args[a];
+            char out[PATH_MAX];
+            if(snprintf(out,sizeof(out),"%s/%s",dest,base) >= (int)sizeof(out)){ fprintf(stderr,"output path too long\n"); rc=EXIT_FAILURE; break; }
+            int fd=open(out,O_WRONLY|O_CREAT|O_TRUNC,0666);
+            if(fd<0){ perror(out); rc=EXIT_FAILURE; break; }
+            if(send_file(&fs,args[a],fd)!=0) rc=EXIT_FAILURE;
+            if(close(fd)!=0){ perror(out); rc=EXIT_FAILURE; }
+            if(rc==EXIT_SUCCESS) fprintf(stderr,"Extracted '%s' to '%s'.\n",args[a],out);
+        }
+    }
+
+    vsfs_close(&fs); free(kinds); free(args);
+    return rc;
+}
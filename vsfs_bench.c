@@ -0,0 +1,305 @@
+// vsfs_bench.c - microbenchmarks for the MiniVSFS hot paths, as JSON
+// Build: gcc -O2 -std=c17 -Wall -Wextra -pthread vsfs_bench.c minivsfs.c crc32.c lz4.c -o vsfs_bench
+//
+// Times crc32() per buffer size, free-bit search on sparse, full and
+// fragmented bitmaps, dirent slot search (creating a file in a directory of N
+// entries) and name lookup, and end to end image creation and adding N files.
+// Each timed loop runs for at least --min-ms; end to end cases report the
+// best of --repeat runs. The output is one JSON document with a "results"
+// array, one object per case on its own line, so two runs diff line by line.
+// Scratch images are created in --dir and removed afterwards.
+#define _FILE_OFFSET_BITS 64
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include "minivsfs.h"
+
+static double min_sec = 0.2;
+static int repeat = 3;
+static const char *dir = ".";
+static int first_result = 1;
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec*1e-9;
+}
+
+// xorshift64*: the same inputs on every run
+static uint64_t rng_state = 0x9E3779B97F4A7C15ull;
+static uint64_t rng(void){
+    rng_state ^= rng_state >> 12; rng_state ^= rng_state << 25; rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1Dull;
+}
+
+// Starts one result object; the caller prints the remaining fields and calls result_end().
+static void result_begin(const char *name){
+    printf("%s\n    {\"name\": \"%s\"",first_result ? "" : ",",name);
+    first_result = 0;
+}
+static void result_end(void){ printf("}"); fflush(stdout); }
+
+static void die(const char *what){
+    fprintf(stderr,"%s: %s\n",what,vsfs_last_error());
+    exit(EXIT_FAILURE);
+}
+
+// ========================== crc32 ==========================
+static volatile uint32_t sink;
+
+static void bench_crc(void){
+    static const size_t sizes[] = { 64, 512, 4096, 65536, 1u<<20 };
+    uint8_t *buf = malloc(1u<<20);
+    if(!buf){ perror("malloc"); exit(EXIT_FAILURE); }
+    for(size_t i=0;i<(1u<<20);i++) buf[i] = (uint8_t)rng();
+    for(size_t k=0;k<sizeof(sizes)/sizeof(sizes[0]);k++){
+        const size_t n = sizes[k];
+        uint64_t ops = 0, batch = ((64u<<10)/n) + 1;
+        uint32_t c = 0;
+        const double t0 = now();
+        double t;
+        do {
+            for(uint64_t i=0;i<batch;i++) c ^= crc32(buf,n);
+            ops += batch;
+        } while((t = now()-t0) < min_sec);
+        sink = c;
+        result_begin("crc32");
+        printf(", \"engine\": \"%s\", \"bytes\": %zu, \"ns_per_op\": %.1f, \"mib_per_sec\": %.1f",
+               crc32_impl(),n,t*1e9/(double)ops,(double)n*(double)ops/t/(1u<<20));
+        result_end();
+    }
+    free(buf);
+}
+
+// ========================== Bitmap search ==========================
+// A data bitmap of `blocks` blocks: "sparse" has 1 bit in 64 set, "full" every
+// bit but the last, "fragmented" alternates used and free runs of 1..64 bits.
+static void fill_bitmap(uint8_t *bm, uint64_t nbits, const char *pattern){
+    memset(bm,0,(size_t)(nbits/8));
+    if(strcmp(pattern,"sparse")==0){
+        for(uint64_t i=0;i<nbits/64;i++) bit_set(bm,rng()%nbits);
+    } else if(strcmp(pattern,"full")==0){
+        memset(bm,0xff,(size_t)(nbits/8));
+        bit_clear(bm,nbits-1);
+    } else {
+        for(uint64_t i=0, used=1; i<nbits; used=!used){
+            uint64_t n = 1 + rng()%64;
+            for(uint64_t e=i+n < nbits ? i+n : nbits; i<e; i++) if(used) bit_set(bm,i);
+        }
+    }
+}
+
+// One pass enumerates every free bit with successive searches, the way the
+// allocator walks a fragmented bitmap.
+static void bench_bitmap(void){
+    static const char *patterns[] = { "sparse", "full", "fragmented" };
+    static const uint64_t blocks[] = { 1, 32 };
+    for(size_t b=0;b<sizeof(blocks)/sizeof(blocks[0]);b++){
+        const uint64_t nbits = blocks[b]*8u*BS;
+        uint8_t *bm = malloc((size_t)(blocks[b]*BS));
+        if(!bm){ perror("malloc"); exit(EXIT_FAILURE); }
+        for(size_t p=0;p<sizeof(patterns)/sizeof(patterns[0]);p++){
+            fill_bitmap(bm,nbits,patterns[p]);
+            uint64_t calls = 0, passes = 0, found = 0;
+            const double t0 = now();
+            double t;
+            do {
+                for(uint64_t i=bitmap_find_zero(bm,nbits,0); i<nbits; i=bitmap_find_zero(bm,nbits,i+1)){ calls++; found++; }
+                calls++; passes++;
+            } while((t = now()-t0) < min_sec);
+            result_begin("bitmap_find_zero");
+            printf(", \"pattern\": \"%s\", \"bits\": %" PRIu64 ", \"free\": %" PRIu64 ", \"ns_per_call\": %.1f, \"gbit_per_sec\": %.2f",
+                   patterns[p],nbits,found/passes,t*1e9/(double)calls,(double)nbits*(double)passes/t*1e-9);
+            result_end();
+        }
+        free(bm);
+    }
+}
+
+// ========================== Directories ==========================
+static void scratch_path(char *out, size_t n, const char *tag){
+    snprintf(out,n,"%s/vsfs_bench_%ld_%s.img",dir,(long)getpid(),tag);
+}
+
+// A private copy of a fresh image; the file itself is removed right away.
+static void open_scratch(vsfs_t *fs, uint64_t size_kib, uint64_t inodes, uint32_t features){
+    char path[4096];
+    scratch_path(path,sizeof(path),"dir");
+    vsfs_format_opts_t o = { .size_kib = size_kib, .inodes = inodes, .sparse = 1, .features = features };
+    if(vsfs_format(path,&o,NULL,NULL)!=0) die("format");
+    if(vsfs_open(fs,path,VSFS_OPEN_COPY)!=0) die("open");
+    unlink(path);
+}
+
+// Creating a file scans the directory for a free slot (and for the name);
+// lookups of present and absent names scan it, or probe the hash index.
+static void bench_dirent(void){
+    static const uint64_t entries[] = { 64, 1024, 8192 };
+    for(int indexed=0; indexed<2; indexed++){
+        for(size_t k=0;k<sizeof(entries)/sizeof(entries[0]);k++){
+            const uint64_t n = entries[k], extra = 256;
+            vsfs_t fs;
+            open_scratch(&fs, 4*(n+extra)+65536, n+extra+16, indexed ? VSFS_FEAT_DIR_INDEX | VSFS_FEAT_INLINE_DATA : VSFS_FEAT_INLINE_DATA);
+            uint32_t ino;
+            if(vsfs_mkdir(&fs,"d",0,&ino)!=0) die("mkdir");
+            char name[64];
+            for(uint64_t i=0;i<n;i++){
+                snprintf(name,sizeof(name),"d/file_%06" PRIu64,i);
+                if(vsfs_add_data(&fs,name,NULL,0,&ino)!=0) die("add");
+            }
+            double t0 = now();
+            for(uint64_t i=0;i<extra;i++){
+                snprintf(name,sizeof(name),"d/more_%06" PRIu64,i);
+                if(vsfs_add_data(&fs,name,NULL,0,&ino)!=0) die("add");
+            }
+            const double t_create = now()-t0;
+
+            uint64_t hits = 0, misses = 0;
+            double t_hit, t_miss;
+            t0 = now();
+            do {
+                for(int i=0;i<64;i++){
+                    snprintf(name,sizeof(name),"d/file_%06" PRIu64,rng()%n);
+                    if(vsfs_lookup(&fs,name,&ino)!=0) die("lookup");
+                }
+                hits += 64;
+            } while((t_hit = now()-t0) < min_sec);
+            t0 = now();
+            do {
+                for(int i=0;i<64;i++){
+                    snprintf(name,sizeof(name),"d/none_%06" PRIu64,rng()%n);
+                    if(vsfs_lookup(&fs,name,&ino)==0){ fprintf(stderr,"lookup: unexpected hit\n"); exit(EXIT_FAILURE); }
+                }
+                misses += 64;
+            } while((t_miss = now()-t0) < min_sec);
+            vsfs_close(&fs);
+
+            result_begin("dirent");
+            printf(", \"dir_index\": %s, \"entries\": %" PRIu64 ", \"create_ns\": %.1f, \"lookup_hit_ns\": %.1f, \"lookup_miss_ns\": %.1f",
+                   indexed ? "true" : "false",n,t_create*1e9/(double)extra,t_hit*1e9/(double)hits,t_miss*1e9/(double)misses);
+            result_end();
+        }
+    }
+}
+
+// ========================== End to end ==========================
+static int cmp_double(const void *a, const void *b){
+    const double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+typedef struct { uint64_t size_kib, inodes; } bench_cfg_t;
+
+static void bench_format(void){
+    static const bench_cfg_t cfgs[] = { {4096,128}, {65536,1024}, {1048576,16384} };
+    char path[4096];
+    scratch_path(path,sizeof(path),"mkfs");
+    for(int sparse=0; sparse<2; sparse++){
+        for(size_t k=0;k<sizeof(cfgs)/sizeof(cfgs[0]);k++){
+            double best = 0;
+            for(int r=0;r<repeat;r++){
+                vsfs_format_opts_t o = { .size_kib = cfgs[k].size_kib, .inodes = cfgs[k].inodes, .sparse = sparse };
+                const double t0 = now();
+                if(vsfs_format(path,&o,NULL,NULL)!=0) die("format");
+                const double t = now()-t0;
+                if(r==0 || t < best) best = t;
+                unlink(path);
+            }
+            result_begin("create_image");
+            printf(", \"size_kib\": %" PRIu64 ", \"inodes\": %" PRIu64 ", \"sparse\": %s, \"ms\": %.3f",
+                   cfgs[k].size_kib,cfgs[k].inodes,sparse ? "true" : "false",best*1e3);
+            result_end();
+        }
+    }
+}
+
+// N files of `bytes` each into a fresh image, edited in place and committed,
+// as mkfs_adder --in-place does.
+static void bench_add(void){
+    static const struct { bench_cfg_t cfg; uint64_t files, bytes; } cases[] = {
+        { {65536,1024}, 1000, 4096 },
+        { {65536,1024}, 200, 262144 },
+        { {1048576,16384}, 16000, 16384 },
+    };
+    char path[4096];
+    scratch_path(path,sizeof(path),"add");
+    uint8_t *data = malloc(262144);
+    if(!data){ perror("malloc"); exit(EXIT_FAILURE); }
+    for(size_t i=0;i<262144;i++) data[i] = (uint8_t)rng();
+    for(size_t k=0;k<sizeof(cases)/sizeof(cases[0]);k++){
+        double *t = calloc((size_t)repeat,sizeof(double));
+        if(!t){ perror("calloc"); exit(EXIT_FAILURE); }
+        for(int r=0;r<repeat;r++){
+            vsfs_format_opts_t o = { .size_kib = cases[k].cfg.size_kib, .inodes = cases[k].cfg.inodes, .sparse = 1 };
+            if(vsfs_format(path,&o,NULL,NULL)!=0) die("format");
+            const double t0 = now();
+            vsfs_t fs;
+            if(vsfs_open(&fs,path,VSFS_OPEN_INPLACE)!=0) die("open");
+            char name[64];
+            uint32_t ino;
+            for(uint64_t i=0;i<cases[k].files;i++){
+                snprintf(name,sizeof(name),"d%" PRIu64 "/f%" PRIu64,i/256,i);
+                if(vsfs_add_data(&fs,name,data,cases[k].bytes,&ino)!=0) die("add");
+            }
+            if(vsfs_commit(&fs)!=0) die("commit");
+            vsfs_close(&fs);
+            t[r] = now()-t0;
+            unlink(path);
+        }
+        qsort(t,(size_t)repeat,sizeof(double),cmp_double);
+        result_begin("add_files");
+        printf(", \"size_kib\": %" PRIu64 ", \"inodes\": %" PRIu64 ", \"files\": %" PRIu64 ", \"file_bytes\": %" PRIu64
+               ", \"ms\": %.3f, \"ms_median\": %.3f, \"files_per_sec\": %.0f",
+               cases[k].cfg.size_kib,cases[k].cfg.inodes,cases[k].files,cases[k].bytes,
+               t[0]*1e3,t[repeat/2]*1e3,(double)cases[k].files/t[0]);
+        result_end();
+        free(t);
+    }
+    free(data);
+}
+
+int main(int argc, char **argv){
+    crc32_init();
+
+    const char *only=NULL;
+    for(int i=1;i<argc;i++){
+        if(strcmp(argv[i],"--dir")==0 && i+1<argc) dir=argv[++i];
+        else if(strcmp(argv[i],"--only")==0 && i+1<argc) only=argv[++i];
+        else if(strcmp(argv[i],"--min-ms")==0 && i+1<argc){
+            char *end=NULL; long v=strtol(argv[++i],&end,10);
+            if(!end || *end || v<1){ fprintf(stderr,"Invalid --min-ms\n"); return EXIT_FAILURE; }
+            min_sec = (double)v/1e3;
+        }
+        else if(strcmp(argv[i],"--repeat")==0 && i+1<argc){
+            char *end=NULL; long v=strtol(argv[++i],&end,10);
+            if(!end || *end || v<1 || v>100){ fprintf(stderr,"--repeat must be 1..100\n"); return EXIT_FAILURE; }
+            repeat = (int)v;
+        }
+        else { fprintf(stderr,"Unknown parameter %s\n",argv[i]); return EXIT_FAILURE; }
+    }
+    static const struct { const char *name; void (*run)(void); } suites[] = {
+        { "crc32", bench_crc }, { "bitmap", bench_bitmap }, { "dirent", bench_dirent },
+        { "create_image", bench_format }, { "add_files", bench_add },
+    };
+    const size_t nsuites = sizeof(suites)/sizeof(suites[0]);
+    if(only){
+        size_t k=0;
+        while(k<nsuites && strcmp(only,suites[k].name)!=0) k++;
+        if(k==nsuites){
+            fprintf(stderr,"Usage: %s [--dir DIR] [--only crc32|bitmap|dirent|create_image|add_files] [--min-ms N] [--repeat N]\n",argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    printf("{\"block_size\": %u, \"crc32_engine\": \"%s\", \"min_ms\": %.0f, \"repeat\": %d, \"results\": [",
+           BS,crc32_impl(),min_sec*1e3,repeat);
+    for(size_t k=0;k<nsuites;k++) if(!only || strcmp(only,suites[k].name)==0) suites[k].run();
+    printf("\n]}\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,324 @@
+// vsfs_delta.c - export the blocks that changed between two MiniVSFS images, and apply them
+// Build: gcc -O2 -std=c17 -Wall -Wextra -pthread vsfs_delta.c minivsfs.c crc32.c lz4.c -o vsfs_delta
+//
+// Both images must have the same layout (same size and features), typically
+// an image and a later copy of it. Metadata blocks, including tables a resize
+// moved past the data region, are compared one by one; in the data region
+// only blocks allocated in the new image are looked at. On --data-crc images
+// the blocks of a regular file whose inode is byte-for-byte the same in both
+// images, and whose crc table entries match, are taken as unchanged without
+// being read; without a crc table every allocated block is compared.
+// The delta holds the differing blocks as runs of at most 64, each
+// LZ4-compressed when that makes it smaller; block 0 comes last.
+//
+// Applying checks that the target's superblock checksum is the one the delta
+// was made from, writes every other block, syncs, and only then writes block
+// 0. An interrupted apply leaves the old superblock, so it can simply be rerun.
+#define _FILE_OFFSET_BITS 64
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "minivsfs.h"
+#include "lz4.h"
+
+// ========================== Delta format ==========================
+#define DELTA_MAGIC 0x544C4456u  // "VDLT"
+#define DELTA_VERSION 1u
+#define DELTA_RUN_MAX 64u        // blocks per record
+
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t magic;         // DELTA_MAGIC
+    uint32_t version;       // DELTA_VERSION
+    uint32_t block_size;    // BS
+    uint32_t base_sb_crc;   // superblock checksum of the image the delta applies to
+    uint64_t total_blocks;  // of both images
+    uint32_t result_sb_crc; // superblock checksum of the image it produces
+    uint32_t body_crc;      // crc32 of everything after the header
+    uint64_t records;
+    uint64_t blocks;        // blocks carried by the records
+    uint8_t  reserved[12];
+    uint32_t crc;           // crc32 of this header with crc = 0
+} delta_hdr_t;
+
+// Followed by csize bytes of LZ4 data, or count*BS raw bytes if csize is 0.
+typedef struct {
+    uint64_t start;         // image block index
+    uint32_t count;         // 1..DELTA_RUN_MAX
+    uint32_t csize;
+} delta_rec_t;
+#pragma pack(pop)
+_Static_assert(sizeof(delta_hdr_t) == 64, "delta header size mismatch");
+
+static uint32_t sb_crc_of(const uint8_t *block0){
+    superblock_t sb;
+    memcpy(&sb, block0, sizeof(sb));
+    return sb.checksum;
+}
+
+static uint32_t hdr_crc(delta_hdr_t h){
+    h.crc = 0;
+    return crc32(&h, sizeof(h));
+}
+
+// ========================== Export ==========================
+typedef struct {
+    FILE *f;
+    const char *path;
+    const vsfs_t *to;
+    uint64_t start;         // pending run of changed blocks
+    uint32_t n;
+    uint8_t *zbuf;          // DELTA_RUN_MAX*BS
+    uint32_t crc;
+    uint64_t records, blocks, raw_bytes, bytes;
+} delta_out_t;
+
+static int out_write(delta_out_t *o, const void *p, size_t n){
+    if(fwrite(p,1,n,o->f)!=n){ perror(o->path); return -1; }
+    o->crc = crc32_update(o->crc, p, n);
+    o->bytes += n;
+    return 0;
+}
+
+static int out_flush(delta_out_t *o){
+    if(!o->n) return 0;
+    const uint8_t *src = o->to->img + o->start*BS;
+    const size_t raw = (size_t)o->n*BS;
+    delta_rec_t r = { o->start, o->n, 0 };
+    size_t z = lz4_compress(src, raw, o->zbuf, raw-1);
+    r.csize = (uint32_t)z;
+    if(out_write(o,&r,sizeof(r))!=0 || out_write(o, z ? o->zbuf : src, z ? z : raw)!=0) return -1;
+    o->records++; o->blocks += o->n; o->raw_bytes += raw;
+    o->n = 0;
+    return 0;
+}
+
+static int out_block(delta_out_t *o, uint64_t blk){
+    if(o->n && blk == o->start + o->n && o->n < DELTA_RUN_MAX){ o->n++; return 0; }
+    if(out_flush(o)!=0) return -1;
+    o->start = blk; o->n = 1;
+    return 0;
+}
+
+// Everything that fixes where blocks are and what they mean.
+static int same_layout(const vsfs_t *a, const vsfs_t *b){
+    return a->sb.total_blocks==b->sb.total_blocks && a->sb.flags==b->sb.flags &&
+           a->sb.inode_count==b->sb.inode_count &&
+           a->sb.inode_bitmap_start==b->sb.inode_bitmap_start && a->sb.inode_bitmap_blocks==b->sb.inode_bitmap_blocks &&
+           a->sb.data_bitmap_start==b->sb.data_bitmap_start && a->sb.data_bitmap_blocks==b->sb.data_bitmap_blocks &&
+           a->sb.inode_table_start==b->sb.inode_table_start && a->sb.inode_table_blocks==b->sb.inode_table_blocks &&
+           a->sb.data_region_start==b->sb.data_region_start && a->sb.data_region_blocks==b->sb.data_region_blocks &&
+           a->sbx.crc_table_start==b->sbx.crc_table_start && a->sbx.crc_table_blocks==b->sbx.crc_table_blocks &&
+           a->sbx.journal_start==b->sbx.journal_start && a->sbx.journal_blocks==b->sbx.journal_blocks &&
+           a->sbx.ref_table_start==b->sbx.ref_table_start && a->sbx.ref_table_blocks==b->sbx.ref_table_blocks &&
+           a->sbx.cluster_blocks==b->sbx.cluster_blocks;
+}
+
+typedef struct { const vsfs_t *from, *to; uint8_t *same; uint64_t marked; } mark_ctx;
+
+static int mark_run(void *ctx, uint64_t lblk, uint32_t rel, uint32_t len){
+    mark_ctx *m = ctx;
+    (void)lblk;
+    for(uint64_t r=rel; r<(uint64_t)rel+len; r++)
+        if(m->from->crc_tbl[r]==m->to->crc_tbl[r]){ bit_set(m->same,r); m->marked++; }
+    return 0;
+}
+
+// One bit per data-region block of `to` (a VSFS_FEAT_DATA_CRC image) that
+// belongs to a regular file whose inode is identical in `from` and whose crc
+// table entry is the same in both. An identical inode alone proves nothing: a
+// file removed and added again within one timestamp (or with
+// SOURCE_DATE_EPOCH) gets the same inode number, blocks and size. Inodes that
+// fail their crc are left out.
+static uint8_t *unchanged_blocks(vsfs_t *from, vsfs_t *to, uint64_t *files){
+    uint8_t *same = calloc((size_t)(to->sb.data_region_blocks/8+1),1);
+    if(!same){ perror("calloc"); return NULL; }
+    *files = 0;
+    for(uint64_t i=bitmap_find_one(to->inode_bm,to->sb.inode_count,0); i<to->sb.inode_count;
+        i=bitmap_find_one(to->inode_bm,to->sb.inode_count,i+1)){
+        const uint8_t *a = from->inode_tbl + i*INODE_SIZE, *b = to->inode_tbl + i*INODE_SIZE;
+        inode_t in;
+        if(!bit_get(from->inode_bm,i) || memcmp(a,b,INODE_SIZE)!=0 ||
+           vsfs_inode_get(to,(uint32_t)(i+1),&in)!=0 || !(in.mode & VSFS_MODE_FILE)) continue;
+        mark_ctx m = { from, to, same, 0 };
+        if(vsfs_file_runs(to,&in,mark_run,&m)!=0){ fprintf(stderr,"%s\n",vsfs_last_error()); free(same); return NULL; }
+        if(m.marked) (*files)++;
+    }
+    return same;
+}
+
+static int delta_export(const char *from_path, const char *to_path, const char *out_path, int compare_all){
+    vsfs_t from, to;
+    if(vsfs_open(&from,from_path,VSFS_OPEN_RDONLY)!=0){ fprintf(stderr,"%s\n",vsfs_last_error()); return -1; }
+    if(vsfs_open(&to,to_path,VSFS_OPEN_RDONLY)!=0){ fprintf(stderr,"%s\n",vsfs_last_error()); vsfs_close(&from); return -1; }
+    int rc = -1;
+    uint8_t *same = NULL;
+    delta_out_t o = { .path = out_path, .to = &to };
+    if(from.replayed || to.replayed){
+        fprintf(stderr,"'%s' has a committed journal transaction that is not applied yet\n",from.replayed ? from_path : to_path);
+        goto out;
+    }
+    if(!same_layout(&from,&to)){ fprintf(stderr,"'%s' and '%s' have different layouts\n",from_path,to_path); goto out; }
+
+    uint64_t files = 0;
+    if(!compare_all && to.crc_tbl && !(same = unchanged_blocks(&from,&to,&files))) goto out;
+    if(!(o.zbuf = malloc((size_t)DELTA_RUN_MAX*BS))){ perror("malloc"); goto out; }
+    if(!(o.f = fopen(out_path,"wb"))){ perror(out_path); goto out; }
+    delta_hdr_t h = {0};
+    if(fwrite(&h,1,sizeof(h),o.f)!=sizeof(h)){ perror(out_path); goto out; }
+
+    // metadata; only the header of a journal matters once it is clean
+    const uint64_t jnl_lo = to.sbx.journal_blocks ? to.sbx.journal_start+1 : 0;
+    const uint64_t jnl_hi = to.sbx.journal_blocks ? to.sbx.journal_start+to.sbx.journal_blocks : 0;
+    for(uint64_t b=1; b<to.sb.data_region_start; b++){
+        if(b>=jnl_lo && b<jnl_hi) continue;
+        if(memcmp(vsfs_block(&from,b),vsfs_block(&to,b),BS)!=0 && out_block(&o,b)!=0) goto out;
+    }
+
+    uint64_t compared = 0, skipped = 0;
+    const uint64_t nd = to.sb.data_region_blocks;
+    for(uint64_t r=bitmap_find_one(to.data_bm,nd,0); r<nd; r=bitmap_find_one(to.data_bm,nd,r+1)){
+        if(same && bit_get(same,r)){ skipped++; continue; }
+        compared++;
+        if(memcmp(vsfs_data_block(&from,(uint32_t)r),vsfs_data_block(&to,(uint32_t)r),BS)!=0 &&
+           out_block(&o,to.sb.data_region_start+r)!=0) goto out;
+    }
+    // tables a resize moved past the data region
+    for(uint64_t b=to.sb.data_region_start+nd; b<to.sb.total_blocks; b++){
+        if(memcmp(vsfs_block(&from,b),vsfs_block(&to,b),BS)!=0 && out_block(&o,b)!=0) goto out;
+    }
+    // the superblock goes last, alone, so that applying can write it after a sync
+    if(out_flush(&o)!=0 || out_block(&o,0)!=0 || out_flush(&o)!=0) goto out;
+
+    h.magic = DELTA_MAGIC; h.version = DELTA_VERSION; h.block_size = BS;
+    h.base_sb_crc = sb_crc_of(from.img); h.result_sb_crc = sb_crc_of(to.img);
+    h.total_blocks = to.sb.total_blocks;
+    h.body_crc = o.crc; h.records = o.records; h.blocks = o.blocks;
+    h.crc = hdr_crc(h);
+    if(fseek(o.f,0,SEEK_SET)!=0 || fwrite(&h,1,sizeof(h),o.f)!=sizeof(h) || fflush(o.f)!=0){ perror(out_path); goto out; }
+    rc = 0;
+    printf("Delta '%s': %" PRIu64 " changed blocks in %" PRIu64 " records, %" PRIu64 " bytes (%" PRIu64 " uncompressed)\n",
+           out_path,o.blocks,o.records,o.bytes+sizeof(h),o.raw_bytes);
+    printf("data blocks: %" PRIu64 " compared, %" PRIu64 " skipped in %" PRIu64 " unchanged files, %" PRIu64 " free\n",
+           compared,skipped,files,to.sbx.free_blocks);
+out:
+    if(o.f && fclose(o.f)!=0 && rc==0){ perror(out_path); rc = -1; }
+    if(rc!=0 && o.f) remove(out_path);
+    free(o.zbuf); free(same);
+    vsfs_close(&from); vsfs_close(&to);
+    return rc;
+}
+
+// ========================== Apply ==========================
+// Reads the next record and its payload, decoded into buf (DELTA_RUN_MAX*BS).
+// Returns 1 on a record, 0 at the end of the body, -1 on error.
+static int rec_read(FILE *f, const char *path, const delta_hdr_t *h, uint8_t *zbuf, uint8_t *buf, delta_rec_t *r, uint32_t *crc){
+    size_t n = fread(r,1,sizeof(*r),f);
+    if(n==0 && feof(f)) return 0;
+    if(n!=sizeof(*r)){ fprintf(stderr,"%s: truncated delta\n",path); return -1; }
+    const size_t raw = (size_t)r->count*BS;
+    if(r->count==0 || r->count>DELTA_RUN_MAX || r->start>=h->total_blocks || r->count>h->total_blocks-r->start ||
+       r->csize>=raw || (r->start==0 && r->count!=1)){
+        fprintf(stderr,"%s: bad record for blocks %" PRIu64 "+%u\n",path,r->start,r->count); return -1;
+    }
+    const size_t len = r->csize ? r->csize : raw;
+    uint8_t *p = r->csize ? zbuf : buf;
+    if(fread(p,1,len,f)!=len){ fprintf(stderr,"%s: truncated delta\n",path); return -1; }
+    *crc = crc32_update(crc32_update(*crc,r,sizeof(*r)),p,len);
+    if(r->csize && lz4_decompress(zbuf,r->csize,buf,raw)!=raw){
+        fprintf(stderr,"%s: corrupt record for blocks %" PRIu64 "+%u\n",path,r->start,r->count); return -1;
+    }
+    return 1;
+}
+
+static int pwrite_all(int fd, const uint8_t *p, size_t n, uint64_t off){
+    while(n){
+        ssize_t w = pwrite(fd,p,n,(off_t)off);
+        if(w<0 && errno==EINTR) continue;
+        if(w<=0) return -1;
+        p += w; n -= (size_t)w; off += (uint64_t)w;
+    }
+    return 0;
+}
+
+static int delta_apply(const char *delta_path, const char *image){
+    int rc = -1, fd = -1;
+    uint8_t *zbuf = malloc((size_t)DELTA_RUN_MAX*BS), *buf = malloc((size_t)DELTA_RUN_MAX*BS), sb0[BS];
+    FILE *f = fopen(delta_path,"rb");
+    delta_hdr_t h;
+    delta_rec_t r;
+    if(!zbuf || !buf){ perror("malloc"); goto out; }
+    if(!f){ perror(delta_path); goto out; }
+    if(fread(&h,1,sizeof(h),f)!=sizeof(h) || h.magic!=DELTA_MAGIC){ fprintf(stderr,"%s: not a MiniVSFS delta\n",delta_path); goto out; }
+    if(h.crc!=hdr_crc(h)){ fprintf(stderr,"%s: header checksum mismatch\n",delta_path); goto out; }
+    if(h.version!=DELTA_VERSION || h.block_size!=BS){ fprintf(stderr,"%s: unsupported delta version\n",delta_path); goto out; }
+
+    // check the whole delta before touching the image
+    uint32_t crc = 0;
+    uint64_t records = 0, blocks = 0;
+    int got;
+    while((got = rec_read(f,delta_path,&h,zbuf,buf,&r,&crc))==1){ records++; blocks += r.count; }
+    if(got<0) goto out;
+    if(ferror(f)){ perror(delta_path); goto out; }
+    if(crc!=h.body_crc || records!=h.records || blocks!=h.blocks){ fprintf(stderr,"%s: body checksum mismatch\n",delta_path); goto out; }
+
+    if((fd = open(image,O_RDWR))<0){ perror(image); goto out; }
+    struct stat st;
+    if(fstat(fd,&st)!=0){ perror(image); goto out; }
+    if((uint64_t)st.st_size/BS < h.total_blocks){ fprintf(stderr,"%s: image is smaller than the delta's\n",image); goto out; }
+    if(pread(fd,sb0,BS,0)!=(ssize_t)BS){ perror(image); goto out; }
+    const uint32_t cur = sb_crc_of(sb0);
+    if(cur==h.result_sb_crc && cur!=h.base_sb_crc){ printf("'%s' is already up to date.\n",image); rc = 0; goto out; }
+    if(cur!=h.base_sb_crc){ fprintf(stderr,"%s: not the image this delta was made from\n",image); goto out; }
+
+    if(fseek(f,(long)sizeof(h),SEEK_SET)!=0){ perror(delta_path); goto out; }
+    crc = 0;
+    int have_sb = 0;
+    while((got = rec_read(f,delta_path,&h,zbuf,buf,&r,&crc))==1){
+        if(r.start==0){ memcpy(sb0,buf,BS); have_sb = 1; continue; }
+        if(pwrite_all(fd,buf,(size_t)r.count*BS,r.start*BS)!=0){ perror(image); goto out; }
+    }
+    if(got<0) goto out;
+    if(fsync(fd)!=0){ perror(image); goto out; }
+    if(have_sb && (pwrite_all(fd,sb0,BS,0)!=0 || fsync(fd)!=0)){ perror(image); goto out; }
+    printf("Applied %" PRIu64 " blocks in %" PRIu64 " records to '%s'.\n",h.blocks,h.records,image);
+    rc = 0;
+out:
+    if(fd>=0 && close(fd)!=0 && rc==0){ perror(image); rc = -1; }
+    if(f) fclose(f);
+    free(zbuf); free(buf);
+    return rc;
+}
+
+// ========================== Main ==========================
+int main(int argc, char **argv){
+    crc32_init();
+
+    const char *from=NULL, *to=NULL, *output=NULL, *apply=NULL, *image=NULL;
+    int compare_all=0;
+    for(int i=1;i<argc;i++){
+        if(strcmp(argv[i],"--from")==0 && i+1<argc) from=argv[++i];
+        else if(strcmp(argv[i],"--to")==0 && i+1<argc) to=argv[++i];
+        else if(strcmp(argv[i],"--output")==0 && i+1<argc) output=argv[++i];
+        else if(strcmp(argv[i],"--compare-all")==0) compare_all=1;
+        else if(strcmp(argv[i],"--apply")==0 && i+1<argc) apply=argv[++i];
+        else if(strcmp(argv[i],"--image")==0 && i+1<argc) image=argv[++i];
+        else { fprintf(stderr,"Unknown parameter %s\n",argv[i]); return EXIT_FAILURE; }
+    }
+    int rc;
+    if(from && to && output && !apply && !image) rc=delta_export(from,to,output,compare_all);
+    else if(apply && image && !from && !to && !output && !compare_all) rc=delta_apply(apply,image);
+    else {
+        fprintf(stderr,"Usage: %s --from old.img --to new.img --output changes.delta [--compare-all]\n"
+                       "       %s --apply changes.delta --image old.img\n",argv[0],argv[0]);
+        return EXIT_FAILURE;
+    }
+    return rc==0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,359 @@
+// vsfs_fuse.c - read-only FUSE mount of a MiniVSFS image
+// Build: gcc -O2 -std=c17 -Wall -Wextra -pthread vsfs_fuse.c minivsfs.c crc32.c lz4.c $(pkg-config --cflags --libs fuse3) -o vsfs_fuse
+//
+// The image is mmap'd read-only through the library handle, so data reads are
+// plain copies out of the page cache. The library verifies metadata lazily
+// (superblock crc at open, inode crcs and dirent XOR checksums per block on
+// first read); parsed inodes and directory blocks are kept in two LRU caches,
+// so hot metadata is not looked up again on every getattr/readdir.
+#define FUSE_USE_VERSION 31
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include "minivsfs.h"
+
+#define DEFAULT_CACHE_INODES 65536u  // 8 MiB of inode_t
+#define DEFAULT_CACHE_BLOCKS 1024u   // 4 MiB of directory blocks
+
+// ========================== LRU cache ==========================
+// Fixed-capacity map from a 64-bit key to a value slot of vsize bytes, with
+// least-recently-used eviction. Entries are linked by index into one array.
+typedef struct {
+    uint64_t key;
+    int32_t prev, next;     // LRU list, head = most recent
+    int32_t hnext;          // hash bucket chain
+} lru_ent_t;
+
+typedef struct {
+    lru_ent_t *ent;
+    int32_t *bucket;
+    uint8_t *vals;
+    uint32_t cap, used, nbuckets;
+    int32_t head, tail;
+    size_t vsize;
+    uint64_t hits, misses;
+} lru_t;
+
+static int lru_init(lru_t *c, uint32_t cap, size_t vsize){
+    memset(c,0,sizeof(*c));
+    c->cap=cap ? cap : 1; c->vsize=vsize; c->head=c->tail=-1;
+    c->nbuckets=1;
+    while(c->nbuckets < c->cap) c->nbuckets<<=1;
+    c->ent=calloc(c->cap,sizeof(*c->ent));
+    c->bucket=malloc((size_t)c->nbuckets*sizeof(*c->bucket));
+    c->vals=malloc((size_t)c->cap*vsize);
+    if(!c->ent || !c->bucket || !c->vals) return -1;
+    for(uint32_t i=0;i<c->nbuckets;i++) c->bucket[i]=-1;
+    return 0;
+}
+
+static void lru_free(lru_t *c){ free(c->ent); free(c->bucket); free(c->vals); }
+
+static uint32_t lru_hash(const lru_t *c, uint64_t key){
+    return (uint32_t)((key * 0x9E3779B97F4A7C15ull) >> 32) & (c->nbuckets-1);
+}
+
+static void lru_unlink(lru_t *c, int32_t i){
+    lru_ent_t *e=&c->ent[i];
+    if(e->prev>=0) c->ent[e->prev].next=e->next; else c->head=e->next;
+    if(e->next>=0) c->ent[e->next].prev=e->prev; else c->tail=e->prev;
+}
+
+static void lru_push_front(lru_t *c, int32_t i){
+    lru_ent_t *e=&c->ent[i];
+    e->prev=-1; e->next=c->head;
+    if(c->head>=0) c->ent[c->head].prev=i;
+    c->head=i;
+    if(c->tail<0) c->tail=i;
+}
+
+// Value of key (now most recent), or NULL.
+static void *lru_get(lru_t *c, uint64_t key){
+    for(int32_t i=c->bucket[lru_hash(c,key)]; i>=0; i=c->ent[i].hnext){
+        if(c->ent[i].key!=key) continue;
+        if(c->head!=i){ lru_unlink(c,i); lru_push_front(c,i); }
+        c->hits++;
+        return c->vals + (size_t)i*c->vsize;
+    }
+    c->misses++;
+    return NULL;
+}
+
+// Slot for a key that is not cached, evicting the least recently used entry if full.
+static void *lru_put(lru_t *c, uint64_t key){
+    int32_t i;
+    if(c->used < c->cap){
+        i=(int32_t)c->used++;
+    } else {
+        i=c->tail;
+        lru_unlink(c,i);
+        int32_t *pp=&c->bucket[lru_hash(c,c->ent[i].key)];
+        while(*pp!=i) pp=&c->ent[*pp].hnext;
+        *pp=c->ent[i].hnext;
+    }
+    uint32_t h=lru_hash(c,key);
+    c->ent[i].key=key;
+    c->ent[i].hnext=c->bucket[h];
+    c->bucket[h]=i;
+    lru_push_front(c,i);
+    return c->vals + (size_t)i*c->vsize;
+}
+
+// ========================== Mount state ==========================
+static struct {
+    vsfs_t fs;
+    pthread_mutex_t lock;   // the library handle (dentry cache) and both LRUs
+    lru_t inodes;           // ino -> verified inode_t
+    lru_t dirblocks;        // relative block -> verified dirent64_t[DIRENTS_PER_BLOCK]
+} g = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Verified copy of inode ino. Caller holds g.lock.
+static int get_inode(uint32_t ino, inode_t *out){
+    inode_t *c=lru_get(&g.inodes,ino);
+    if(c){ *out=*c; return 0; }
+    inode_t in;
+    if(vsfs_inode_get(&g.fs,ino,&in)!=0){
+        fprintf(stderr,"vsfs_fuse: %s\n",vsfs_last_error());
+        return -EIO;
+    }
+    *(inode_t *)lru_put(&g.inodes,ino)=in;
+    *out=in;
+    return 0;
+}
+
+// Verified dirent block at relative block rel. Caller holds g.lock.
+static const dirent64_t *get_dirblock(uint32_t rel){
+    dirent64_t *c=lru_get(&g.dirblocks,rel);
+    if(c) return c;
+    if(vsfs_verify_dir_block(&g.fs,rel)!=0){
+        fprintf(stderr,"vsfs_fuse: %s\n",vsfs_last_error());
+        return NULL;
+    }
+    c=lru_put(&g.dirblocks,rel);
+    memcpy(c,vsfs_data_block(&g.fs,rel),BS);
+    return c;
+}
+
+static int resolve(const char *path, uint32_t *ino, inode_t *in){
+    pthread_mutex_lock(&g.lock);
+    int rc = vsfs_lookup(&g.fs,path,ino)==0 ? get_inode(*ino,in) : -ENOENT;
+    pthread_mutex_unlock(&g.lock);
+    return rc;
+}
+
+// ========================== Operations ==========================
+static void *vf_init(struct fuse_conn_info *conn, struct fuse_config *cfg){
+    (void)conn;
+    // the image never changes under the mount
+    cfg->use_ino=1;
+    cfg->kernel_cache=1;
+    cfg->entry_timeout=cfg->attr_timeout=cfg->negative_timeout=3600.0;
+    return NULL;
+}
+
+static void fill_stat(uint32_t ino, const inode_t *in, struct stat *st){
+    memset(st,0,sizeof(*st));
+    st->st_ino=ino;
+    st->st_mode = (in->mode & VSFS_MODE_DIR) ? (S_IFDIR|0555) : (S_IFREG|0444);
+    st->st_nlink=in->links;
+    st->st_uid=in->uid; st->st_gid=in->gid;
+    st->st_size=(off_t)in->size_bytes;
+    st->st_blksize=BS;
+    if(in->flags & VSFS_INODE_INLINE) st->st_blocks=0;
+    else if(in->flags & VSFS_INODE_COMPRESSED) st->st_blocks=(blkcnt_t)(((uint64_t)in->stored_blocks+in->aux_len)*(BS/512));
+    else st->st_blocks=(blkcnt_t)(((in->size_bytes+BS-1)/BS)*(BS/512));
+    st->st_atime=(time_t)in->atime; st->st_mtime=(time_t)in->mtime; st->st_ctime=(time_t)in->ctime;
+}
+
+static int vf_getattr(const char *path, struct stat *st, struct fuse_file_info *fi){
+    uint32_t ino; inode_t in;
+    if(fi && fi->fh){
+        ino=(uint32_t)fi->fh;
+        pthread_mutex_lock(&g.lock);
+        int rc=get_inode(ino,&in);
+        pthread_mutex_unlock(&g.lock);
+        if(rc) return rc;
+    } else {
+        int rc=resolve(path,&ino,&in);
+        if(rc) return rc;
+    }
+    fill_stat(ino,&in,st);
+    return 0;
+}
+
+static int vf_open(const char *path, struct fuse_file_info *fi){
+    if((fi->flags & O_ACCMODE)!=O_RDONLY) return -EROFS;
+    uint32_t ino; inode_t in;
+    int rc=resolve(path,&ino,&in);
+    if(rc) return rc;
+    if(in.mode & VSFS_MODE_DIR) return -EISDIR;
+    fi->fh=ino;
+    fi->keep_cache=1;
+    return 0;
+}
+
+static int vf_opendir(const char *path, struct fuse_file_info *fi){
+    uint32_t ino; inode_t in;
+    int rc=resolve(path,&ino,&in);
+    if(rc) return rc;
+    if(!(in.mode & VSFS_MODE_DIR)) return -ENOTDIR;
+    fi->fh=ino;
+    return 0;
+}
+
+// Decodes every cluster the range touches (the kernel page cache keeps the result).
+static int read_compressed(const inode_t *in, char *buf, size_t size, uint64_t off){
+    const uint64_t cl=vsfs_cluster_bytes(&g.fs);
+    uint8_t *tmp=malloc((size_t)cl);
+    if(!tmp) return -ENOMEM;
+    size_t done=0;
+    while(done<size){
+        uint64_t pos=off+done;
+        if(vsfs_read_cluster(&g.fs,in,pos/cl,tmp)!=0){ free(tmp); return -EIO; }
+        size_t n=(size_t)(cl - pos%cl);
+        if(n>size-done) n=size-done;
+        memcpy(buf+done,tmp+pos%cl,n);
+        done+=n;
+    }
+    free(tmp);
+    return (int)done;
+}
+
+static int vf_read(const char *path, char *buf, size_t size, off_t off, struct fuse_file_info *fi){
+    (void)path;
+    inode_t in;
+    pthread_mutex_lock(&g.lock);
+    int rc=get_inode((uint32_t)fi->fh,&in);
+    pthread_mutex_unlock(&g.lock);
+    if(rc) return rc;
+    if(off<0) return -EINVAL;
+    if((uint64_t)off >= in.size_bytes) return 0;
+    if(size > in.size_bytes-(uint64_t)off) size=(size_t)(in.size_bytes-(uint64_t)off);
+    if(in.flags & VSFS_INODE_INLINE){ memcpy(buf,vsfs_inline_data(&in)+off,size); return (int)size; }
+    if(in.flags & VSFS_INODE_COMPRESSED) return read_compressed(&in,buf,size,(uint64_t)off);
+    // block lookups only read the (immutable) mapping, so no lock is needed
+    size_t done=0;
+    while(done<size){
+        uint64_t pos=(uint64_t)off+done;
+        uint32_t rel;
+        if(vsfs_bmap(&g.fs,&in,pos/BS,&rel)!=0) return -EIO;
+        size_t n=BS - (size_t)(pos%BS);
+        if(n>size-done) n=size-done;
+        memcpy(buf+done,vsfs_data_block(&g.fs,rel)+pos%BS,n);
+        done+=n;
+    }
+    return (int)done;
+}
+
+static int vf_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t off,
+                      struct fuse_file_info *fi, enum fuse_readdir_flags flags){
+    (void)path; (void)off; (void)flags;
+    inode_t dir;
+    int rc=0;
+    pthread_mutex_lock(&g.lock);
+    if((rc=get_inode((uint32_t)fi->fh,&dir))!=0) goto out;
+    const uint64_t nblocks=(dir.size_bytes+BS-1)/BS;
+    for(uint64_t b=0;b<nblocks;b++){
+        uint32_t rel;
+        const dirent64_t *de;
+        if(vsfs_bmap(&g.fs,&dir,b,&rel)!=0 || !(de=get_dirblock(rel))){ rc=-EIO; goto out; }
+        for(size_t i=0;i<DIRENTS_PER_BLOCK;i++){
+            if(!de[i].inode_no) continue;
+            char name[MAX_FILENAME+1];
+            memcpy(name,de[i].name,MAX_FILENAME); name[MAX_FILENAME]='\0';
+            if(filler(buf,name,NULL,0,0)!=0) goto out;
+        }
+    }
+out:
+    pthread_mutex_unlock(&g.lock);
+    return rc;
+}
+
+static int vf_statfs(const char *path, struct statvfs *sv){
+    (void)path;
+    memset(sv,0,sizeof(*sv));
+    sv->f_bsize=sv->f_frsize=BS;
+    sv->f_blocks=g.fs.sb.data_region_blocks;
+    sv->f_bfree=sv->f_bavail=g.fs.sbx.free_blocks;
+    sv->f_files=g.fs.sb.inode_count;
+    sv->f_ffree=sv->f_favail=g.fs.sbx.free_inodes;
+    sv->f_namemax=MAX_FILENAME-1;
+    sv->f_flag=ST_RDONLY;
+    return 0;
+}
+
+static void vf_destroy(void *priv){
+    (void)priv;
+    fprintf(stderr,"vsfs_fuse: inode cache %llu hits / %llu misses, dir block cache %llu hits / %llu misses\n",
+            (unsigned long long)g.inodes.hits,(unsigned long long)g.inodes.misses,
+            (unsigned long long)g.dirblocks.hits,(unsigned long long)g.dirblocks.misses);
+}
+
+static const struct fuse_operations vf_ops = {
+    .init     = vf_init,
+    .destroy  = vf_destroy,
+    .getattr  = vf_getattr,
+    .open     = vf_open,
+    .read     = vf_read,
+    .opendir  = vf_opendir,
+    .readdir  = vf_readdir,
+    .statfs   = vf_statfs,
+};
+
+// ========================== Main ==========================
+typedef struct {
+    const char *image;
+    unsigned cache_inodes, cache_blocks;
+} vf_conf_t;
+static vf_conf_t conf = { NULL, DEFAULT_CACHE_INODES, DEFAULT_CACHE_BLOCKS };
+
+static const struct fuse_opt vf_opts[] = {
+    { "--cache-inodes=%u", offsetof(vf_conf_t, cache_inodes), 0 },
+    { "--cache-blocks=%u", offsetof(vf_conf_t, cache_blocks), 0 },
+    FUSE_OPT_END
+};
+
+// the first non-option argument is the image, the rest goes to FUSE
+static int opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs){
+    (void)data; (void)outargs;
+    if(key==FUSE_OPT_KEY_NONOPT && !conf.image){ conf.image=arg; return 0; }
+    return 1;
+}
+
+int main(int argc, char **argv){
+    crc32_init();
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    if(fuse_opt_parse(&args,&conf,vf_opts,opt_proc)!=0) return EXIT_FAILURE;
+    if(!conf.image){
+        fprintf(stderr,"Usage: %s [--cache-inodes=N] [--cache-blocks=N] image.img mountpoint [FUSE options]\n",argv[0]);
+        fuse_opt_free_args(&args);
+        return EXIT_FAILURE;
+    }
+
+    if(vsfs_open(&g.fs,conf.image,VSFS_OPEN_RDONLY)!=0){
+        fprintf(stderr,"%s\n",vsfs_last_error()); fuse_opt_free_args(&args); return EXIT_FAILURE;
+    }
+    if(lru_init(&g.inodes,conf.cache_inodes,sizeof(inode_t))!=0 ||
+       lru_init(&g.dirblocks,conf.cache_blocks,BS)!=0){
+        perror("cache"); vsfs_close(&g.fs); fuse_opt_free_args(&args); return EXIT_FAILURE;
+    }
+
+    fuse_opt_add_arg(&args,"-oro");
+    fuse_opt_add_arg(&args,"-osubtype=vsfs");
+    int rc=fuse_main(args.argc,args.argv,&vf_ops,NULL);
+
+    lru_free(&g.inodes); lru_free(&g.dirblocks);
+    vsfs_close(&g.fs);
+    fuse_opt_free_args(&args);
+    return rc;
+}
@@ -0,0 +1,64 @@
+// vsfs_resize.c - grow or shrink a MiniVSFS image in place
+// Build: gcc -O2 -std=c17 -Wall -Wextra -pthread vsfs_resize.c minivsfs.c crc32.c lz4.c -o vsfs_resize
+//
+// Moves the end of the data region: --size-kib sets the new size, --shrink
+// cuts the image down to the last data block in use (run vsfs_defrag first to
+// pack the files at the start). Only metadata is written, never file data.
+#define _FILE_OFFSET_BITS 64
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include "minivsfs.h"
+
+#define MAX_SIZE_KIB   (4ull * UINT32_MAX)
+
+static int parse_u64(const char* s, uint64_t* out){
+    char* end=NULL; errno=0;
+    unsigned long long v = strtoull(s,&end,10);
+    if(errno!=0 || end==s || *end!='\0') return -1;
+    *out = (uint64_t)v; return 0;
+}
+
+int main(int argc, char **argv){
+    crc32_init();
+
+    const char *image=NULL;
+    uint64_t size_kib=0;
+    int shrink=0;
+    for(int i=1;i<argc;i++){
+        if(strcmp(argv[i],"--image")==0 && i+1<argc) image=argv[++i];
+        else if(strcmp(argv[i],"--size-kib")==0 && i+1<argc){
+            if(parse_u64(argv[++i],&size_kib)!=0 || size_kib==0 || size_kib%4 || size_kib>MAX_SIZE_KIB){
+                fprintf(stderr,"--size-kib must be a multiple of 4 up to %llu\n",MAX_SIZE_KIB); return EXIT_FAILURE;
+            }
+        }
+        else if(strcmp(argv[i],"--shrink")==0) shrink=1;
+        else { fprintf(stderr,"Unknown parameter %s\n",argv[i]); return EXIT_FAILURE; }
+    }
+    if(!image || (!size_kib == !shrink)){
+        fprintf(stderr,"Usage: %s --image fs.img (--size-kib N | --shrink)\n",argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    vsfs_t fs;
+    if(vsfs_open(&fs,image,VSFS_OPEN_INPLACE)!=0){ fprintf(stderr,"%s\n",vsfs_last_error()); return EXIT_FAILURE; }
+    const uint64_t old_total = fs.sb.total_blocks, old_bitmap = fs.sb.data_bitmap_start;
+    const uint64_t old_crc = fs.sbx.crc_table_start, old_ref = fs.sbx.ref_table_start;
+    const uint64_t total = shrink ? vsfs_min_total_blocks(&fs) : size_kib*1024/BS;
+    if(vsfs_resize(&fs,total)!=0){ fprintf(stderr,"%s\n",vsfs_last_error()); vsfs_close(&fs); return EXIT_FAILURE; }
+
+    printf("Resized '%s': %" PRIu64 " -> %" PRIu64 " blocks (%" PRIu64 " KiB), %" PRIu64 " data blocks\n",
+           image,old_total,fs.sb.total_blocks,fs.sb.total_blocks*BS/1024,(uint64_t)fs.sb.data_region_blocks);
+    if(fs.sb.data_bitmap_start!=old_bitmap)
+        printf("  data bitmap moved to block %" PRIu64 "\n",(uint64_t)fs.sb.data_bitmap_start);
+    if(fs.sbx.crc_table_blocks && fs.sbx.crc_table_start!=old_crc)
+        printf("  crc table moved to block %" PRIu64 "\n",fs.sbx.crc_table_start);
+    if(fs.sbx.ref_table_blocks && fs.sbx.ref_table_start!=old_ref)
+        printf("  refcount table moved to block %" PRIu64 "\n",fs.sbx.ref_table_start);
+    vsfs_close(&fs);
+    return EXIT_SUCCESS;
+}